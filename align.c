@@ -0,0 +1,476 @@
+/*	$Id$ */
+
+/*
+   D. S. Hirschberg, "A linear space algorithm for computing maximal
+   common subsequences", Communications of the ACM, 18, 6, 341-343,
+   1975.
+
+   alignments: not just how far apart two inputs are, but which edits
+   turn one into the other. keeping the whole matrix for a traceback
+   takes len1 * len2 cells, far too much for inputs of a megabyte, so
+   the rows are split in half instead: one pass scores the top half
+   forwards, one scores the bottom half backwards, and the column where
+   the two meet best is a point the optimal path goes through. the two
+   quarters of the matrix on either side of it are solved the same way
+   until they are small enough for a plain traceback. memory stays
+   linear in the inputs and the time is about twice a single pass.
+
+   for the levenshtein distance the passes run on the bit-parallel
+   kernel of myers.c, and common prefixes and suffixes are matched off
+   first since the typical pair of payloads differs in a few places
+   only. the two passes of a split, and the two halves after it, can
+   run on separate threads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+/* subproblems up to this many cells get a full traceback */
+#define ALIGN_BASE_CELLS	16384
+/* and below this many the halves are not worth a thread */
+#define ALIGN_THREAD_CELLS	(1 << 20)
+
+struct align {
+	const unsigned char *s;
+	const unsigned char *t;
+	const unsigned char *rs;	/* s reversed, levenshtein only */
+	const unsigned char *rt;
+	size_t		 n;
+	size_t		 m;
+	struct matrix	*mt;		/* NULL for unit costs */
+};
+
+/* the matrix has 255 entries per side, larger bytes share the last */
+#define ALIGN_IDX(c)	((c) > 254 ? 254 : (c))
+
+/*
+   the cost of the gap edges into cell (i, j), deleting s[i - 1] or
+   inserting t[j - 1]. as in needleman_wunsch_d() the cost depends on
+   the pair of bytes at the cell, on the first row and column that of
+   the first byte.
+ */
+static __inline double
+align_gap(const struct align *al, size_t i, size_t j)
+{
+	unsigned char   a, b;
+
+	if (al->mt == NULL)
+		return (1);
+	a = al->n == 0 ? 0 : al->s[(i > 0 ? i : 1) - 1];
+	b = al->m == 0 ? 0 : al->t[(j > 0 ? j : 1) - 1];
+	return (al->mt->insertion[ALIGN_IDX(a)][ALIGN_IDX(b)]);
+}
+
+/* the cost of the diagonal edge into cell (i, j) */
+static __inline double
+align_sub(const struct align *al, size_t i, size_t j)
+{
+	unsigned char   a = al->s[i - 1], b = al->t[j - 1];
+
+	if (a == b)
+		return (0);
+	if (al->mt == NULL)
+		return (1);
+	return (al->mt->conversion[ALIGN_IDX(a)][ALIGN_IDX(b)]);
+}
+
+/* appends len ops, merging with the last run */
+static int
+script_add(struct distance_script *sc, int op, size_t len)
+{
+	struct distance_edit_run *r;
+	size_t          na;
+
+	if (len == 0)
+		return (0);
+	if (sc->nruns > 0 && sc->runs[sc->nruns - 1].op == op) {
+		sc->runs[sc->nruns - 1].len += len;
+		return (0);
+	}
+	if (sc->nruns == sc->nalloc) {
+		na = sc->nalloc ? 2 * sc->nalloc : 16;
+		if ((r = realloc(sc->runs, na * sizeof(*r))) == NULL)
+			return (-1);
+		STATS_ADD(allocs, 1);
+		sc->runs = r;
+		sc->nalloc = na;
+	}
+	sc->runs[sc->nruns].op = op;
+	sc->runs[sc->nruns].len = len;
+	sc->nruns++;
+	return (0);
+}
+
+static int
+script_cat(struct distance_script *sc, const struct distance_script *more)
+{
+	size_t          i;
+
+	for (i = 0; i < more->nruns; i++)
+		if (script_add(sc, more->runs[i].op, more->runs[i].len) == -1)
+			return (-1);
+	return (0);
+}
+
+void
+distance_script_free(struct distance_script *sc)
+{
+	free(sc->runs);
+	memset(sc, 0, sizeof(*sc));
+}
+
+/* full matrix and traceback for a small block, returns its cost */
+static double
+align_base(const struct align *al, size_t i0, size_t i1, size_t j0,
+    size_t j1, struct distance_script *sc, int *err)
+{
+	size_t          n = i1 - i0, m = j1 - j0, w = m + 1, i, j, k, nops;
+	double         *d, cost;
+	char           *ops;
+
+#define D(i, j)	d[(i) * w + (j)]
+	d = malloc((n + 1) * w * sizeof(double));
+	ops = malloc(n + m + 1);
+	if (d == NULL || ops == NULL) {
+		free(d);
+		free(ops);
+		*err = 1;
+		return (0);
+	}
+	STATS_ADD(allocs, 2);
+
+	D(0, 0) = 0;
+	for (j = 1; j <= m; j++)
+		D(0, j) = D(0, j - 1) + align_gap(al, i0, j0 + j);
+	for (i = 1; i <= n; i++) {
+		D(i, 0) = D(i - 1, 0) + align_gap(al, i0 + i, j0);
+		for (j = 1; j <= m; j++)
+			D(i, j) = min(D(i - 1, j - 1) +
+			    align_sub(al, i0 + i, j0 + j),
+			    min(D(i - 1, j), D(i, j - 1)) +
+			    align_gap(al, i0 + i, j0 + j));
+	}
+	cost = D(n, m);
+
+	/* walk back from the corner, preferring the diagonal */
+	for (i = n, j = m, nops = 0; i > 0 || j > 0; ) {
+		if (i > 0 && j > 0 && D(i, j) == D(i - 1, j - 1) +
+		    align_sub(al, i0 + i, j0 + j)) {
+			ops[nops++] = al->s[i0 + i - 1] == al->t[j0 + j - 1] ?
+			    DISTANCE_EDIT_MATCH : DISTANCE_EDIT_SUB;
+			i--;
+			j--;
+		} else if (i > 0 && (j == 0 || D(i, j) == D(i - 1, j) +
+		    align_gap(al, i0 + i, j0 + j))) {
+			ops[nops++] = DISTANCE_EDIT_DEL;
+			i--;
+		} else {
+			ops[nops++] = DISTANCE_EDIT_INS;
+			j--;
+		}
+	}
+	for (k = nops; k > 0; k--)
+		if (script_add(sc, ops[k - 1], 1) == -1)
+			*err = 1;
+#undef D
+
+	free(d);
+	free(ops);
+	return (cost);
+}
+
+/* one of the two scoring passes of a split */
+struct align_pass {
+	const struct align *al;
+	size_t		 i0, i1, j0, j1;
+	int		 backward;
+	double		*row;		/* j1 - j0 + 1 entries */
+	int		 err;
+};
+
+/*
+   forward: row[j - j0] is the cost from (i0, j0) to (i1, j). backward:
+   the cost from (i0, j) to (i1, j1). for unit costs the rows come from
+   the bit-parallel kernel, run on the reversed inputs going backward.
+ */
+static void
+align_score(struct align_pass *ap)
+{
+	const struct align *al = ap->al;
+	struct myers_peq peq;
+	size_t          i, j, m = ap->j1 - ap->j0, *row;
+	double          diag, up;
+
+	if (al->mt == NULL) {
+		if ((row = malloc((m + 1) * sizeof(size_t))) == NULL) {
+			ap->err = 1;
+			return;
+		}
+		STATS_ADD(allocs, 1);
+		if (!ap->backward) {
+			if (myers_peq_init(&peq, al->s + ap->i0,
+			    ap->i1 - ap->i0, 1) == -1) {
+				free(row);
+				ap->err = 1;
+				return;
+			}
+			if (myers_row(&peq, al->t + ap->j0, m, row) == -1)
+				ap->err = 1;
+			for (j = 0; j <= m; j++)
+				ap->row[j] = row[j];
+		} else {
+			if (myers_peq_init(&peq, al->rs + al->n - ap->i1,
+			    ap->i1 - ap->i0, 1) == -1) {
+				free(row);
+				ap->err = 1;
+				return;
+			}
+			if (myers_row(&peq, al->rt + al->m - ap->j1, m,
+			    row) == -1)
+				ap->err = 1;
+			for (j = 0; j <= m; j++)
+				ap->row[j] = row[m - j];
+		}
+		myers_peq_free(&peq);
+		free(row);
+		return;
+	}
+
+	if (!ap->backward) {
+		ap->row[0] = 0;
+		for (j = 1; j <= m; j++)
+			ap->row[j] = ap->row[j - 1] +
+			    align_gap(al, ap->i0, ap->j0 + j);
+		for (i = ap->i0 + 1; i <= ap->i1; i++) {
+			diag = ap->row[0];
+			ap->row[0] += align_gap(al, i, ap->j0);
+			for (j = 1; j <= m; j++) {
+				up = ap->row[j];
+				ap->row[j] = min(diag +
+				    align_sub(al, i, ap->j0 + j),
+				    min(up, ap->row[j - 1]) +
+				    align_gap(al, i, ap->j0 + j));
+				diag = up;
+			}
+		}
+	} else {
+		ap->row[m] = 0;
+		for (j = m; j > 0; j--)
+			ap->row[j - 1] = ap->row[j] +
+			    align_gap(al, ap->i1, ap->j0 + j);
+		for (i = ap->i1; i > ap->i0; i--) {
+			/* row i - 1 from row i */
+			diag = ap->row[m];
+			ap->row[m] += align_gap(al, i, ap->j1);
+			for (j = m; j > 0; j--) {
+				up = ap->row[j - 1];
+				ap->row[j - 1] = min(diag +
+				    align_sub(al, i, ap->j0 + j),
+				    up + align_gap(al, i, ap->j0 + j - 1));
+				ap->row[j - 1] = min(ap->row[j - 1],
+				    ap->row[j] + align_gap(al, i - 1,
+				    ap->j0 + j));
+				diag = up;
+			}
+		}
+	}
+}
+
+static void
+align_score_work(size_t lo, size_t hi, void *p)
+{
+	struct align_pass *ap = p;
+	size_t          k;
+
+	for (k = lo; k < hi; k++)
+		align_score(&ap[k]);
+}
+
+static double	align_rec(const struct align *, size_t, size_t, size_t,
+    size_t, struct distance_script *, int, int *);
+
+/* one of the two halves after a split */
+struct align_half {
+	const struct align *al;
+	size_t		 i0, i1, j0, j1;
+	struct distance_script sc;
+	int		 nthreads;
+	int		 err;
+	double		 cost;
+};
+
+static void
+align_half_work(size_t lo, size_t hi, void *p)
+{
+	struct align_half *ah = p;
+	size_t          k;
+
+	for (k = lo; k < hi; k++)
+		ah[k].cost = align_rec(ah[k].al, ah[k].i0, ah[k].i1, ah[k].j0,
+		    ah[k].j1, &ah[k].sc, ah[k].nthreads, &ah[k].err);
+}
+
+static double
+align_rec(const struct align *al, size_t i0, size_t i1, size_t j0, size_t j1,
+    struct distance_script *sc, int nthreads, int *err)
+{
+	struct align_pass ap[2];
+	struct align_half ah[2];
+	size_t          mid, j, best, m = j1 - j0;
+	double         *rows, cost;
+	int             k, par;
+
+	if (i1 - i0 <= 1 || (i1 - i0) * (m + 1) <= ALIGN_BASE_CELLS)
+		return (align_base(al, i0, i1, j0, j1, sc, err));
+
+	if ((rows = malloc(2 * (m + 1) * sizeof(double))) == NULL) {
+		*err = 1;
+		return (0);
+	}
+	STATS_ADD(allocs, 1);
+	mid = i0 + (i1 - i0) / 2;
+	par = nthreads > 1 && (i1 - i0) * m >= ALIGN_THREAD_CELLS;
+	for (k = 0; k < 2; k++) {
+		memset(&ap[k], 0, sizeof(ap[k]));
+		ap[k].al = al;
+		ap[k].i0 = k == 0 ? i0 : mid;
+		ap[k].i1 = k == 0 ? mid : i1;
+		ap[k].j0 = j0;
+		ap[k].j1 = j1;
+		ap[k].backward = k;
+		ap[k].row = rows + k * (m + 1);
+	}
+	distance_parallel_for(2, par ? 2 : 1, align_score_work, ap);
+	if (ap[0].err || ap[1].err) {
+		free(rows);
+		*err = 1;
+		return (0);
+	}
+	for (best = 0, j = 1; j <= m; j++)
+		if (ap[0].row[j] + ap[1].row[j] <
+		    ap[0].row[best] + ap[1].row[best])
+			best = j;
+	cost = ap[0].row[best] + ap[1].row[best];
+	free(rows);
+
+	for (k = 0; k < 2; k++) {
+		memset(&ah[k], 0, sizeof(ah[k]));
+		ah[k].al = al;
+		ah[k].i0 = k == 0 ? i0 : mid;
+		ah[k].i1 = k == 0 ? mid : i1;
+		ah[k].j0 = k == 0 ? j0 : j0 + best;
+		ah[k].j1 = k == 0 ? j0 + best : j1;
+		ah[k].nthreads = par ? (nthreads + 1 - k) / 2 : 1;
+	}
+	if (par) {
+		distance_parallel_for(2, 2, align_half_work, ah);
+		for (k = 0; k < 2; k++) {
+			if (ah[k].err || script_cat(sc, &ah[k].sc) == -1)
+				*err = 1;
+			distance_script_free(&ah[k].sc);
+		}
+	} else
+		for (k = 0; k < 2; k++)
+			align_rec(al, ah[k].i0, ah[k].i1, ah[k].j0, ah[k].j1,
+			    sc, 1, err);
+	return (cost);
+}
+
+static int
+align_run(struct align *al, struct distance_script *sc, int nthreads)
+{
+	int             err = 0;
+
+	if (nthreads <= 0)
+		nthreads = distance_pool_size();
+	sc->cost = align_rec(al, 0, al->n, 0, al->m, sc, nthreads, &err);
+	if (err || distance_cancelled()) {
+		distance_script_free(sc);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+   the edits that turn d1 into d2 with the fewest operations. sc is
+   filled with runs of the same operation, its cost is the levenshtein
+   distance. returns 0, or -1 if out of memory.
+ */
+int
+levenshtein_align(const void *d1, size_t len1, const void *d2, size_t len2,
+    struct distance_script *sc, int nthreads)
+{
+	const unsigned char *s = d1, *t = d2;
+	unsigned char  *rev;
+	struct align    al;
+	size_t          pre, suf, i;
+	int             ret;
+
+	memset(sc, 0, sizeof(*sc));
+	STATS_CALL(DISTANCE_LEVENSHTEIN, len1, len2,
+	    (unsigned long long) len1 * len2, DISTANCE_KERNEL_BITPARALLEL);
+
+	/* a common prefix and suffix are always part of an optimum */
+	for (pre = 0; pre < len1 && pre < len2 && s[pre] == t[pre]; pre++)
+		;
+	for (suf = 0; suf < len1 - pre && suf < len2 - pre &&
+	    s[len1 - suf - 1] == t[len2 - suf - 1]; suf++)
+		;
+	if (script_add(sc, DISTANCE_EDIT_MATCH, pre) == -1)
+		goto fail;
+
+	memset(&al, 0, sizeof(al));
+	al.s = s + pre;
+	al.t = t + pre;
+	al.n = len1 - pre - suf;
+	al.m = len2 - pre - suf;
+	if ((rev = malloc(al.n + al.m + 1)) == NULL)
+		goto fail;
+	STATS_ADD(allocs, 1);
+	for (i = 0; i < al.n; i++)
+		rev[i] = al.s[al.n - i - 1];
+	for (i = 0; i < al.m; i++)
+		rev[al.n + i] = al.t[al.m - i - 1];
+	al.rs = rev;
+	al.rt = rev + al.n;
+	ret = align_run(&al, sc, nthreads);
+	free(rev);
+	if (ret == -1)
+		return (-1);
+
+	if (script_add(sc, DISTANCE_EDIT_MATCH, suf) == -1)
+		goto fail;
+	return (0);
+
+fail:
+	distance_script_free(sc);
+	return (-1);
+}
+
+/*
+   the cheapest edits that turn d1 into d2 under the costs in mt, see
+   distance.3 for how they are charged. returns 0, or -1 if out of
+   memory.
+ */
+int
+needleman_wunsch_align(const void *d1, size_t len1, const void *d2,
+    size_t len2, struct matrix *mt, struct distance_script *sc, int nthreads)
+{
+	struct align    al;
+
+	memset(sc, 0, sizeof(*sc));
+	if (mt == NULL)
+		return (-1);
+	STATS_CALL(DISTANCE_NEEDLEMAN_WUNSCH, len1, len2,
+	    (unsigned long long) len1 * len2, DISTANCE_KERNEL_FULL);
+	memset(&al, 0, sizeof(al));
+	al.s = d1;
+	al.t = d2;
+	al.n = len1;
+	al.m = len2;
+	al.mt = mt;
+	return (align_run(&al, sc, nthreads));
+}
@@ -0,0 +1,325 @@
+/*	$Id$ */
+
+/*
+   batches that run in the background, for callers that must not block,
+   such as an event loop. a submit hands the batch to a thread of the
+   pool (pool.c), or to the executor if one is set, and returns a handle
+   straight away. the batch then takes part in the work on the pool as
+   any caller would, so many batches in flight share the pool's threads
+   rather than each adding one, and wait their turn when all of them
+   are busy. the results go to the caller's buffer, which must stay in
+   place until the batch is done.
+
+   a finished batch calls the callback, if there is one, on the thread
+   that ran it, and then makes its file descriptor readable: an
+   eventfd on Linux, the read end of a pipe elsewhere. the descriptor can go into
+   poll(), select() or an event library next to the caller's sockets.
+
+   the handle is shared by the caller and the batch's thread, and is
+   freed by whichever lets go of it last, so distance_async_free() may
+   be called from the callback. a batch freed before it has started is
+   dropped when it does, without waiting for a thread to get to it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "distance.h"
+#include "distance_int.h"
+
+enum {
+	ASYNC_CDIST,
+	ASYNC_PDIST
+};
+
+enum {
+	ASYNC_QUEUED,
+	ASYNC_RUNNING,
+	ASYNC_DROPPED			/* freed before it started */
+};
+
+struct distance_async {
+	int		 kind;
+	distance_fn	 f;
+	void		*arg;
+	const void	*q;		/* for distance_async_many() */
+	size_t		 qlen;
+	const void * const *a;
+	const size_t	*alen;
+	size_t		 na;
+	const void * const *b;
+	const size_t	*blen;
+	size_t		 nb;
+	double		*out;
+	int		 nthreads;
+	distance_async_fn cb;
+	void		*cbarg;
+
+	volatile int	 cancel;
+	struct distance_task task;
+	pthread_t	 tid;		/* the batch's thread, once running */
+	int		 fd[2];		/* [0] is polled, [1] written */
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cv;
+	int		 state;		/* under lock */
+	int		 done;		/* under lock */
+	int		 status;
+	int		 refs;		/* under lock */
+};
+
+static void
+async_release(struct distance_async *da)
+{
+	int             refs;
+
+	pthread_mutex_lock(&da->lock);
+	refs = --da->refs;
+	pthread_mutex_unlock(&da->lock);
+	if (refs > 0)
+		return;
+	close(da->fd[0]);
+	if (da->fd[1] != da->fd[0])
+		close(da->fd[1]);
+	pthread_mutex_destroy(&da->lock);
+	pthread_cond_destroy(&da->cv);
+	free(da);
+}
+
+static void
+async_run(void *p)
+{
+	struct distance_async *da = p;
+	uint64_t        one = 1;
+	int             status;
+
+	pthread_mutex_lock(&da->lock);
+	if (da->state == ASYNC_DROPPED) {
+		pthread_mutex_unlock(&da->lock);
+		async_release(da);
+		return;
+	}
+	da->state = ASYNC_RUNNING;
+	da->tid = pthread_self();
+	pthread_mutex_unlock(&da->lock);
+
+	distance_cancel(&da->cancel);
+	if (da->kind == ASYNC_PDIST)
+		status = distance_pdist(da->f, da->arg, da->a, da->alen,
+		    da->na, da->out, da->nthreads);
+	else
+		status = distance_cdist(da->f, da->arg, da->a, da->alen,
+		    da->na, da->b, da->blen, da->nb, da->out, da->nthreads);
+	distance_cancel(NULL);
+
+	/* the callback comes first, so a wait returns after it */
+	if (da->cb != NULL)
+		da->cb(da, status, da->cbarg);
+	pthread_mutex_lock(&da->lock);
+	da->status = status;
+	da->done = 1;
+	pthread_cond_broadcast(&da->cv);
+	pthread_mutex_unlock(&da->lock);
+	/* an eventfd takes 8 bytes, a pipe 1 of them will do */
+	while (write(da->fd[1], &one, da->fd[1] == da->fd[0] ?
+	    sizeof(one) : 1) == -1 && errno == EINTR)
+		;
+	async_release(da);
+}
+
+static struct distance_async *
+async_new(int kind, distance_fn f, void *arg, double *out, int nthreads,
+    distance_async_fn cb, void *cbarg)
+{
+	struct distance_async *da;
+
+	if (f == NULL || out == NULL)
+		return (NULL);
+	if ((da = calloc(1, sizeof(*da))) == NULL)
+		return (NULL);
+	STATS_ADD(allocs, 1);
+	da->kind = kind;
+	da->f = f;
+	da->arg = arg;
+	da->out = out;
+	da->nthreads = nthreads;
+	da->cb = cb;
+	da->cbarg = cbarg;
+#ifdef __linux__
+	if ((da->fd[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+		free(da);
+		return (NULL);
+	}
+	da->fd[1] = da->fd[0];
+#else
+	if (pipe(da->fd) == -1) {
+		free(da);
+		return (NULL);
+	}
+	fcntl(da->fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(da->fd[1], F_SETFD, FD_CLOEXEC);
+	fcntl(da->fd[0], F_SETFL, O_NONBLOCK);
+#endif
+	pthread_mutex_init(&da->lock, NULL);
+	pthread_cond_init(&da->cv, NULL);
+	return (da);
+}
+
+static struct distance_async *
+async_start(struct distance_async *da)
+{
+	/* one reference for the caller, one for the batch's thread */
+	da->refs = 2;
+	da->task.fn = async_run;
+	da->task.arg = da;
+	if (distance_pool_submit(&da->task) == -1) {
+		da->refs = 1;
+		async_release(da);
+		return (NULL);
+	}
+	return (da);
+}
+
+/*
+   starts distance_cdist() in the background and returns its handle, or
+   NULL if out of memory or on bad arguments. the inputs and out must
+   stay in place until it is done. cb, if not NULL, is called with the
+   handle, the return value of distance_cdist() and cbarg when it is.
+ */
+struct distance_async *
+distance_async_cdist(distance_fn f, void *arg, const void * const *a,
+    const size_t *alen, size_t na, const void * const *b, const size_t *blen,
+    size_t nb, double *out, int nthreads, distance_async_fn cb, void *cbarg)
+{
+	struct distance_async *da;
+
+	if ((da = async_new(ASYNC_CDIST, f, arg, out, nthreads, cb,
+	    cbarg)) == NULL)
+		return (NULL);
+	da->a = a;
+	da->alen = alen;
+	da->na = na;
+	da->b = b;
+	da->blen = blen;
+	da->nb = nb;
+	return (async_start(da));
+}
+
+/* distance_many() in the background, as distance_async_cdist() */
+struct distance_async *
+distance_async_many(distance_fn f, void *arg, const void *q, size_t qlen,
+    const void * const *b, const size_t *blen, size_t nb, double *out,
+    int nthreads, distance_async_fn cb, void *cbarg)
+{
+	struct distance_async *da;
+
+	if ((da = async_new(ASYNC_CDIST, f, arg, out, nthreads, cb,
+	    cbarg)) == NULL)
+		return (NULL);
+	da->q = q;
+	da->qlen = qlen;
+	da->a = (const void * const *) &da->q;
+	da->alen = &da->qlen;
+	da->na = 1;
+	da->b = b;
+	da->blen = blen;
+	da->nb = nb;
+	return (async_start(da));
+}
+
+/* distance_pdist() in the background, as distance_async_cdist() */
+struct distance_async *
+distance_async_pdist(distance_fn f, void *arg, const void * const *a,
+    const size_t *alen, size_t n, double *out, int nthreads,
+    distance_async_fn cb, void *cbarg)
+{
+	struct distance_async *da;
+
+	if ((da = async_new(ASYNC_PDIST, f, arg, out, nthreads, cb,
+	    cbarg)) == NULL)
+		return (NULL);
+	da->a = a;
+	da->alen = alen;
+	da->na = n;
+	return (async_start(da));
+}
+
+/* a descriptor that turns readable when the batch is done */
+int
+distance_async_fd(const struct distance_async *da)
+{
+	return (da->fd[0]);
+}
+
+/* returns 1 if the batch is done, 0 if it is still running */
+int
+distance_async_done(struct distance_async *da)
+{
+	int             done;
+
+	pthread_mutex_lock(&da->lock);
+	done = da->done;
+	pthread_mutex_unlock(&da->lock);
+	return (done);
+}
+
+/*
+   waits for the batch to be done and returns what the batch function
+   returned: 0, or -1 if it failed or was cancelled. this returns after
+   the callback, so must not be called from it.
+ */
+int
+distance_async_wait(struct distance_async *da)
+{
+	int             status;
+
+	pthread_mutex_lock(&da->lock);
+	while (!da->done)
+		pthread_cond_wait(&da->cv, &da->lock);
+	status = da->status;
+	pthread_mutex_unlock(&da->lock);
+	return (status);
+}
+
+/*
+   asks the batch to stop. it is done soon after, with the results it
+   had not got to left unset and a status of -1.
+ */
+void
+distance_async_cancel(struct distance_async *da)
+{
+	__atomic_store_n(&da->cancel, 1, __ATOMIC_RELAXED);
+}
+
+/*
+   lets go of the handle. a batch that is not done is cancelled and
+   waited for, the caller's buffers are not used once this returns.
+ */
+void
+distance_async_free(struct distance_async *da)
+{
+	int             nowait;
+
+	if (da == NULL)
+		return;
+	/*
+	   from the callback the batch is over, bar the signalling, and one
+	   that has not started never will
+	 */
+	pthread_mutex_lock(&da->lock);
+	if (da->state == ASYNC_QUEUED)
+		da->state = ASYNC_DROPPED;
+	nowait = da->state == ASYNC_DROPPED ||
+	    pthread_equal(pthread_self(), da->tid);
+	pthread_mutex_unlock(&da->lock);
+	if (!nowait) {
+		distance_async_cancel(da);
+		distance_async_wait(da);
+	}
+	async_release(da);
+}
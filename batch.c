@@ -0,0 +1,320 @@
+/*	$Id$ */
+
+/*
+   batch interfaces: run one metric over many pairs of inputs in a
+   single call. the pairwise functions in distance.h all have slightly
+   different signatures, so each gets a small wrapper with the common
+   distance_fn signature (the extra argument carries the power for
+   minkowski_d and the cost matrix for needleman_wunsch_d).
+
+   the work is split across threads with distance_parallel_for_cost(),
+   every output slot is written by exactly one thread so no locking is
+   needed. the cost of a pair is taken to be the product of the
+   lengths, which is what the edit distances take.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+double
+levenshtein_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	return (levenshtein_d(d1, len1, d2, len2));
+}
+
+double
+damerau_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	return (damerau_d(d1, len1, d2, len2));
+}
+
+double
+hamming_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	return (hamming_d(d1, len1, d2, len2));
+}
+
+double
+jaccard_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	return (jaccard_d(d1, len1, d2, len2));
+}
+
+double
+jaro_fn(const void *d1, size_t len1, const void *d2, size_t len2, void *arg)
+{
+	return (jaro_d(d1, len1, d2, len2));
+}
+
+/* arg points to the double prefix scale, NULL means 0.1 */
+double
+jaro_winkler_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	double          p = 0.1;
+
+	if (arg != NULL)
+		p = *(double *) arg;
+	return (jaro_winkler_d(d1, len1, d2, len2, p));
+}
+
+/* arg points to the size_t q, NULL means 2 */
+double
+qgram_fn(const void *d1, size_t len1, const void *d2, size_t len2, void *arg)
+{
+	return (qgram_d(d1, len1, d2, len2, arg != NULL ? *(size_t *) arg : 2));
+}
+
+double
+qgram_cosine_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	return (qgram_cosine_d(d1, len1, d2, len2,
+	    arg != NULL ? *(size_t *) arg : 2));
+}
+
+double
+qgram_dice_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	return (qgram_dice_d(d1, len1, d2, len2,
+	    arg != NULL ? *(size_t *) arg : 2));
+}
+
+/* arg points to the int power, NULL means 1 (manhattan) */
+double
+minkowski_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	int             power = 1;
+
+	if (arg != NULL)
+		power = *(int *) arg;
+	return (minkowski_d(d1, len1, d2, len2, power));
+}
+
+/* arg points to the struct matrix of costs */
+double
+needleman_wunsch_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	return (needleman_wunsch_d(d1, len1, d2, len2, (struct matrix *) arg));
+}
+
+struct batch {
+	distance_fn	 f;
+	void		*arg;
+	const void * const *a;
+	const size_t	*alen;
+	size_t		 na;
+	const void * const *b;
+	const size_t	*blen;
+	size_t		 nb;
+	double		*out;
+};
+
+static void
+cdist_work(size_t lo, size_t hi, void *p)
+{
+	struct batch   *bt = p;
+	size_t          i, j, k;
+
+	/* k walks the flattened na x nb matrix so rows split evenly */
+	for (k = lo; k < hi; k++) {
+		i = k / bt->nb;
+		j = k % bt->nb;
+		bt->out[k] = bt->f(bt->a[i], bt->alen[i], bt->b[j],
+		    bt->blen[j], bt->arg);
+	}
+}
+
+static uint64_t
+cdist_cost(size_t k, void *p)
+{
+	struct batch   *bt = p;
+
+	return ((uint64_t) (bt->alen[k / bt->nb] + 1) *
+	    (bt->blen[k % bt->nb] + 1));
+}
+
+/*
+   fills out[i * nb + j] with the distance between a[i] and b[j].
+   returns 0, or -1 on bad arguments or if cancelled.
+ */
+int
+distance_cdist(distance_fn f, void *arg, const void * const *a,
+    const size_t *alen, size_t na, const void * const *b, const size_t *blen,
+    size_t nb, double *out, int nthreads)
+{
+	struct batch    bt;
+
+	if (f == NULL || out == NULL)
+		return (-1);
+	if (na == 0 || nb == 0)
+		return (0);
+
+	bt.f = f;
+	bt.arg = arg;
+	bt.a = a;
+	bt.alen = alen;
+	bt.na = na;
+	bt.b = b;
+	bt.blen = blen;
+	bt.nb = nb;
+	bt.out = out;
+	return (distance_parallel_for_cost(na * nb, nthreads, cdist_work, &bt,
+	    cdist_cost));
+}
+
+/*
+   fills out[j] with the distance between q and b[j], the one-vs-many
+   case of distance_cdist(). returns 0, or -1 on bad arguments or if
+   cancelled.
+ */
+int
+distance_many(distance_fn f, void *arg, const void *q, size_t qlen,
+    const void * const *b, const size_t *blen, size_t nb, double *out,
+    int nthreads)
+{
+	return (distance_cdist(f, arg, &q, &qlen, 1, b, blen, nb, out,
+	    nthreads));
+}
+
+/*
+   index of the pair (i, j), i < j, in the condensed upper triangle of
+   an n x n matrix, the same layout scipy's pdist() uses.
+ */
+#define PDIST_IDX(n, i, j)	((i) * (2 * (n) - (i) - 1) / 2 + (j) - (i) - 1)
+
+static void
+pdist_work(size_t lo, size_t hi, void *p)
+{
+	struct batch   *bt = p;
+	size_t          i, j, n;
+
+	/* one unit of work is one row; rows get shorter as i grows */
+	n = bt->na;
+	for (i = lo; i < hi; i++)
+		for (j = i + 1; j < n; j++)
+			bt->out[PDIST_IDX(n, i, j)] = bt->f(bt->a[i],
+			    bt->alen[i], bt->a[j], bt->alen[j], bt->arg);
+}
+
+/* row i pairs a[i] with the n - i - 1 inputs after it */
+static uint64_t
+pdist_cost(size_t i, void *p)
+{
+	struct batch   *bt = p;
+
+	return ((uint64_t) (bt->alen[i] + 1) * (bt->na - i - 1));
+}
+
+/*
+   fills out with the n * (n - 1) / 2 distances between every pair
+   a[i], a[j] with i < j. returns 0, or -1 on bad arguments or if
+   cancelled.
+ */
+int
+distance_pdist(distance_fn f, void *arg, const void * const *a,
+    const size_t *alen, size_t n, double *out, int nthreads)
+{
+	struct batch    bt;
+
+	if (f == NULL || out == NULL)
+		return (-1);
+	if (n < 2)
+		return (0);
+
+	memset(&bt, 0, sizeof(bt));
+	bt.f = f;
+	bt.arg = arg;
+	bt.a = a;
+	bt.alen = alen;
+	bt.na = n;
+	bt.out = out;
+	return (distance_parallel_for_cost(n - 1, nthreads, pdist_work, &bt,
+	    pdist_cost));
+}
+
+static int
+match_cmp(const void *x, const void *y)
+{
+	const struct distance_match *m1 = x, *m2 = y;
+
+	if (m1->distance < m2->distance)
+		return (-1);
+	if (m1->distance > m2->distance)
+		return (1);
+	/* keep the order of the choices for ties */
+	return ((m1->index > m2->index) - (m1->index < m2->index));
+}
+
+/*
+   finds the (up to) k choices closest to q whose distance is at most
+   max_distance, a negative max_distance means no limit. negative
+   distances (hamming_d and jaccard_d on inputs of different sizes) are
+   never matches. out must have room for k entries and is filled
+   closest first. returns the number of matches, or -1 on error.
+ */
+int
+distance_extract(distance_fn f, void *arg, const void *q, size_t qlen,
+    const void * const *b, const size_t *blen, size_t nb, size_t k,
+    double max_distance, struct distance_match *out, int nthreads)
+{
+	struct distance_match *m;
+	double         *d;
+	size_t          i, n;
+
+	if (f == NULL || (out == NULL && k > 0))
+		return (-1);
+	if (nb == 0 || k == 0)
+		return (0);
+
+	if ((d = malloc(sizeof(double) * nb)) == NULL)
+		return (-1);
+	/* edit distances under a limit can skip most choices unseen */
+	if ((f == levenshtein_fn || f == damerau_fn) && max_distance >= 0 &&
+	    max_distance < INT_MAX) {
+		if (distance_filter(f == levenshtein_fn ? DISTANCE_LEVENSHTEIN :
+		    DISTANCE_DAMERAU, DISTANCE_FILTER_ALL, q, qlen, b, blen, nb,
+		    (int) max_distance, d, NULL, nthreads) == -1) {
+			free(d);
+			return (-1);
+		}
+	} else if (distance_many(f, arg, q, qlen, b, blen, nb, d,
+	    nthreads) == -1) {
+		free(d);
+		return (-1);
+	}
+
+	/* collect the hits, then order them closest first */
+	if ((m = malloc(sizeof(struct distance_match) * nb)) == NULL) {
+		free(d);
+		return (-1);
+	}
+	for (i = n = 0; i < nb; i++) {
+		if (d[i] < 0)
+			continue;
+		if (max_distance >= 0 && d[i] > max_distance)
+			continue;
+		m[n].index = i;
+		m[n].distance = d[i];
+		n++;
+	}
+	free(d);
+
+	qsort(m, n, sizeof(struct distance_match), match_cmp);
+	if (n > k)
+		n = k;
+	memcpy(out, m, sizeof(struct distance_match) * n);
+	free(m);
+
+	return ((int) n);
+}
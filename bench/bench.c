@@ -0,0 +1,558 @@
+/* $Id$ */
+
+/*
+   libdistance benchmarks
+
+   generates reproducible corpora (random, near-duplicate, natural text
+   and binary data at lengths from 8 bytes to 1 MB), times every public
+   interface in distance.h on them, one pair at a time and in batches,
+   and writes the results as JSON on stdout so that runs can be compared
+   across releases.
+
+   the quadratic metrics are only run where len1 * len2 stays under the
+   cell budget (-c), larger cases are reported with "skipped": true so
+   the grid is always complete.
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include "distance.h"
+
+#define NPAIRS		8		/* distinct pairs per case */
+#define NBATCH		64		/* inputs on each side of a batch */
+#define DIGEST_LEN	32		/* bloom digest size, in bytes */
+
+enum corpus {
+	CORPUS_RANDOM,
+	CORPUS_NEARDUP,
+	CORPUS_TEXT,
+	CORPUS_BINARY,
+	CORPUS_MAX
+};
+
+static const char *corpus_names[] = { "random", "near-duplicate",
+    "natural-text", "binary" };
+
+static const size_t lengths[] = { 8, 64, 512, 4096, 32768, 262144,
+    1048576 };
+#define NLENGTHS	(sizeof(lengths) / sizeof(lengths[0]))
+
+static uint64_t rng_state;
+static double   min_time = 0.1;		/* seconds per case */
+static double   max_cells = 67108864;	/* 2^26 cells per pair */
+static size_t   max_len = 1048576;
+static int      nthreads = 0;
+static const char *only = NULL;
+static struct matrix *nw_matrix;
+static int      nresults = 0;
+
+/*
+   allocation counting. the GNU makefile links with --wrap for the
+   allocator entry points so every malloc() made inside the library
+   comes through here; elsewhere allocs are reported as null.
+ */
+#ifdef BENCH_WRAP_MALLOC
+static unsigned long nallocs;
+
+void           *__real_malloc(size_t);
+void           *__real_calloc(size_t, size_t);
+void           *__real_realloc(void *, size_t);
+
+void *
+__wrap_malloc(size_t n)
+{
+	__sync_fetch_and_add(&nallocs, 1);
+	return (__real_malloc(n));
+}
+
+void *
+__wrap_calloc(size_t n, size_t m)
+{
+	__sync_fetch_and_add(&nallocs, 1);
+	return (__real_calloc(n, m));
+}
+
+void *
+__wrap_realloc(void *p, size_t n)
+{
+	__sync_fetch_and_add(&nallocs, 1);
+	return (__real_realloc(p, n));
+}
+#endif				/* BENCH_WRAP_MALLOC */
+
+/* xorshift64*, good enough and the same on every platform */
+static uint64_t
+rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 2685821657736338717ULL);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static uint64_t
+cycles(void)
+{
+#ifdef HAVE_RDTSC
+	return (__rdtsc());
+#else
+	return (0);
+#endif
+}
+
+static void *
+xmalloc(size_t n)
+{
+	void           *p;
+
+	if ((p = malloc(n)) == NULL) {
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+	return (p);
+}
+
+static const char *words[] = {
+	"the", "of", "and", "to", "a", "in", "is", "you", "that", "it",
+	"he", "was", "for", "on", "are", "as", "with", "his", "they", "at",
+	"be", "this", "have", "from", "or", "one", "had", "by", "word",
+	"but", "not", "what", "all", "were", "we", "when", "your", "can",
+	"said", "there", "use", "an", "each", "which", "she", "do", "how",
+	"their", "if", "will", "up", "other", "about", "out", "many",
+	"then", "them", "these", "so", "some", "her", "would", "make",
+	"like", "him", "into", "time", "has", "look", "two", "more",
+	"write", "go", "see", "number", "no", "way", "could", "people",
+	"my", "than", "first", "water", "been", "call", "who", "oil",
+	"its", "now", "find", "long", "down", "day", "did", "get", "come",
+	"made", "may", "part", "generic", "viagra", "offer", "free",
+	"money", "click", "here", "unsubscribe", "price", "low"
+};
+#define NWORDS		(sizeof(words) / sizeof(words[0]))
+
+/* words drawn with a zipf-like 1/rank frequency */
+static const char *
+zipf_word(void)
+{
+	static double   cdf[NWORDS];
+	double          x, sum;
+	size_t          i, lo, hi;
+
+	if (cdf[NWORDS - 1] == 0) {
+		for (sum = 0, i = 0; i < NWORDS; i++) {
+			sum += 1.0 / (i + 1);
+			cdf[i] = sum;
+		}
+		for (i = 0; i < NWORDS; i++)
+			cdf[i] /= sum;
+	}
+	x = (rng() >> 11) / 9007199254740992.0;
+	for (lo = 0, hi = NWORDS - 1; lo < hi;) {
+		i = (lo + hi) / 2;
+		if (cdf[i] < x)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	return (words[lo]);
+}
+
+static void
+fill(char *s, size_t len, enum corpus c)
+{
+	const char     *w;
+	size_t          i, n;
+
+	switch (c) {
+	case CORPUS_BINARY:
+		for (i = 0; i < len; i++)
+			s[i] = rng() & 0xff;
+		break;
+	case CORPUS_TEXT:
+		for (i = 0; i < len;) {
+			w = zipf_word();
+			n = strlen(w);
+			if (n > len - i)
+				n = len - i;
+			memcpy(s + i, w, n);
+			i += n;
+			if (i < len)
+				s[i++] = (rng() % 12) ? ' ' : '\n';
+		}
+		break;
+	default:
+		for (i = 0; i < len; i++)
+			s[i] = 'a' + rng() % 26;
+		break;
+	}
+}
+
+/*
+   a copy of s with about 2% of the positions edited; substitutions,
+   insertions and deletions in equal measure.
+ */
+static char *
+mutate(const char *s, size_t len, size_t *outlen)
+{
+	char           *t;
+	size_t          i, j;
+
+	t = xmalloc(len + len / 16 + 2);
+	for (i = j = 0; i < len; i++) {
+		if (rng() % 50 != 0) {
+			t[j++] = s[i];
+			continue;
+		}
+		switch (rng() % 3) {
+		case 0:
+			t[j++] = 'a' + rng() % 26;
+			break;
+		case 1:
+			t[j++] = s[i];
+			t[j++] = 'a' + rng() % 26;
+			break;
+		default:
+			break;
+		}
+	}
+	*outlen = j;
+	return (t);
+}
+
+struct input {
+	char           *s;
+	size_t          len;
+};
+
+/* n inputs of about len bytes each from corpus c */
+static void
+generate(struct input *in, size_t n, size_t len, enum corpus c)
+{
+	size_t          i;
+
+	for (i = 0; i < n; i++) {
+		if (c == CORPUS_NEARDUP && i % 2 == 1) {
+			in[i].s = mutate(in[i - 1].s, in[i - 1].len,
+			    &in[i].len);
+			continue;
+		}
+		in[i].s = xmalloc(len);
+		in[i].len = len;
+		fill(in[i].s, len, c == CORPUS_NEARDUP ? CORPUS_RANDOM : c);
+	}
+}
+
+static void
+release(struct input *in, size_t n)
+{
+	size_t          i;
+
+	for (i = 0; i < n; i++)
+		free(in[i].s);
+}
+
+/* the functions under test, cells says how the work grows */
+enum cost {
+	COST_LINEAR,		/* len1 + len2 bytes are looked at */
+	COST_QUADRATIC		/* len1 * len2 dp cells */
+};
+
+struct metric {
+	const char     *name;
+	distance_fn     f;
+	enum cost       cost;
+	void           *arg;
+};
+
+static int      power2 = 2;
+
+static struct metric metrics[] = {
+	{ "levenshtein_d", levenshtein_fn, COST_QUADRATIC, NULL },
+	{ "damerau_d", damerau_fn, COST_QUADRATIC, NULL },
+	{ "hamming_d", hamming_fn, COST_LINEAR, NULL },
+	{ "jaccard_d", jaccard_fn, COST_LINEAR, NULL },
+	{ "minkowski_d", minkowski_fn, COST_QUADRATIC, &power2 },
+	{ "jaro_winkler_d", jaro_winkler_fn, COST_LINEAR, NULL },
+	{ "qgram_cosine_d", qgram_cosine_fn, COST_LINEAR, NULL },
+	{ "needleman_wunsch_d", needleman_wunsch_fn, COST_QUADRATIC, NULL },
+	{ "bloom_d", NULL, COST_LINEAR, NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+/* bloom_create() + bloom_d() as a distance_fn, the digest cost counts */
+static double
+bloom_fn(const void *d1, size_t len1, const void *d2, size_t len2, void *arg)
+{
+	char            b1[DIGEST_LEN], b2[DIGEST_LEN];
+
+	bloom_create(d1, len1, b1, DIGEST_LEN);
+	bloom_create(d2, len2, b2, DIGEST_LEN);
+	return (bloom_d(b1, b2, DIGEST_LEN));
+}
+
+struct result {
+	const char     *metric;
+	const char     *mode;
+	enum corpus     corpus;
+	size_t          len;
+	int             threads;
+	int             skipped;
+	unsigned long   pairs;
+	double          secs;
+	double          bytes;
+	double          cells;
+	uint64_t        cycles;
+	unsigned long   allocs;
+};
+
+static void
+report(struct result *r)
+{
+	printf("%s\n    {\"metric\": \"%s\", \"mode\": \"%s\", "
+	    "\"corpus\": \"%s\", \"len\": %lu, \"threads\": %d",
+	    nresults++ ? "," : "", r->metric, r->mode,
+	    corpus_names[r->corpus], (unsigned long) r->len, r->threads);
+	if (r->skipped) {
+		printf(", \"skipped\": true}");
+		return;
+	}
+	printf(", \"pairs\": %lu, \"seconds\": %.6f, \"ns_per_pair\": %.2f, "
+	    "\"pairs_per_sec\": %.1f, \"mb_per_sec\": %.3f, "
+	    "\"cells_per_ns\": %.4f",
+	    r->pairs, r->secs, r->secs * 1e9 / r->pairs, r->pairs / r->secs,
+	    r->bytes / r->secs / 1e6, r->cells / (r->secs * 1e9));
+	if (r->cycles != 0 && r->threads == 1)
+		printf(", \"cycles_per_cell\": %.4f",
+		    (double) r->cycles / r->cells);
+	else
+		printf(", \"cycles_per_cell\": null");
+#ifdef BENCH_WRAP_MALLOC
+	printf(", \"allocs_per_pair\": %.3f", (double) r->allocs / r->pairs);
+#else
+	printf(", \"allocs_per_pair\": null");
+#endif
+	printf("}");
+	fflush(stdout);
+}
+
+static double
+pair_cells(struct metric *m, size_t len1, size_t len2)
+{
+	if (m->cost == COST_QUADRATIC)
+		return ((double) len1 * len2);
+	return ((double) len1 + len2);
+}
+
+static unsigned long
+allocs(void)
+{
+#ifdef BENCH_WRAP_MALLOC
+	return (nallocs);
+#else
+	return (0);
+#endif
+}
+
+/* time single calls, cycling through the pairs until min_time is up */
+static void
+bench_pairs(struct metric *m, distance_fn f, struct input *in, size_t len,
+    enum corpus c)
+{
+	struct result   r;
+	volatile double sink;
+	double          start, cells = 0;
+	size_t          i;
+	unsigned long   a0;
+	uint64_t        c0;
+
+	memset(&r, 0, sizeof(r));
+	r.metric = m->name;
+	r.mode = "pair";
+	r.corpus = c;
+	r.len = len;
+	r.threads = 1;
+
+	for (i = 0; i < NPAIRS; i++)
+		if (pair_cells(m, in[2 * i].len, in[2 * i + 1].len) > cells)
+			cells = pair_cells(m, in[2 * i].len, in[2 * i + 1].len);
+	if (cells > max_cells) {
+		r.skipped = 1;
+		report(&r);
+		return;
+	}
+
+	a0 = allocs();
+	c0 = cycles();
+	start = now();
+	do {
+		for (i = 0; i < NPAIRS; i++) {
+			sink = f(in[2 * i].s, in[2 * i].len, in[2 * i + 1].s,
+			    in[2 * i + 1].len, m->arg);
+			r.bytes += in[2 * i].len + in[2 * i + 1].len;
+			r.cells += pair_cells(m, in[2 * i].len,
+			    in[2 * i + 1].len);
+		}
+		r.pairs += NPAIRS;
+		r.secs = now() - start;
+	} while (r.secs < min_time);
+	r.cycles = cycles() - c0;
+	r.allocs = allocs() - a0;
+	(void) sink;
+
+	report(&r);
+}
+
+/* time distance_cdist() over NBATCH x NBATCH inputs */
+static void
+bench_batch(struct metric *m, distance_fn f, struct input *in, size_t len,
+    enum corpus c)
+{
+	struct result   r;
+	const void     *a[NBATCH], *b[NBATCH];
+	size_t          alen[NBATCH], blen[NBATCH], i, j;
+	double         *out, start, cells;
+	unsigned long   a0;
+
+	memset(&r, 0, sizeof(r));
+	r.metric = m->name;
+	r.mode = "batch";
+	r.corpus = c;
+	r.len = len;
+	r.threads = nthreads > 0 ? nthreads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (cells = 0, i = 0; i < NBATCH; i++) {
+		a[i] = in[2 * i].s;
+		alen[i] = in[2 * i].len;
+		b[i] = in[2 * i + 1].s;
+		blen[i] = in[2 * i + 1].len;
+		if (pair_cells(m, alen[i], blen[i]) > cells)
+			cells = pair_cells(m, alen[i], blen[i]);
+	}
+	/* the whole batch has to fit the budget of a few pairs */
+	if (cells * NBATCH * NBATCH > max_cells * NPAIRS) {
+		r.skipped = 1;
+		report(&r);
+		return;
+	}
+
+	out = xmalloc(sizeof(double) * NBATCH * NBATCH);
+	a0 = allocs();
+	start = now();
+	do {
+		distance_cdist(f, m->arg, a, alen, NBATCH, b, blen, NBATCH,
+		    out, nthreads);
+		for (i = 0; i < NBATCH; i++)
+			for (j = 0; j < NBATCH; j++) {
+				r.bytes += alen[i] + blen[j];
+				r.cells += pair_cells(m, alen[i], blen[j]);
+			}
+		r.pairs += NBATCH * NBATCH;
+		r.secs = now() - start;
+	} while (r.secs < min_time);
+	r.allocs = allocs() - a0;
+	free(out);
+
+	report(&r);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: bench [-c max_cells] [-j threads] "
+	    "[-l max_len] [-m metric] [-s seed] [-t seconds]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct input    in[2 * NBATCH];
+	struct metric  *m;
+	distance_fn     f;
+	unsigned long   seed = 1;
+	size_t          l;
+	int             c, ch, x, y;
+
+	while ((ch = getopt(argc, argv, "c:j:l:m:s:t:")) != -1) {
+		switch (ch) {
+		case 'c':
+			max_cells = strtod(optarg, NULL);
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'l':
+			max_len = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			only = optarg;
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			min_time = strtod(optarg, NULL);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	nw_matrix = xmalloc(sizeof(struct matrix));
+	for (x = 0; x < 255; x++)
+		for (y = 0; y < 255; y++) {
+			nw_matrix->conversion[x][y] = 1.0;
+			nw_matrix->insertion[x][y] = 1.0;
+		}
+	for (m = metrics; m->name != NULL; m++)
+		if (m->f == needleman_wunsch_fn)
+			m->arg = nw_matrix;
+
+	printf("{\"library\": \"libdistance\", \"seed\": %lu, "
+	    "\"min_time\": %g, \"max_cells\": %.0f, \"results\": [",
+	    seed, min_time, max_cells);
+
+	for (l = 0; l < NLENGTHS && lengths[l] <= max_len; l++) {
+		for (c = 0; c < CORPUS_MAX; c++) {
+			/* same seed, same corpus, whatever else was run */
+			rng_state = (seed + 1) * 0x9e3779b97f4a7c15ULL +
+			    l * 131 + c;
+			generate(in, 2 * NBATCH, lengths[l], c);
+			for (m = metrics; m->name != NULL; m++) {
+				if (only != NULL && strcmp(only, m->name) != 0)
+					continue;
+				/* the cost matrix only covers 7 bit input */
+				if (m->f == needleman_wunsch_fn &&
+				    c == CORPUS_BINARY)
+					continue;
+				f = m->f != NULL ? m->f : bloom_fn;
+				bench_pairs(m, f, in, lengths[l], c);
+				bench_batch(m, f, in, lengths[l], c);
+			}
+			release(in, 2 * NBATCH);
+		}
+	}
+	printf("\n]}\n");
+
+	free(nw_matrix);
+	return (0);
+}
@@ -46,6 +46,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "distance.h"
+#include "distance_int.h"
+
 #define ADLER_WINDOW		4		// in bytes
 #define	ADLER_INC		1		// in bytes
 
@@ -143,6 +146,7 @@ bloom_create(const void *data, size_t len, const void *digest, size_t digest_len
 	d1 = (char *) digest;
 	offset = 0;
 	memset((void *)digest, 0, digest_len);
+	STATS_CALL(DISTANCE_BLOOM, len, 0, 0, DISTANCE_KERNEL_LINEAR);
 	while (1) {
 		adler = adler32(0, buf + offset, ADLER_WINDOW);
 		bit_id = adler % (digest_len * 8);
@@ -158,6 +162,7 @@ bloom_create(const void *data, size_t len, const void *digest, size_t digest_len
     Computes the distance between any two bloom filter digest of the same
     length.  digest_len must be be 32 bit aligned (i.e. divisible by 4)
 */
+DISTANCE_CLONES
 double
 bloom_d(const void *digest1, const void *digest2, size_t digest_len)
 {
@@ -167,6 +172,8 @@ bloom_d(const void *digest1, const void *digest2, size_t digest_len)
 	bitready();
 	d1 = (uint32_t *) digest1;
 	d2 = (uint32_t *) digest2;
+	STATS_CALL(DISTANCE_BLOOM, digest_len, digest_len, 0,
+	    DISTANCE_KERNEL_LINEAR);
 
 	//get the bit count for each digest
 	bit_cnt1 = 0;
@@ -0,0 +1,347 @@
+/*	$Id$ */
+
+/*
+   a bounded cache of distances for traffic that keeps comparing the
+   same pairs. a cache is made for one distance_fn and its argument,
+   and distance_cache_fn() then stands in for that function anywhere a
+   distance_fn goes, the batch interfaces included.
+
+   entries are keyed by a 128 bit hash of the two inputs and hold no
+   copy of them, so a hit costs the hash and a few loads. inputs may
+   come from whoever sends the traffic, and a pair built to collide
+   with another would be given the other's distance, so the hash is
+   siphash-1-3 under a key drawn at random for each cache: without the
+   key, finding two pairs that share all 128 bits is no easier than
+   guessing.
+
+   the table is set associative: a key can only live in one set of
+   CACHE_WAYS entries, and a full set gives up the entry the CLOCK hand
+   comes to first without its reference bit. readers take no lock,
+   every entry has a sequence number that is odd while it is being
+   written and changes with every write, and a read that sees it odd or
+   changed is a miss. writers take one of CACHE_LOCKS mutexes, picked
+   by set, so different sets fill in parallel.
+
+   the counters are spread over the lock stripes too, each on its own
+   cache line, and only added up when they are asked for.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+#define CACHE_WAYS	8
+#define CACHE_LOCKS	64
+
+struct cache_entry {
+	uint32_t	 seq;		/* 0 empty, odd while written */
+	uint32_t	 ref;		/* CLOCK reference bit */
+	uint64_t	 k1;
+	uint64_t	 k2;
+	uint64_t	 value;		/* the double, as bits */
+};
+
+struct cache_set {
+	struct cache_entry e[CACHE_WAYS];
+	unsigned	 hand;
+};
+
+struct cache_stripe {
+	pthread_mutex_t	 lock;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+} __attribute__((aligned(64)));
+
+struct distance_cache {
+	distance_fn	 f;
+	void		*arg;
+	uint64_t	 key[2];	/* the hash key, random */
+	struct cache_set *sets;
+	size_t		 nsets;		/* power of two */
+	struct cache_stripe stripes[CACHE_LOCKS];
+};
+
+/*
+   J.-P. Aumasson and D. J. Bernstein, "SipHash: a fast short-input
+   PRF", INDOCRYPT 2012. one round per word and three to finish, with
+   the 128 bit output.
+ */
+struct cache_sip {
+	uint64_t	 v0, v1, v2, v3;
+};
+
+#define CACHE_ROTL(x, b)	(((x) << (b)) | ((x) >> (64 - (b))))
+
+static __inline void
+cache_round(struct cache_sip *s)
+{
+	s->v0 += s->v1;
+	s->v1 = CACHE_ROTL(s->v1, 13);
+	s->v1 ^= s->v0;
+	s->v0 = CACHE_ROTL(s->v0, 32);
+	s->v2 += s->v3;
+	s->v3 = CACHE_ROTL(s->v3, 16);
+	s->v3 ^= s->v2;
+	s->v0 += s->v3;
+	s->v3 = CACHE_ROTL(s->v3, 21);
+	s->v3 ^= s->v0;
+	s->v2 += s->v1;
+	s->v1 = CACHE_ROTL(s->v1, 17);
+	s->v1 ^= s->v2;
+	s->v2 = CACHE_ROTL(s->v2, 32);
+}
+
+static __inline void
+cache_word(struct cache_sip *s, uint64_t m)
+{
+	s->v3 ^= m;
+	cache_round(s);
+	s->v0 ^= m;
+}
+
+/*
+   the words of d, the last one padded with zeros, then its length.
+   read back from the end, the lengths tell where each input starts,
+   so no two pairs of inputs give the same words.
+ */
+static __inline void
+cache_absorb(struct cache_sip *s, const void *d, size_t len)
+{
+	const unsigned char *p = d;
+	uint64_t        w;
+	size_t          i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, p + i, 8);
+		cache_word(s, w);
+	}
+	if (i < len) {
+		w = 0;
+		memcpy(&w, p + i, len - i);
+		cache_word(s, w);
+	}
+	cache_word(s, (uint64_t) len);
+}
+
+/* the 128 bit key of a pair under the cache's key */
+static void
+cache_hash(const struct distance_cache *dc, const void *d1, size_t len1,
+    const void *d2, size_t len2, uint64_t *k1, uint64_t *k2)
+{
+	struct cache_sip s;
+
+	s.v0 = dc->key[0] ^ 0x736f6d6570736575ULL;
+	s.v1 = dc->key[1] ^ 0x646f72616e646f6dULL ^ 0xee;
+	s.v2 = dc->key[0] ^ 0x6c7967656e657261ULL;
+	s.v3 = dc->key[1] ^ 0x7465646279746573ULL;
+	cache_absorb(&s, d1, len1);
+	cache_absorb(&s, d2, len2);
+	s.v2 ^= 0xee;
+	cache_round(&s);
+	cache_round(&s);
+	cache_round(&s);
+	*k1 = s.v0 ^ s.v1 ^ s.v2 ^ s.v3;
+	s.v1 ^= 0xdd;
+	cache_round(&s);
+	cache_round(&s);
+	cache_round(&s);
+	*k2 = s.v0 ^ s.v1 ^ s.v2 ^ s.v3;
+}
+
+/* n random bytes into p. returns 0, or -1 if there are none to be had */
+static int
+cache_random(void *p, size_t n)
+{
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+    defined(__NetBSD__) || defined(__DragonFly__)
+	arc4random_buf(p, n);
+	return (0);
+#else
+	unsigned char  *b = p;
+	ssize_t         r;
+	int             fd;
+
+	if ((fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) == -1)
+		return (-1);
+	while (n > 0) {
+		if ((r = read(fd, b, n)) == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		b += r;
+		n -= r;
+	}
+	close(fd);
+	return (n == 0 ? 0 : -1);
+#endif
+}
+
+/*
+   a cache in front of f with room for about nentries distances.
+   returns NULL if out of memory or if no random key could be had.
+ */
+struct distance_cache *
+distance_cache_new(distance_fn f, void *arg, size_t nentries)
+{
+	struct distance_cache *dc;
+	size_t          n;
+	int             i;
+
+	if (f == NULL)
+		return (NULL);
+	if ((dc = calloc(1, sizeof(*dc))) == NULL)
+		return (NULL);
+	STATS_ADD(allocs, 1);
+	for (n = 1; n * CACHE_WAYS < nentries; n *= 2)
+		;
+	dc->f = f;
+	dc->arg = arg;
+	dc->nsets = n;
+	if (cache_random(dc->key, sizeof(dc->key)) == -1 ||
+	    (dc->sets = calloc(n, sizeof(struct cache_set))) == NULL) {
+		free(dc);
+		return (NULL);
+	}
+	STATS_ADD(allocs, 1);
+	for (i = 0; i < CACHE_LOCKS; i++)
+		pthread_mutex_init(&dc->stripes[i].lock, NULL);
+	return (dc);
+}
+
+void
+distance_cache_free(struct distance_cache *dc)
+{
+	int             i;
+
+	if (dc == NULL)
+		return;
+	for (i = 0; i < CACHE_LOCKS; i++)
+		pthread_mutex_destroy(&dc->stripes[i].lock);
+	free(dc->sets);
+	free(dc);
+}
+
+/* the value of an entry for k1, k2, or -1 if it has none */
+static int
+cache_read(struct cache_entry *e, uint64_t k1, uint64_t k2, uint64_t *v)
+{
+	uint32_t        s1, s2;
+	uint64_t        x1, x2;
+
+	s1 = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+	if (s1 == 0 || s1 & 1)
+		return (-1);
+	x1 = __atomic_load_n(&e->k1, __ATOMIC_RELAXED);
+	x2 = __atomic_load_n(&e->k2, __ATOMIC_RELAXED);
+	*v = __atomic_load_n(&e->value, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	s2 = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+	if (s1 != s2 || x1 != k1 || x2 != k2)
+		return (-1);
+	return (0);
+}
+
+static void
+cache_write(struct cache_entry *e, uint64_t k1, uint64_t k2, uint64_t v)
+{
+	uint32_t        s = e->seq;
+
+	__atomic_store_n(&e->seq, s + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&e->k1, k1, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->k2, k2, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->value, v, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->ref, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->seq, s + 2, __ATOMIC_RELEASE);
+}
+
+/*
+   the distance_fn of the cache, arg is the struct distance_cache.
+   returns what the cache's function returns for d1 and d2, computing
+   it only if the pair is not in the cache.
+ */
+double
+distance_cache_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	struct distance_cache *dc = arg;
+	struct cache_stripe *st;
+	struct cache_set *set;
+	struct cache_entry *e;
+	uint64_t        k1, k2, v;
+	double          d;
+	int             i, w;
+
+	cache_hash(dc, d1, len1, d2, len2, &k1, &k2);
+
+	set = &dc->sets[k1 & (dc->nsets - 1)];
+	st = &dc->stripes[(k1 & (dc->nsets - 1)) % CACHE_LOCKS];
+	for (i = 0; i < CACHE_WAYS; i++) {
+		e = &set->e[i];
+		if (cache_read(e, k1, k2, &v) == 0) {
+			if (__atomic_load_n(&e->ref, __ATOMIC_RELAXED) == 0)
+				__atomic_store_n(&e->ref, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&st->hits, 1, __ATOMIC_RELAXED);
+			memcpy(&d, &v, sizeof(d));
+			return (d);
+		}
+	}
+
+	__atomic_fetch_add(&st->misses, 1, __ATOMIC_RELAXED);
+	d = dc->f(d1, len1, d2, len2, dc->arg);
+	memcpy(&v, &d, sizeof(v));
+
+	pthread_mutex_lock(&st->lock);
+	/* an empty way if there is one, else the CLOCK victim */
+	for (i = 0, w = -1; i < CACHE_WAYS; i++) {
+		if (set->e[i].seq == 0) {
+			w = i;
+			break;
+		}
+		/* another thread got there first */
+		if (set->e[i].k1 == k1 && set->e[i].k2 == k2) {
+			pthread_mutex_unlock(&st->lock);
+			return (d);
+		}
+	}
+	if (w == -1) {
+		for (;;) {
+			e = &set->e[set->hand];
+			set->hand = (set->hand + 1) % CACHE_WAYS;
+			if (__atomic_load_n(&e->ref, __ATOMIC_RELAXED) == 0)
+				break;
+			__atomic_store_n(&e->ref, 0, __ATOMIC_RELAXED);
+		}
+		w = e - set->e;
+		__atomic_fetch_add(&st->evictions, 1, __ATOMIC_RELAXED);
+	}
+	cache_write(&set->e[w], k1, k2, v);
+	pthread_mutex_unlock(&st->lock);
+
+	return (d);
+}
+
+/* the counters of every stripe added up */
+void
+distance_cache_stats(const struct distance_cache *dc,
+    struct distance_cache_stats *st)
+{
+	const struct cache_stripe *s;
+	int             i;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < CACHE_LOCKS; i++) {
+		s = &dc->stripes[i];
+		st->hits += __atomic_load_n(&s->hits, __ATOMIC_RELAXED);
+		st->misses += __atomic_load_n(&s->misses, __ATOMIC_RELAXED);
+		st->evictions += __atomic_load_n(&s->evictions,
+		    __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,553 @@
+/* $Id$ */
+
+/*
+   distance: computes distances from the command line.
+
+	distance [-m metric] [-j threads] [-t max] [-f tsv|json] [file]
+	distance -q query [-m metric] [-j threads] [-t max] [-k n]
+	    [-f tsv|json] [file]
+
+   without -q every input line is a pair of strings separated by a tab,
+   with -q every line is a candidate compared with the query. the input
+   is the file, mapped, or stdin, and every result line follows the
+   order of the input. distances are written in full, to 17 digits, and
+   a pair the metric has no distance for (hamming on strings of
+   different lengths) gets - in tsv and null in json, or is left out
+   with -t.
+
+   the work goes through a pipeline: a reader thread cuts the input
+   into batches of lines, the workers compute the batches' distances
+   and the main thread writes the batches out in order. at most
+   CLI_INFLIGHT batches per worker exist at a time, so the memory used
+   does not depend on the size of the input however far the reader
+   gets ahead. -k needs every distance before it can write anything and
+   runs distance_extract() over the whole input instead.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "distance.h"
+
+#define CLI_BATCH	4096		/* lines per batch */
+#define CLI_INFLIGHT	4		/* batches per worker */
+
+enum cli_format {
+	CLI_TSV,
+	CLI_JSON
+};
+
+struct cli_batch {
+	size_t		 first;		/* line number of the first line */
+	size_t		 n;
+	char		*buf;		/* the lines when read from stdin */
+	const char	**s;		/* [n] */
+	size_t		*slen;
+	const char	**t;		/* [n], unused with -q */
+	size_t		*tlen;
+	double		*d;
+	int		 done;
+};
+
+struct cli {
+	distance_fn	 f;
+	void		*arg;
+	const char	*query;
+	size_t		 qlen;
+	double		 max;		/* -t, negative for none */
+	enum cli_format	 format;
+
+	/* the input, mapped or read */
+	const char	*map;
+	size_t		 maplen;
+	FILE		*in;
+
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 more;		/* a batch to work on, or the end */
+	pthread_cond_t	 ready;		/* a batch was finished */
+	pthread_cond_t	 room;		/* a batch was written */
+	struct cli_batch **slots;	/* [nslots], by batch number */
+	size_t		 nslots;
+	size_t		 nread;		/* batches read */
+	size_t		 nstarted;	/* batches given to workers */
+	size_t		 nwritten;
+	int		 reading;	/* the reader is still going */
+};
+
+struct cli_metric {
+	const char	*name;
+	distance_fn	 f;
+};
+
+static double
+levenshtein_utf8_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	return (levenshtein_utf8_d(d1, len1, d2, len2));
+}
+
+static double
+damerau_utf8_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	return (damerau_utf8_d(d1, len1, d2, len2));
+}
+
+static const struct cli_metric metrics[] = {
+	{ "levenshtein", levenshtein_fn },
+	{ "damerau", damerau_fn },
+	{ "hamming", hamming_fn },
+	{ "jaccard", jaccard_fn },
+	{ "minkowski", minkowski_fn },
+	{ "jaro", jaro_fn },
+	{ "jaro_winkler", jaro_winkler_fn },
+	{ "qgram", qgram_fn },
+	{ "qgram_cosine", qgram_cosine_fn },
+	{ "qgram_dice", qgram_dice_fn },
+	{ "needleman_wunsch", needleman_wunsch_fn },
+	{ "levenshtein_utf8", levenshtein_utf8_fn },
+	{ "damerau_utf8", damerau_utf8_fn },
+	{ NULL, NULL }
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: distance [-f tsv|json] [-j threads] "
+	    "[-m metric] [-p power] [-t max] [file]\n"
+	    "       distance -q query [-f tsv|json] [-j threads] [-k n] "
+	    "[-m metric] [-p power] [-t max] [file]\n");
+	exit(1);
+}
+
+static void *
+xcalloc(size_t n, size_t size)
+{
+	void           *p;
+
+	if ((p = calloc(n, size)) == NULL)
+		err(1, NULL);
+	return (p);
+}
+
+static struct cli_batch *
+batch_new(size_t n)
+{
+	struct cli_batch *b;
+
+	b = xcalloc(1, sizeof(*b));
+	b->s = xcalloc(n, sizeof(*b->s));
+	b->slen = xcalloc(n, sizeof(*b->slen));
+	b->t = xcalloc(n, sizeof(*b->t));
+	b->tlen = xcalloc(n, sizeof(*b->tlen));
+	b->d = xcalloc(n, sizeof(*b->d));
+	return (b);
+}
+
+static void
+batch_free(struct cli_batch *b)
+{
+	free(b->buf);
+	free(b->s);
+	free(b->slen);
+	free(b->t);
+	free(b->tlen);
+	free(b->d);
+	free(b);
+}
+
+/* splits a pair line at its first tab, a line without one is skipped */
+static void
+batch_add(struct cli *c, struct cli_batch *b, const char *line, size_t len)
+{
+	const char     *tab;
+	size_t          i = b->n++;
+
+	if (len > 0 && line[len - 1] == '\r')
+		len--;
+	b->s[i] = line;
+	b->slen[i] = len;
+	b->t[i] = NULL;
+	if (c->query != NULL)
+		return;
+	if ((tab = memchr(line, '\t', len)) == NULL) {
+		warnx("line %zu: no tab, skipped", b->first + i + 1);
+		b->s[i] = NULL;
+		return;
+	}
+	b->slen[i] = tab - line;
+	b->t[i] = tab + 1;
+	b->tlen[i] = len - (tab + 1 - line);
+}
+
+/* the next batch of the input, NULL at the end */
+static struct cli_batch *
+read_batch(struct cli *c, size_t first, size_t *pos)
+{
+	struct cli_batch *b;
+	const char     *p, *nl;
+	char           *line = NULL;
+	size_t          cap = 0, used = 0, i, n = 0, offs[CLI_BATCH];
+	ssize_t         len;
+
+	b = batch_new(CLI_BATCH);
+	b->first = first;
+	if (c->map != NULL) {
+		while (b->n < CLI_BATCH && *pos < c->maplen) {
+			p = c->map + *pos;
+			nl = memchr(p, '\n', c->maplen - *pos);
+			len = nl != NULL ? nl - p : (ssize_t) (c->maplen - *pos);
+			batch_add(c, b, p, len);
+			*pos += len + 1;
+		}
+	} else {
+		/* copy the lines into one buffer, then point into it */
+		while (n < CLI_BATCH &&
+		    (len = getline(&line, &cap, c->in)) != -1) {
+			if (len > 0 && line[len - 1] == '\n')
+				len--;
+			if ((b->buf = realloc(b->buf, used + len + 1)) == NULL)
+				err(1, NULL);
+			memcpy(b->buf + used, line, len);
+			offs[n] = used;
+			b->slen[n++] = len;
+			used += len + 1;
+		}
+		if (ferror(c->in))
+			err(1, "stdin");
+		free(line);
+		for (i = 0; i < n; i++)
+			batch_add(c, b, b->buf + offs[i], b->slen[i]);
+	}
+	if (b->n == 0) {
+		batch_free(b);
+		return (NULL);
+	}
+	return (b);
+}
+
+static void *
+reader(void *p)
+{
+	struct cli     *c = p;
+	struct cli_batch *b;
+	size_t          pos = 0, line = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&c->lock);
+		while (c->nread - c->nwritten >= c->nslots)
+			pthread_cond_wait(&c->room, &c->lock);
+		pthread_mutex_unlock(&c->lock);
+
+		b = read_batch(c, line, &pos);
+
+		pthread_mutex_lock(&c->lock);
+		if (b == NULL) {
+			c->reading = 0;
+			pthread_cond_broadcast(&c->more);
+			pthread_cond_broadcast(&c->ready);
+			pthread_mutex_unlock(&c->lock);
+			return (NULL);
+		}
+		line += b->n;
+		c->slots[c->nread++ % c->nslots] = b;
+		pthread_cond_signal(&c->more);
+		pthread_mutex_unlock(&c->lock);
+	}
+}
+
+static void *
+worker(void *p)
+{
+	struct cli     *c = p;
+	struct cli_batch *b;
+	size_t          i;
+
+	for (;;) {
+		pthread_mutex_lock(&c->lock);
+		while (c->nstarted == c->nread && c->reading)
+			pthread_cond_wait(&c->more, &c->lock);
+		if (c->nstarted == c->nread) {
+			pthread_mutex_unlock(&c->lock);
+			return (NULL);
+		}
+		b = c->slots[c->nstarted++ % c->nslots];
+		pthread_mutex_unlock(&c->lock);
+
+		for (i = 0; i < b->n; i++) {
+			if (b->s[i] == NULL)
+				b->d[i] = NAN;
+			else if (c->query != NULL)
+				b->d[i] = c->f(c->query, c->qlen, b->s[i],
+				    b->slen[i], c->arg);
+			else
+				b->d[i] = c->f(b->s[i], b->slen[i], b->t[i],
+				    b->tlen[i], c->arg);
+		}
+
+		pthread_mutex_lock(&c->lock);
+		b->done = 1;
+		pthread_cond_broadcast(&c->ready);
+		pthread_mutex_unlock(&c->lock);
+	}
+}
+
+static void
+put_json(const char *s, size_t len)
+{
+	size_t          i;
+	unsigned char   ch;
+
+	putchar('"');
+	for (i = 0; i < len; i++) {
+		ch = s[i];
+		if (ch == '"' || ch == '\\')
+			printf("\\%c", ch);
+		else if (ch < 0x20)
+			printf("\\u%04x", ch);
+		else
+			putchar(ch);
+	}
+	putchar('"');
+}
+
+/* one result; line counts from 1 */
+static void
+put_result(const struct cli *c, size_t line, const char *s, size_t slen,
+    const char *t, size_t tlen, double d)
+{
+	char            v[32];
+
+	if (isnan(d))
+		return;
+	if (c->max >= 0 && (d < 0 || d > c->max))
+		return;
+	/* no distance for the pair, or all of it (%g gives 1e+06) */
+	if (d < 0)
+		snprintf(v, sizeof(v), "%s", c->format == CLI_TSV ? "-" :
+		    "null");
+	else
+		snprintf(v, sizeof(v), "%.17g", d);
+	if (c->format == CLI_TSV) {
+		if (c->query != NULL)
+			printf("%zu\t%s\t%.*s\n", line, v, (int) slen, s);
+		else
+			printf("%.*s\t%.*s\t%s\n", (int) slen, s, (int) tlen, t,
+			    v);
+		return;
+	}
+	printf("{\"line\":%zu,", line);
+	if (c->query != NULL) {
+		printf("\"candidate\":");
+		put_json(s, slen);
+	} else {
+		printf("\"s\":");
+		put_json(s, slen);
+		printf(",\"t\":");
+		put_json(t, tlen);
+	}
+	printf(",\"distance\":%s}\n", v);
+}
+
+/* the ordered writer, on the main thread */
+static void
+writer(struct cli *c)
+{
+	struct cli_batch *b;
+	size_t          i;
+
+	for (;;) {
+		pthread_mutex_lock(&c->lock);
+		while (!(c->nwritten < c->nread &&
+		    c->slots[c->nwritten % c->nslots]->done) &&
+		    !(c->nwritten == c->nread && !c->reading))
+			pthread_cond_wait(&c->ready, &c->lock);
+		if (c->nwritten == c->nread && !c->reading) {
+			pthread_mutex_unlock(&c->lock);
+			return;
+		}
+		b = c->slots[c->nwritten % c->nslots];
+		pthread_mutex_unlock(&c->lock);
+
+		for (i = 0; i < b->n; i++)
+			put_result(c, b->first + i + 1, b->s[i], b->slen[i],
+			    b->t[i], b->tlen[i], b->d[i]);
+		batch_free(b);
+
+		pthread_mutex_lock(&c->lock);
+		c->slots[c->nwritten++ % c->nslots] = NULL;
+		pthread_cond_signal(&c->room);
+		pthread_mutex_unlock(&c->lock);
+	}
+}
+
+/* -k: every candidate at once, through distance_extract() */
+static void
+top_k(struct cli *c, size_t k, int nthreads)
+{
+	struct cli_batch *all, *b;
+	struct distance_match *m;
+	size_t          pos = 0, n = 0, cap = 0, i;
+	int             nm;
+
+	all = xcalloc(1, sizeof(*all));
+	b = NULL;
+	/* gather the batches into one list of candidates */
+	while ((b = read_batch(c, n, &pos)) != NULL) {
+		if (n + b->n > cap) {
+			cap = 2 * (n + b->n);
+			all->s = realloc(all->s, cap * sizeof(*all->s));
+			all->slen = realloc(all->slen, cap * sizeof(*all->slen));
+			if (all->s == NULL || all->slen == NULL)
+				err(1, NULL);
+		}
+		memcpy(all->s + n, b->s, b->n * sizeof(*b->s));
+		memcpy(all->slen + n, b->slen, b->n * sizeof(*b->slen));
+		n += b->n;
+		/* the lines stay where they were read */
+		b->buf = NULL;
+		batch_free(b);
+	}
+	m = xcalloc(k, sizeof(*m));
+	nm = distance_extract(c->f, c->arg, c->query, c->qlen,
+	    (const void * const *) all->s, all->slen, n, k, c->max, m,
+	    nthreads);
+	if (nm == -1)
+		errx(1, "out of memory");
+	for (i = 0; i < (size_t) nm; i++)
+		put_result(c, m[i].index + 1, all->s[m[i].index],
+		    all->slen[m[i].index], NULL, 0, m[i].distance);
+	free(m);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct cli_metric *mt;
+	struct cli      c;
+	struct matrix  *nw = NULL;
+	struct stat     sb;
+	pthread_t       rd, *wk;
+	const char     *metric = "levenshtein";
+	size_t          k = 0;
+	int             ch, fd, i, nthreads = 0, power = 1, x, y;
+
+	memset(&c, 0, sizeof(c));
+	c.max = -1;
+	c.format = CLI_TSV;
+	while ((ch = getopt(argc, argv, "f:j:k:m:p:q:t:")) != -1) {
+		switch (ch) {
+		case 'f':
+			if (strcmp(optarg, "tsv") == 0)
+				c.format = CLI_TSV;
+			else if (strcmp(optarg, "json") == 0)
+				c.format = CLI_JSON;
+			else
+				usage();
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'k':
+			k = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			metric = optarg;
+			break;
+		case 'p':
+			power = atoi(optarg);
+			break;
+		case 'q':
+			c.query = optarg;
+			c.qlen = strlen(optarg);
+			break;
+		case 't':
+			c.max = strtod(optarg, NULL);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1 || (k > 0 && c.query == NULL))
+		usage();
+
+	for (mt = metrics; mt->name != NULL; mt++)
+		if (strcmp(mt->name, metric) == 0)
+			break;
+	if (mt->name == NULL)
+		errx(1, "unknown metric %s", metric);
+	c.f = mt->f;
+	if (c.f == minkowski_fn)
+		c.arg = &power;
+	else if (c.f == needleman_wunsch_fn) {
+		/*
+		   unit costs. not levenshtein_d all the same: the first
+		   row and column of needleman_wunsch_d hold the cost of
+		   one insertion each, so a and bbbb are 2 apart, not 4
+		 */
+		nw = xcalloc(1, sizeof(*nw));
+		for (x = 0; x < 255; x++)
+			for (y = 0; y < 255; y++) {
+				nw->conversion[x][y] = 1;
+				nw->insertion[x][y] = 1;
+			}
+		c.arg = nw;
+	}
+
+	c.in = stdin;
+	if (argc == 1) {
+		if ((fd = open(argv[0], O_RDONLY)) == -1 ||
+		    fstat(fd, &sb) == -1)
+			err(1, "%s", argv[0]);
+		if ((c.maplen = sb.st_size) == 0)
+			return (0);
+		c.map = mmap(NULL, c.maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (c.map == MAP_FAILED)
+			err(1, "%s", argv[0]);
+		madvise((void *) c.map, c.maplen, MADV_SEQUENTIAL);
+		close(fd);
+	}
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+		    (int) sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+	if (k > 0) {
+		top_k(&c, k, nthreads);
+		return (0);
+	}
+
+	pthread_mutex_init(&c.lock, NULL);
+	pthread_cond_init(&c.more, NULL);
+	pthread_cond_init(&c.ready, NULL);
+	pthread_cond_init(&c.room, NULL);
+	c.nslots = (size_t) nthreads * CLI_INFLIGHT;
+	c.slots = xcalloc(c.nslots, sizeof(*c.slots));
+	c.reading = 1;
+	wk = xcalloc(nthreads, sizeof(*wk));
+	if (pthread_create(&rd, NULL, reader, &c) != 0)
+		errx(1, "cannot start the reader");
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&wk[i], NULL, worker, &c) != 0)
+			errx(1, "cannot start a worker");
+	writer(&c);
+	pthread_join(rd, NULL);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(wk[i], NULL);
+	if (fflush(stdout) == EOF)
+		err(1, "stdout");
+	free(nw);
+
+	return (0);
+}
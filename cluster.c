@@ -0,0 +1,226 @@
+/*	$Id$ */
+
+/*
+   clustering of many inputs under any metric distance_fn, without
+   looking at all n * n pairs. the neighbours of each input, the
+   inputs within eps of it, come from range queries on a vantage point
+   tree (vptree.c), which run in parallel.
+
+   M. Ester, H. Kriegel, J. Sander, X. Xu, "A density-based algorithm
+   for discovering clusters in large spatial databases with noise",
+   Proc. KDD-96, 226-231, 1996. an input with at least minpts
+   neighbours (itself included) is a core input. core inputs that are
+   neighbours are in the same cluster, an input that is not core joins
+   the cluster of a core neighbour and is noise if it has none. with
+   minpts 1 every input is core and the clusters are those of single
+   linkage cut at eps: the connected components of the graph joining
+   inputs within eps.
+
+   the first pass counts neighbours to find the core inputs, the
+   second joins each core input with its core neighbours in a
+   union-find forest shared by all threads. a root is only ever linked
+   under a root with a smaller index, by compare and swap, so the
+   parents only go down, the forest never gets a cycle and the root of
+   a cluster ends up its smallest core input. an input that is not
+   core takes the smallest core neighbour it has, so the result does
+   not depend on the order the threads ran in.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+#define CLUSTER_NONE	((size_t) -1)
+
+struct cluster {
+	struct distance_vptree *t;
+	const void * const *b;
+	const size_t	*blen;
+	double		 eps;
+	size_t		 minpts;
+	unsigned char	*core;
+	size_t		*parent;	/* union-find, shared */
+	size_t		*owner;		/* smallest core neighbour */
+	int		 failed;
+};
+
+static size_t
+cluster_find(size_t *parent, size_t i)
+{
+	size_t          p, gp;
+
+	/* path halving, losing the race to another thread is harmless */
+	while ((p = parent[i]) != i) {
+		gp = parent[p];
+		if (gp != p)
+			__sync_bool_compare_and_swap(&parent[i], p, gp);
+		i = gp;
+	}
+	return (i);
+}
+
+static void
+cluster_union(size_t *parent, size_t a, size_t b)
+{
+	size_t          t;
+
+	for (;;) {
+		a = cluster_find(parent, a);
+		b = cluster_find(parent, b);
+		if (a == b)
+			return;
+		if (a < b) {
+			t = a;
+			a = b;
+			b = t;
+		}
+		if (__sync_bool_compare_and_swap(&parent[a], a, b))
+			return;
+	}
+}
+
+static void
+cluster_count(size_t lo, size_t hi, void *p)
+{
+	struct cluster *cl = p;
+	size_t          i;
+	int             n;
+
+	for (i = lo; i < hi; i++) {
+		n = distance_vptree_radius(cl->t, cl->b[i], cl->blen[i],
+		    cl->eps, NULL, 0, NULL);
+		cl->core[i] = n >= 0 && (size_t) n >= cl->minpts;
+	}
+}
+
+static void
+cluster_join(size_t lo, size_t hi, void *p)
+{
+	struct cluster *cl = p;
+	struct distance_match *m, *nm;
+	size_t          i, j, x, nm_max = 64;
+	int             k, n;
+
+	if ((m = malloc(nm_max * sizeof(*m))) == NULL) {
+		cl->failed = 1;
+		return;
+	}
+	STATS_ADD(allocs, 1);
+	for (i = lo; i < hi; i++) {
+		if (!cl->core[i])
+			continue;
+		n = distance_vptree_radius(cl->t, cl->b[i], cl->blen[i],
+		    cl->eps, m, nm_max, NULL);
+		if (n > 0 && (size_t) n > nm_max) {
+			if ((nm = realloc(m, n * sizeof(*m))) == NULL) {
+				cl->failed = 1;
+				break;
+			}
+			STATS_ADD(allocs, 1);
+			m = nm;
+			nm_max = n;
+			n = distance_vptree_radius(cl->t, cl->b[i],
+			    cl->blen[i], cl->eps, m, nm_max, NULL);
+		}
+		for (k = 0; k < n; k++) {
+			j = m[k].index;
+			if (cl->core[j]) {
+				/* the other end joins it from its side */
+				if (j > i)
+					cluster_union(cl->parent, i, j);
+				continue;
+			}
+			/* the smallest core neighbour gets the border input */
+			while ((x = cl->owner[j]) > i)
+				if (__sync_bool_compare_and_swap(&cl->owner[j],
+				    x, i))
+					break;
+		}
+	}
+	free(m);
+}
+
+/*
+   clusters the n inputs b[i] under f, which should be a metric, with
+   DBSCAN: labels[i] is set to the cluster of b[i], numbered from 0 in
+   the order of their first inputs, or -1 for noise. with minpts 0 or
+   1 there is no noise and the clusters are single linkage at eps. the
+   work is spread over nthreads threads, 0 means one per CPU. returns
+   the number of clusters, or -1 on bad arguments, if out of memory or
+   if cancelled.
+ */
+int
+distance_cluster(distance_fn f, void *arg, const void * const *b,
+    const size_t *blen, size_t n, double eps, size_t minpts, int *labels,
+    int nthreads)
+{
+	struct cluster  cl;
+	size_t          i, r;
+	int            *id, nc = 0;
+
+	if (f == NULL || eps < 0 || (labels == NULL && n > 0))
+		return (-1);
+	if (n == 0)
+		return (0);
+	memset(&cl, 0, sizeof(cl));
+	cl.b = b;
+	cl.blen = blen;
+	cl.eps = eps;
+	cl.minpts = minpts;
+	cl.core = malloc(n);
+	cl.parent = malloc(n * sizeof(size_t));
+	cl.owner = malloc(n * sizeof(size_t));
+	id = malloc(n * sizeof(int));
+	if (cl.core == NULL || cl.parent == NULL || cl.owner == NULL ||
+	    id == NULL)
+		goto fail;
+	STATS_ADD(allocs, 4);
+	if ((cl.t = distance_vptree_new(f, arg, b, blen, n, nthreads)) == NULL)
+		goto fail;
+	for (i = 0; i < n; i++) {
+		cl.parent[i] = i;
+		cl.owner[i] = CLUSTER_NONE;
+		id[i] = -1;
+	}
+
+	if (minpts > 1) {
+		if (distance_parallel_for(n, nthreads, cluster_count,
+		    &cl) == -1)
+			goto fail;
+	} else
+		memset(cl.core, 1, n);
+	if (distance_parallel_for(n, nthreads, cluster_join, &cl) == -1 ||
+	    cl.failed)
+		goto fail;
+
+	/* number the clusters by their first input */
+	for (i = 0; i < n; i++) {
+		if (cl.core[i])
+			r = cluster_find(cl.parent, i);
+		else if (cl.owner[i] != CLUSTER_NONE)
+			r = cluster_find(cl.parent, cl.owner[i]);
+		else {
+			labels[i] = -1;
+			continue;
+		}
+		if (id[r] == -1)
+			id[r] = nc++;
+		labels[i] = id[r];
+	}
+
+	distance_vptree_free(cl.t);
+	free(cl.core);
+	free(cl.parent);
+	free(cl.owner);
+	free(id);
+	return (nc);
+fail:
+	distance_vptree_free(cl.t);
+	free(cl.core);
+	free(cl.parent);
+	free(cl.owner);
+	free(id);
+	return (-1);
+}
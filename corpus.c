@@ -0,0 +1,280 @@
+/*	$Id$ */
+
+/*
+   corpus files: a set of candidate strings compiled once into a single
+   file that a process maps and uses as it is. the file is
+
+	struct corpus_header
+	uint64_t	offsets[count + 1]	entry i is [offsets[i],
+						offsets[i + 1]) of the data
+	unsigned char	data[datalen]
+	uint8_t		hist[count][32]		optional, see below
+
+   with every section 8 byte aligned and the numbers in the byte order
+   of the machine that wrote it (a file from the other byte order is
+   refused). opening maps the file and checks the header and nothing
+   else, so it takes the same time whatever the size of the corpus; a
+   broken offset table can only make entries come back empty.
+
+   hist holds the byte counts of every entry folded into 32 bins
+   (byte & 31) and capped at 255. the bag distance over the folded,
+   capped counts is still a lower bound on the levenshtein distance,
+   so distance_corpus_filter() can reject most far away entries from 32
+   bytes of precomputed data before it reads the entry itself.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+#define CORPUS_MAGIC	"DISTCRP1"
+#define CORPUS_VERSION	1
+#define CORPUS_ALIGN(x)	(((x) + 7) & ~(uint64_t) 7)
+
+struct corpus_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 flags;		/* DISTANCE_CORPUS_* */
+	uint64_t	 count;
+	uint64_t	 offsets;	/* file offsets of the sections */
+	uint64_t	 data;
+	uint64_t	 datalen;
+	uint64_t	 hist;		/* 0 without DISTANCE_CORPUS_HIST */
+	uint64_t	 size;		/* of the whole file */
+};
+
+/* the folded histogram of one entry */
+void
+corpus_hist(const unsigned char *s, size_t len, uint8_t *hist)
+{
+	unsigned        h[CORPUS_HIST];
+	size_t          i;
+
+	memset(h, 0, sizeof(h));
+	for (i = 0; i < len; i++)
+		h[s[i] & (CORPUS_HIST - 1)]++;
+	for (i = 0; i < CORPUS_HIST; i++)
+		hist[i] = h[i] > UINT8_MAX ? UINT8_MAX : h[i];
+}
+
+static int
+corpus_put(FILE *f, const void *p, size_t len, uint64_t *pos)
+{
+	static const char zero[8];
+	size_t          pad;
+
+	if (len > 0 && fwrite(p, 1, len, f) != len)
+		return (-1);
+	*pos += len;
+	pad = CORPUS_ALIGN(*pos) - *pos;
+	if (pad > 0 && fwrite(zero, 1, pad, f) != pad)
+		return (-1);
+	*pos += pad;
+	return (0);
+}
+
+/*
+   writes the n entries b[i] of blen[i] bytes to a new corpus file at
+   path, with the per entry data asked for in flags. returns 0, or -1
+   with errno set.
+ */
+int
+distance_corpus_write(const char *path, const void * const *b,
+    const size_t *blen, size_t n, int flags)
+{
+	struct corpus_header h;
+	FILE           *f;
+	uint64_t        pos, off;
+	uint8_t         hist[CORPUS_HIST];
+	size_t          i;
+
+	if ((f = fopen(path, "wb")) == NULL)
+		return (-1);
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CORPUS_MAGIC, sizeof(h.magic));
+	h.version = CORPUS_VERSION;
+	h.flags = flags & DISTANCE_CORPUS_HIST;
+	h.count = n;
+	h.offsets = CORPUS_ALIGN(sizeof(h));
+	h.data = h.offsets + (n + 1) * sizeof(uint64_t);
+	for (i = 0; i < n; i++)
+		h.datalen += blen[i];
+	h.hist = h.flags & DISTANCE_CORPUS_HIST ?
+	    CORPUS_ALIGN(h.data + h.datalen) : 0;
+	h.size = h.hist ? h.hist + n * CORPUS_HIST :
+	    CORPUS_ALIGN(h.data + h.datalen);
+
+	pos = 0;
+	if (corpus_put(f, &h, sizeof(h), &pos) == -1)
+		goto fail;
+	for (i = 0, off = 0; i <= n; off += i < n ? blen[i] : 0, i++) {
+		if (fwrite(&off, sizeof(off), 1, f) != 1)
+			goto fail;
+		pos += sizeof(off);
+	}
+	for (i = 0; i < n; i++) {
+		if (blen[i] > 0 && fwrite(b[i], 1, blen[i], f) != blen[i])
+			goto fail;
+		pos += blen[i];
+	}
+	if (corpus_put(f, NULL, 0, &pos) == -1)
+		goto fail;
+	if (h.hist)
+		for (i = 0; i < n; i++) {
+			corpus_hist(b[i], blen[i], hist);
+			if (fwrite(hist, 1, sizeof(hist), f) != sizeof(hist))
+				goto fail;
+		}
+	if (fclose(f) != 0)
+		return (-1);
+	return (0);
+
+fail:
+	fclose(f);
+	unlink(path);
+	return (-1);
+}
+
+/*
+   maps the corpus file at path. returns NULL with errno set if it
+   cannot be read or is not a corpus file.
+ */
+struct distance_corpus *
+distance_corpus_open(const char *path)
+{
+	struct distance_corpus *c;
+	struct corpus_header h;
+	struct stat     sb;
+	void           *p;
+	int             fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (NULL);
+	if (fstat(fd, &sb) == -1 || (size_t) sb.st_size < sizeof(h) ||
+	    pread(fd, &h, sizeof(h), 0) != sizeof(h))
+		goto bad;
+	if (memcmp(h.magic, CORPUS_MAGIC, sizeof(h.magic)) != 0 ||
+	    h.version != CORPUS_VERSION || h.size != (uint64_t) sb.st_size ||
+	    h.count > h.size / sizeof(uint64_t) ||
+	    h.offsets < sizeof(h) || h.offsets > h.size ||
+	    h.offsets != CORPUS_ALIGN(h.offsets) ||
+	    h.data > h.size || h.data < h.offsets ||
+	    /* subtract, a sum could wrap */
+	    (h.count + 1) * sizeof(uint64_t) > h.data - h.offsets ||
+	    h.datalen > h.size - h.data ||
+	    (h.hist != 0 && (h.hist > h.size ||
+	    h.hist != CORPUS_ALIGN(h.hist) ||
+	    h.count * CORPUS_HIST > h.size - h.hist)))
+		goto bad;
+	p = mmap(NULL, h.size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		close(fd);
+		return (NULL);
+	}
+	close(fd);
+	if ((c = malloc(sizeof(*c))) == NULL) {
+		munmap(p, h.size);
+		return (NULL);
+	}
+	STATS_ADD(allocs, 1);
+	c->map = p;
+	c->size = h.size;
+	c->count = h.count;
+	c->offsets = (const uint64_t *) ((const char *) p + h.offsets);
+	c->data = (const unsigned char *) p + h.data;
+	c->datalen = h.datalen;
+	c->hist = h.hist ? (const uint8_t *) p + h.hist : NULL;
+	return (c);
+
+bad:
+	close(fd);
+	errno = EINVAL;
+	return (NULL);
+}
+
+void
+distance_corpus_close(struct distance_corpus *c)
+{
+	if (c == NULL)
+		return;
+	munmap(c->map, c->size);
+	free(c);
+}
+
+size_t
+distance_corpus_count(const struct distance_corpus *c)
+{
+	return (c->count);
+}
+
+/* entry i, in place in the mapping, and its length in *len */
+const void *
+distance_corpus_get(const struct distance_corpus *c, size_t i, size_t *len)
+{
+	return (corpus_entry(c, i, len));
+}
+
+struct corpus_many {
+	const struct distance_corpus *c;
+	distance_fn	 f;
+	void		*arg;
+	const void	*q;
+	size_t		 qlen;
+	double		*out;
+};
+
+static void
+corpus_many_work(size_t lo, size_t hi, void *p)
+{
+	struct corpus_many *cm = p;
+	const void     *t;
+	size_t          j, m;
+
+	for (j = lo; j < hi; j++) {
+		t = corpus_entry(cm->c, j, &m);
+		cm->out[j] = cm->f(cm->q, cm->qlen, t, m, cm->arg);
+	}
+}
+
+static uint64_t
+corpus_many_cost(size_t j, void *p)
+{
+	struct corpus_many *cm = p;
+	size_t          m;
+
+	corpus_entry(cm->c, j, &m);
+	return ((uint64_t) (cm->qlen + 1) * (m + 1));
+}
+
+/*
+   fills out[j] with the distance between q and entry j, as
+   distance_many() would. returns 0, or -1 on bad arguments or if
+   cancelled.
+ */
+int
+distance_corpus_many(const struct distance_corpus *c, distance_fn f,
+    void *arg, const void *q, size_t qlen, double *out, int nthreads)
+{
+	struct corpus_many cm;
+
+	if (c == NULL || f == NULL || out == NULL)
+		return (-1);
+	cm.c = c;
+	cm.f = f;
+	cm.arg = arg;
+	cm.q = q;
+	cm.qlen = qlen;
+	cm.out = out;
+	return (distance_parallel_for_cost(c->count, nthreads,
+	    corpus_many_work, &cm, corpus_many_cost));
+}
@@ -0,0 +1,101 @@
+/* $Id$ */
+
+/*
+   mkcorpus: compiles a list of strings, one per line, into a corpus
+   file for distance_corpus_open(). the lines are read from the files
+   named on the command line, or from stdin, and keep their order; the
+   newlines are not part of the entries.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "distance.h"
+
+struct list {
+	const void	**b;
+	size_t		*blen;
+	size_t		 n;
+	size_t		 cap;
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: mkcorpus [-H] -o corpus [file ...]\n");
+	exit(1);
+}
+
+static void
+read_lines(FILE *f, const char *name, struct list *l)
+{
+	char           *line = NULL, *p;
+	size_t          cap = 0;
+	ssize_t         len;
+
+	while ((len = getline(&line, &cap, f)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			len--;
+		if (l->n == l->cap) {
+			l->cap = l->cap ? 2 * l->cap : 1024;
+			l->b = realloc(l->b, l->cap * sizeof(*l->b));
+			l->blen = realloc(l->blen, l->cap * sizeof(*l->blen));
+			if (l->b == NULL || l->blen == NULL)
+				err(1, NULL);
+		}
+		if ((p = malloc(len + 1)) == NULL)
+			err(1, NULL);
+		memcpy(p, line, len);
+		l->b[l->n] = p;
+		l->blen[l->n] = len;
+		l->n++;
+	}
+	if (ferror(f))
+		err(1, "%s", name);
+	free(line);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct list     l;
+	const char     *out = NULL;
+	FILE           *f;
+	int             ch, flags = 0, i;
+
+	while ((ch = getopt(argc, argv, "Ho:")) != -1) {
+		switch (ch) {
+		case 'H':
+			flags |= DISTANCE_CORPUS_HIST;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (out == NULL)
+		usage();
+
+	memset(&l, 0, sizeof(l));
+	if (argc == 0)
+		read_lines(stdin, "stdin", &l);
+	for (i = 0; i < argc; i++) {
+		if ((f = fopen(argv[i], "r")) == NULL)
+			err(1, "%s", argv[i]);
+		read_lines(f, argv[i], &l);
+		fclose(f);
+	}
+	if (distance_corpus_write(out, l.b, l.blen, l.n, flags) == -1)
+		err(1, "%s", out);
+
+	return (0);
+}
@@ -17,62 +17,207 @@
 #include <string.h>
 
 #include "distance.h"
+#include "distance_int.h"
+
+/*
+   the distance never exceeds the longer input, so the matrix cells
+   are only as wide as that needs: bytes for inputs of up to 255
+   bytes, shorts up to 65535 and ints beyond. the cells are computed
+   in int and stored narrow, and only two rows are kept, the one being
+   filled and the one before it.
+
+   the recurrence is that of damerau_tok_d below: a byte past either
+   end never matches and the swap state starts over on every call, so
+   calls on different threads do not disturb each other.
+ */
+#define DAMERAU_ROWS(T)							\
+static int								\
+damerau_##T(const unsigned char *s, int n, const unsigned char *t,	\
+    int m, T *prev, T *cur)						\
+{									\
+	int             i, j, cost, swap = 0, a, b, c;			\
+	T              *tmp;						\
+									\
+	for (j = 0; j <= m; j++)					\
+		prev[j] = j;						\
+	for (i = 1; i <= n; i++) {					\
+		cur[0] = i;						\
+		for (j = 1; j <= m; j++) {				\
+			/* modified from LD to tolerate	*/		\
+			/* adjascent character swaps.	*/		\
+			if (s[i - 1] == t[j - 1])			\
+				cost = 0;				\
+			else if (i < n && j < m &&			\
+			    s[i - 1] == t[j] && s[i] == t[j - 1]) {	\
+				/* tolerate swapped adjascent chars */	\
+				swap = 1;				\
+				cost = 0;				\
+			} else if (swap && i > 1 && j > 1 &&		\
+			    s[i - 2] == t[j - 1] &&			\
+			    s[i - 1] == t[j - 2]) {			\
+				/* next pass screwed up, reset swap */	\
+				cost = 0;				\
+				swap = 0;	/* turn off */		\
+			} else						\
+				cost = 1;				\
+			a = cur[j - 1] + 1;				\
+			b = prev[j] + 1;				\
+			c = prev[j - 1] + cost;				\
+			cur[j] = (min(a,(min(b,c))));			\
+		}							\
+		tmp = prev;						\
+		prev = cur;						\
+		cur = tmp;						\
+	}								\
+	return (prev[m]);						\
+}
+
+DAMERAU_ROWS(uint8_t)
+DAMERAU_ROWS(uint16_t)
+DAMERAU_ROWS(int)
 
 /* Compute damerau distance between d1 and d2 */
 
+DISTANCE_CLONES
 int
 damerau_d(const void *d1, size_t len1, const void *d2, size_t len2)
 {
-	int             k, i, j, n, m, cost, *d, distance, a, b, c;
-	char           *s, *t;	
+	int             n, m, distance;
+	size_t          l;
+	const unsigned char *s, *t;
+	void           *d;
 
 	//Step 1
-	s = (char *) d1;
-	t = (char *) d2;
+	s = d1;
+	t = d2;
 	n = len1;
 	m = len2;
 	if (n != 0 && m != 0) {
-		static int swap;
-
-		d = malloc((sizeof(int)) * (m + 1) * (n + 1));
-		m++;
-		n++;
-		//Step 2
-		for (k = 0; k < n; k++)
-			d[k] = k;
-		for (k = 0; k < m; k++)
-			d[k * n] = k;
-		//Step 3 and 4
-		for (i = 1; i < n; i++) {
-			for (j = 1; j < m; j++) {
-				//Step 5
-				//modified from LD to tolerate
-				//adjascent character swaps.
-				if (s[i - 1] == t[j - 1])
-					cost = 0;
-				else if ((s[i - 1] == t[j]) &&
-					 (s[i] == t[j - 1])) {
-					/* tolerate swapped adjascent chars */
-					swap = 1;
-					cost = 0;
-				} else if ((swap) && (s[i - 2] == t[j - 1]) &&
-					   (s[i - 1] == t[j - 2])) {
-					/* next pass screwed up, reset swap */
-					cost = 0;
-					swap = 0;	/* turn off */
-				} else
-					cost = 1;
-				//Step 6
-				a = d[(j - 1) * n + i] + 1;
-				b = d[j * n + i - 1] + 1;
-				c = d[(j - 1) * n + i - 1] + cost;
-				d[j * n + i] = (min(a,(min(b,c))));
-			}
+		l = max(len1, len2);
+		if (l <= UINT8_MAX) {
+			/* small enough for the stack */
+			uint8_t         rows[2 * (UINT8_MAX + 1)];
+
+			STATS_CALL(DISTANCE_DAMERAU, len1, len2,
+			    (unsigned long long) len1 * len2,
+			    DISTANCE_KERNEL_NARROW);
+			return (damerau_uint8_t(s, n, t, m, rows, rows + m + 1));
+		}
+		if ((d = malloc((l <= UINT16_MAX ? sizeof(uint16_t) :
+		    sizeof(int)) * 2 * (m + 1))) == NULL)
+			return (-1);
+		STATS_ADD(allocs, 1);
+		if (l <= UINT16_MAX) {
+			STATS_CALL(DISTANCE_DAMERAU, len1, len2,
+			    (unsigned long long) len1 * len2,
+			    DISTANCE_KERNEL_NARROW);
+			distance = damerau_uint16_t(s, n, t, m, d,
+			    (uint16_t *) d + m + 1);
+		} else {
+			STATS_CALL(DISTANCE_DAMERAU, len1, len2,
+			    (unsigned long long) len1 * len2,
+			    DISTANCE_KERNEL_FULL);
+			distance = damerau_int(s, n, t, m, d, (int *) d + m + 1);
 		}
-		distance = d[n * m - 1];
 		free(d);
 		return distance;
-	} else
+	} else {
+		STATS_CALL(DISTANCE_DAMERAU, len1, len2, 0,
+		    DISTANCE_KERNEL_TRIVIAL);
 		return (max(m,n));
+	}
 	// return the full string cost if one is zero length
 }
+
+/*
+   the same recurrence over tokens of width bytes (1, 2, 4 or 8),
+   lengths counted in tokens. only two rows of the matrix are kept, a
+   token past either end never matches and the swap state starts over
+   on every call.
+ */
+#define DAMERAU_TOK(W)							\
+static int								\
+damerau_tok_##W(const void *s, size_t n, const void *t, size_t m,	\
+    int *prev, int *cur)						\
+{									\
+	size_t          i, j;						\
+	int             cost, swap = 0, *tmp;				\
+	uint64_t        si, tj;						\
+									\
+	for (j = 0; j <= m; j++)					\
+		prev[j] = j;						\
+	for (i = 1; i <= n; i++) {					\
+		cur[0] = i;						\
+		si = token_get(s, i - 1, W);				\
+		for (j = 1; j <= m; j++) {				\
+			tj = token_get(t, j - 1, W);			\
+			if (si == tj)					\
+				cost = 0;				\
+			else if (i < n && j < m &&			\
+			    si == token_get(t, j, W) &&			\
+			    token_get(s, i, W) == tj) {			\
+				swap = 1;				\
+				cost = 0;				\
+			} else if (swap && i > 1 && j > 1 &&		\
+			    token_get(s, i - 2, W) == tj &&		\
+			    si == token_get(t, j - 2, W)) {		\
+				cost = 0;				\
+				swap = 0;				\
+			} else						\
+				cost = 1;				\
+			cur[j] = min(cur[j - 1] + 1,			\
+			    min(prev[j] + 1, prev[j - 1] + cost));	\
+		}							\
+		tmp = prev;						\
+		prev = cur;						\
+		cur = tmp;						\
+	}								\
+	return (prev[m]);						\
+}
+
+DAMERAU_TOK(1)
+DAMERAU_TOK(2)
+DAMERAU_TOK(4)
+DAMERAU_TOK(8)
+
+DISTANCE_CLONES
+int
+damerau_tok_d(const void *d1, size_t len1, const void *d2, size_t len2,
+    size_t width)
+{
+	int            *rows, distance;
+
+	if (width != 1 && width != 2 && width != 4 && width != 8)
+		return (-1);
+	if (len1 == 0 || len2 == 0) {
+		STATS_CALL(DISTANCE_DAMERAU, len1, len2, 0,
+		    DISTANCE_KERNEL_TRIVIAL);
+		return (max(len1, len2));
+	}
+	if ((rows = malloc(2 * (len2 + 1) * sizeof(int))) == NULL)
+		return (-1);
+	STATS_ADD(allocs, 1);
+	STATS_CALL(DISTANCE_DAMERAU, len1, len2,
+	    (unsigned long long) len1 * len2, DISTANCE_KERNEL_FULL);
+
+	switch (width) {
+	case 1:
+		distance = damerau_tok_1(d1, len1, d2, len2, rows,
+		    rows + len2 + 1);
+		break;
+	case 2:
+		distance = damerau_tok_2(d1, len1, d2, len2, rows,
+		    rows + len2 + 1);
+		break;
+	case 4:
+		distance = damerau_tok_4(d1, len1, d2, len2, rows,
+		    rows + len2 + 1);
+		break;
+	default:
+		distance = damerau_tok_8(d1, len1, d2, len2, rows,
+		    rows + len2 + 1);
+		break;
+	}
+	free(rows);
+	return (distance);
+}
@@ -1,4 +1,7 @@
 /*	$Id: distance.h,v 1.7 2004/10/10 09:12:18 jose Exp $ */
+#ifndef _DISTANCE_H_
+#define _DISTANCE_H_
+
 #include <sys/cdefs.h>
 
 __BEGIN_DECLS
@@ -23,6 +26,31 @@ int     levenshtein_d(const void *d1, size_t len1, const void *d2,
     size_t len2);
 /* calculate the damerau distance, like LD but tolerate adjascent swaps */
 int 	damerau_d(const void *d1, size_t len1, const void *d2, size_t len2);
+/* the same two over tokens of width 1, 2, 4 or 8 bytes */
+int	levenshtein_tok_d(const void *d1, size_t len1, const void *d2,
+    size_t len2, size_t width);
+int	damerau_tok_d(const void *d1, size_t len1, const void *d2,
+    size_t len2, size_t width);
+/* levenshtein and damerau distances of UTF-8 text, in codepoints */
+int	levenshtein_utf8_d(const void *d1, size_t len1, const void *d2,
+    size_t len2);
+int	damerau_utf8_d(const void *d1, size_t len1, const void *d2,
+    size_t len2);
+/* called with each end offset of a match found by levenshtein_search */
+typedef int	(*distance_hit_fn)(size_t end, int distance, void *arg);
+/* every place in text where pat occurs with at most k edits */
+int	levenshtein_search(const void *pat, size_t m, const void *text,
+    size_t n, int k, distance_hit_fn cb, void *arg);
+int	levenshtein_search_file(const void *pat, size_t m, const char *path,
+    int k, distance_hit_fn cb, void *arg);
+/* levenshtein_d and needleman_wunsch_d of huge inputs on many threads */
+int	levenshtein_mt_d(const void *d1, size_t len1, const void *d2,
+    size_t len2, int nthreads);
+double	needleman_wunsch_mt_d(const void *d1, size_t len1, const void *d2,
+    size_t len2, struct matrix *m, int nthreads);
+/* the levenshtein distance if at most k, otherwise k + 1 */
+int	levenshtein_bounded_d(const void *d1, size_t len1, const void *d2,
+    size_t len2, int k);
 /* calculate the hamming distance */
 int     hamming_d(const void *d1, size_t len1, const void *d2,
     size_t len2);
@@ -35,13 +63,368 @@ double  bloom_d(const void *digest1, const void *digest2,
 /* calculate a variable cost edit distance */
 double  needleman_wunsch_d(const void *d1, size_t len1, const void *d2, 
     size_t len2, struct matrix *m);
+/* a cost matrix scaled to integers, for needleman_wunsch_q_d */
+struct matrix_q {
+	int	scale;			/* costs times scale */
+	int	maxcost;		/* largest scaled cost, either sign */
+	int	conversion[255][255];
+	int	insertion[255][255];
+};
+int	matrix_quantize(const struct matrix *m, struct matrix_q *q);
+/* needleman_wunsch_d in integers, returns the unscaled cost */
+double	needleman_wunsch_q_d(const void *d1, size_t len1, const void *d2,
+    size_t len2, const struct matrix_q *q);
 /* calculate the jaccard distance between two strings */
 float	jaccard_d(const void *d1, size_t len1, const void *d2,
     size_t len2);
 /* calculate the minkowski distance between two strings */
 float 	minkowski_d(const void *d1, size_t len1, const void *d2, 
     size_t len2, int power);
+/* 1 minus the jaro and jaro-winkler similarities, for names */
+double	jaro_d(const void *d1, size_t len1, const void *d2, size_t len2);
+double	jaro_winkler_d(const void *d1, size_t len1, const void *d2,
+    size_t len2, double p);
+/* jaro_winkler_d between q and every b[j], into out[j] */
+int	jaro_winkler_many(const void *q, size_t qlen, const void * const *b,
+    const size_t *blen, size_t nb, double p, double *out, int nthreads);
+/* distances between the q-gram profiles of two strings */
+double	qgram_d(const void *d1, size_t len1, const void *d2, size_t len2,
+    size_t q);
+double	qgram_cosine_d(const void *d1, size_t len1, const void *d2,
+    size_t len2, size_t q);
+double	qgram_dice_d(const void *d1, size_t len1, const void *d2,
+    size_t len2, size_t q);
+
+/* metric identifiers, used by the statistics below */
+enum distance_metric {
+	DISTANCE_LEVENSHTEIN,
+	DISTANCE_DAMERAU,
+	DISTANCE_HAMMING,
+	DISTANCE_BLOOM,
+	DISTANCE_NEEDLEMAN_WUNSCH,
+	DISTANCE_JACCARD,
+	DISTANCE_MINKOWSKI,
+	DISTANCE_JARO,
+	DISTANCE_QGRAM,
+	DISTANCE_NMETRICS
+};
+
+/* which implementation of a metric ran */
+enum distance_kernel {
+	DISTANCE_KERNEL_TRIVIAL,	/* empty or mismatched inputs */
+	DISTANCE_KERNEL_FULL,		/* scalar, full matrix */
+	DISTANCE_KERNEL_LINEAR,		/* single pass over the inputs */
+	DISTANCE_KERNEL_BITPARALLEL,	/* 64 rows per word, myers.c */
+	DISTANCE_KERNEL_DIAGONAL,	/* few edits on long inputs, lv.c */
+	DISTANCE_KERNEL_NARROW,		/* 8 or 16 bit cells */
+	DISTANCE_NKERNELS
+};
+
+#define DISTANCE_LEN_BUCKETS	32	/* floor(log2(max(len1, len2))) + 1 */
+
+/*
+   runtime counters, only kept when the library is built with
+   DISTANCE_STATS. each thread counts into its own block, so the hot
+   paths need no locks or atomics; distance_stats_get() sums them up.
+ */
+struct distance_stats {
+	unsigned long long	calls[DISTANCE_NMETRICS];
+	unsigned long long	calls_by_len[DISTANCE_NMETRICS]
+				    [DISTANCE_LEN_BUCKETS];
+	unsigned long long	cells[DISTANCE_NMETRICS];	/* dp cells */
+	unsigned long long	bytes[DISTANCE_NMETRICS];	/* input read */
+	unsigned long long	kernels[DISTANCE_NKERNELS];
+	unsigned long long	allocs;
+	unsigned long long	band_exits;	/* band ruled a pair out */
+	unsigned long long	threshold_exits; /* bound exceeded early */
+};
+
+/* sum of the counters of every thread, -1 if stats are compiled out */
+int	distance_stats_get(struct distance_stats *st);
+/* zero the counters, best called while no distances are computed */
+void	distance_stats_reset(void);
+
+/* common signature for the batch interfaces, arg is metric specific */
+typedef double	(*distance_fn)(const void *d1, size_t len1, const void *d2,
+    size_t len2, void *arg);
+/* distance_fn wrappers for the functions above */
+double	levenshtein_fn(const void *d1, size_t len1, const void *d2,
+    size_t len2, void *arg);
+double	damerau_fn(const void *d1, size_t len1, const void *d2,
+    size_t len2, void *arg);
+double	hamming_fn(const void *d1, size_t len1, const void *d2,
+    size_t len2, void *arg);
+double	jaccard_fn(const void *d1, size_t len1, const void *d2,
+    size_t len2, void *arg);
+/* arg is an int * power, NULL for 1 */
+double	minkowski_fn(const void *d1, size_t len1, const void *d2,
+    size_t len2, void *arg);
+double	jaro_fn(const void *d1, size_t len1, const void *d2,
+    size_t len2, void *arg);
+/* arg is a double * prefix scale, NULL for 0.1 */
+double	jaro_winkler_fn(const void *d1, size_t len1, const void *d2,
+    size_t len2, void *arg);
+/* arg is a size_t * q, NULL for 2 */
+double	qgram_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg);
+double	qgram_cosine_fn(const void *d1, size_t len1, const void *d2,
+    size_t len2, void *arg);
+double	qgram_dice_fn(const void *d1, size_t len1, const void *d2,
+    size_t len2, void *arg);
+/* arg is a struct matrix * */
+double	needleman_wunsch_fn(const void *d1, size_t len1, const void *d2,
+    size_t len2, void *arg);
+
+/* one result from distance_extract() */
+struct distance_match {
+	size_t	index;		/* position in the list of choices */
+	double	distance;
+};
+
+/* distances between every a[i] and b[j], into out[i * nb + j] */
+int	distance_cdist(distance_fn f, void *arg, const void * const *a,
+    const size_t *alen, size_t na, const void * const *b,
+    const size_t *blen, size_t nb, double *out, int nthreads);
+/* distances between q and every b[j], into out[j] */
+int	distance_many(distance_fn f, void *arg, const void *q, size_t qlen,
+    const void * const *b, const size_t *blen, size_t nb, double *out,
+    int nthreads);
+/* distances between every pair in a, condensed upper triangle */
+int	distance_pdist(distance_fn f, void *arg, const void * const *a,
+    const size_t *alen, size_t n, double *out, int nthreads);
+/* the k choices closest to q, at most max_distance away */
+int	distance_extract(distance_fn f, void *arg, const void *q,
+    size_t qlen, const void * const *b, const size_t *blen, size_t nb,
+    size_t k, double max_distance, struct distance_match *out,
+    int nthreads);
+
+/* the threads every call taking an nthreads argument runs on */
+#define DISTANCE_POOL_AFFINITY	0x1	/* keep each thread to one CPU */
+
+/* an application's own threads, to run the pool's work on */
+struct distance_executor {
+	/* runs fn(task) on some thread, soon */
+	void	(*submit)(void (*fn)(void *), void *task, void *ctx);
+	void	*ctx;
+	int	 nthreads;	/* what nthreads 0 means, 0 for ncpu */
+};
+
+int	distance_pool_set(int nthreads, int flags);
+void	distance_pool_executor(const struct distance_executor *ex);
+/* parallel calls of this thread fail once *flag is set, NULL for none */
+void	distance_cancel(const volatile int *flag);
+
+/* a batch running in the background */
+struct distance_async;
+/* called when it is done, status is what the batch function returned */
+typedef void	(*distance_async_fn)(struct distance_async *da, int status,
+    void *arg);
+
+struct distance_async *distance_async_cdist(distance_fn f, void *arg,
+    const void * const *a, const size_t *alen, size_t na,
+    const void * const *b, const size_t *blen, size_t nb, double *out,
+    int nthreads, distance_async_fn cb, void *cbarg);
+struct distance_async *distance_async_many(distance_fn f, void *arg,
+    const void *q, size_t qlen, const void * const *b, const size_t *blen,
+    size_t nb, double *out, int nthreads, distance_async_fn cb,
+    void *cbarg);
+struct distance_async *distance_async_pdist(distance_fn f, void *arg,
+    const void * const *a, const size_t *alen, size_t n, double *out,
+    int nthreads, distance_async_fn cb, void *cbarg);
+/* readable once the batch is done */
+int	distance_async_fd(const struct distance_async *da);
+int	distance_async_done(struct distance_async *da);
+int	distance_async_wait(struct distance_async *da);
+void	distance_async_cancel(struct distance_async *da);
+void	distance_async_free(struct distance_async *da);
+
+
+/* the q-gram counts of one input, built once and compared many times */
+struct distance_qgram;
+
+enum {
+	DISTANCE_QGRAM_UKKONEN,		/* sum of the count differences */
+	DISTANCE_QGRAM_COSINE,		/* 1 - cosine of the counts */
+	DISTANCE_QGRAM_DICE		/* 1 - dice coefficient */
+};
+
+struct distance_qgram *distance_qgram_new(const void *d, size_t len,
+    size_t q);
+void	distance_qgram_free(struct distance_qgram *qp);
+size_t	distance_qgram_count(const struct distance_qgram *qp);
+int	distance_qgram_profiles(const void * const *b, const size_t *blen,
+    size_t n, size_t q, struct distance_qgram **out, int nthreads);
+double	distance_qgram_d(int metric, const struct distance_qgram *a,
+    const struct distance_qgram *b);
+/* distance_qgram_d between q and every b[j], into out[j] */
+int	distance_qgram_many(int metric, const struct distance_qgram *q,
+    const struct distance_qgram * const *b, size_t nb, double *out,
+    int nthreads);
+
+
+/* lower bound filters run by distance_filter(), in this order */
+enum {
+	DISTANCE_FILTER_LENGTH,		/* difference in length */
+	DISTANCE_FILTER_HISTOGRAM,	/* byte counts, the bag distance */
+	DISTANCE_FILTER_QGRAM,		/* shared 2-grams */
+	DISTANCE_FILTER_VERIFY,		/* the distance itself */
+	DISTANCE_FILTER_NSTAGES
+};
+
+#define DISTANCE_FILTER_LENGTH_BIT	(1 << DISTANCE_FILTER_LENGTH)
+#define DISTANCE_FILTER_HISTOGRAM_BIT	(1 << DISTANCE_FILTER_HISTOGRAM)
+#define DISTANCE_FILTER_QGRAM_BIT	(1 << DISTANCE_FILTER_QGRAM)
+#define DISTANCE_FILTER_ALL		(DISTANCE_FILTER_LENGTH_BIT | \
+    DISTANCE_FILTER_HISTOGRAM_BIT | DISTANCE_FILTER_QGRAM_BIT)
+
+/* candidates each stage of distance_filter() turned away */
+struct distance_filter_stats {
+	unsigned long long	tested;
+	unsigned long long	rejected[DISTANCE_FILTER_NSTAGES];
+};
+
+/* distances between q and every b[j] that are at most k, else -1 */
+int	distance_filter(int metric, int stages, const void *q, size_t qlen,
+    const void * const *b, const size_t *blen, size_t nb, int k,
+    double *out, struct distance_filter_stats *fs, int nthreads);
+
+
+/* a corpus file of candidates, mapped by distance_corpus_open() */
+struct distance_corpus;
+
+#define DISTANCE_CORPUS_HIST	0x1	/* keep byte histograms */
+
+int	distance_corpus_write(const char *path, const void * const *b,
+    const size_t *blen, size_t n, int flags);
+struct distance_corpus *distance_corpus_open(const char *path);
+void	distance_corpus_close(struct distance_corpus *c);
+size_t	distance_corpus_count(const struct distance_corpus *c);
+const void *distance_corpus_get(const struct distance_corpus *c, size_t i,
+    size_t *len);
+/* distance_many() and distance_filter() over the entries of a corpus */
+int	distance_corpus_many(const struct distance_corpus *c, distance_fn f,
+    void *arg, const void *q, size_t qlen, double *out, int nthreads);
+int	distance_corpus_filter(const struct distance_corpus *c, int metric,
+    int stages, const void *q, size_t qlen, int k, double *out,
+    struct distance_filter_stats *fs, int nthreads);
+
+
+/* a vantage point tree over inputs under any metric distance_fn */
+struct distance_vptree;
+
+/* distances a query computed, and the ones the tree saved it */
+struct distance_vptree_stats {
+	unsigned long long	evaluated;
+	unsigned long long	pruned;
+};
+
+struct distance_vptree *distance_vptree_new(distance_fn f, void *arg,
+    const void * const *b, const size_t *blen, size_t n, int nthreads);
+void	distance_vptree_free(struct distance_vptree *t);
+/* every input within r of q, closest first, up to nout of them */
+int	distance_vptree_radius(const struct distance_vptree *t,
+    const void *q, size_t qlen, double r, struct distance_match *out,
+    size_t nout, struct distance_vptree_stats *st);
+/* the k inputs closest to q, closest first */
+int	distance_vptree_knn(const struct distance_vptree *t, const void *q,
+    size_t qlen, size_t k, struct distance_match *out,
+    struct distance_vptree_stats *st);
+
+/* DBSCAN, or single linkage with minpts 1, using a vptree for range queries */
+int	distance_cluster(distance_fn f, void *arg, const void * const *b,
+    const size_t *blen, size_t n, double eps, size_t minpts, int *labels,
+    int nthreads);
+
+
+/* what distance_knng() did to build its graph */
+struct distance_knng_stats {
+	unsigned long long	evaluated;	/* distances computed */
+	unsigned long long	rounds;
+	unsigned long long	updates;	/* neighbours changed */
+};
+
+/* an approximate k nearest neighbour graph, by NN-descent */
+int	distance_knng(distance_fn f, void *arg, const void * const *b,
+    const size_t *blen, size_t n, size_t k, double rho, double delta,
+    struct distance_match *out, struct distance_knng_stats *st,
+    int nthreads);
+/* the share of the true k nearest neighbours the graph has */
+double	distance_knng_recall(distance_fn f, void *arg,
+    const void * const *b, const size_t *blen, size_t n, size_t k,
+    const struct distance_match *g, size_t nsample, int nthreads);
 
+/* levenshtein_d() of a fixed string and one that grows and shrinks */
+struct distance_stream;
+
+struct distance_stream *distance_stream_new(const void *s, size_t m);
+void	distance_stream_free(struct distance_stream *ds);
+int	distance_stream_append(struct distance_stream *ds, const void *text,
+    size_t n);
+void	distance_stream_pop(struct distance_stream *ds, size_t n);
+void	distance_stream_set_depth(struct distance_stream *ds, size_t depth);
+size_t	distance_stream_len(const struct distance_stream *ds);
+int	distance_stream_distance(const struct distance_stream *ds);
+int	distance_stream_prefix_distance(const struct distance_stream *ds);
+
+
+/* a bounded cache of the distances of one distance_fn */
+struct distance_cache;
+
+struct distance_cache_stats {
+	unsigned long long	hits;
+	unsigned long long	misses;
+	unsigned long long	evictions;
+};
+
+struct distance_cache *distance_cache_new(distance_fn f, void *arg,
+    size_t nentries);
+void	distance_cache_free(struct distance_cache *dc);
+/* arg is the struct distance_cache */
+double	distance_cache_fn(const void *d1, size_t len1, const void *d2,
+    size_t len2, void *arg);
+void	distance_cache_stats(const struct distance_cache *dc,
+    struct distance_cache_stats *st);
+
+
+/* edit operations of an alignment, turning d1 into d2 */
+enum distance_edit {
+	DISTANCE_EDIT_MATCH,		/* same byte in both */
+	DISTANCE_EDIT_SUB,		/* a byte of d1 replaced */
+	DISTANCE_EDIT_INS,		/* a byte of d2 inserted */
+	DISTANCE_EDIT_DEL		/* a byte of d1 deleted */
+};
+
+/* len edits of the same kind in a row */
+struct distance_edit_run {
+	int	op;			/* enum distance_edit */
+	size_t	len;
+};
+
+/* result of the alignment functions, free with distance_script_free */
+struct distance_script {
+	struct distance_edit_run *runs;
+	size_t	nruns;
+	size_t	nalloc;			/* internal */
+	double	cost;			/* the distance */
+};
+
+int	levenshtein_align(const void *d1, size_t len1, const void *d2,
+    size_t len2, struct distance_script *sc, int nthreads);
+int	needleman_wunsch_align(const void *d1, size_t len1, const void *d2,
+    size_t len2, struct matrix *m, struct distance_script *sc,
+    int nthreads);
+void	distance_script_free(struct distance_script *sc);
+
+/* a compiled set of patterns for approximate multi-pattern search */
+struct distance_matcher;
+/* called with each pattern, end offset of a match */
+typedef int	(*distance_pattern_fn)(size_t pattern, size_t end,
+    int distance, void *arg);
+struct distance_matcher *distance_matcher_new(const void * const *pats,
+    const size_t *lens, size_t npats, int k);
+int	distance_matcher_scan(const struct distance_matcher *dm,
+    const void *text, size_t n, distance_pattern_fn cb, void *arg);
+void	distance_matcher_free(struct distance_matcher *dm);
 
 /* useful shortcuts */
 #define MANHATTAN_D(d1, len1, d2, len2)				\
@@ -50,3 +433,5 @@ float 	minkowski_d(const void *d1, size_t len1, const void *d2,
 	minkowski_d(d1, len1, d2, len2, 2)
 
 __END_DECLS
+
+#endif	/* _DISTANCE_H_ */
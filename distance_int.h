@@ -0,0 +1,291 @@
+/*	$Id$ */
+
+/*
+   internal interfaces shared between the libdistance sources. nothing
+   in here is installed or part of the public API, see distance.h for
+   that.
+ */
+
+#ifndef _DISTANCE_INT_H_
+#define _DISTANCE_INT_H_
+
+#include <sys/cdefs.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "distance.h"
+
+__BEGIN_DECLS
+
+/*
+   DISTANCE_CLONES marks the hot kernels. where the toolchain and the C
+   library support ifunc (GNU/Linux on x86-64) each is compiled for the
+   baseline, AVX2 and AVX-512 and the dynamic loader picks the best one
+   the CPU can run, so one binary package gets the wide vectors without
+   being built per host. elsewhere, or with DISTANCE_NO_CLONES, it is
+   empty.
+ */
+#if defined(__has_attribute)
+#if __has_attribute(target_clones) && defined(__x86_64__) && \
+    defined(__GLIBC__) && !defined(DISTANCE_NO_CLONES)
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+/* the x86-64-v4 level brings the AVX-512 byte and word instructions */
+#define DISTANCE_CLONES							\
+	__attribute__((target_clones("default", "arch=x86-64-v3",	\
+	    "arch=x86-64-v4")))
+#else
+#define DISTANCE_CLONES							\
+	__attribute__((target_clones("default", "avx2", "avx512f")))
+#endif
+#endif
+#endif
+#ifndef DISTANCE_CLONES
+#define DISTANCE_CLONES
+#endif
+
+/* run fn over [0, n) in chunks on up to nthreads threads, 0 means all */
+typedef void	(*distance_work_fn)(size_t lo, size_t hi, void *arg);
+
+/* the estimated cost of item i, such as the product of two lengths */
+typedef uint64_t (*distance_cost_fn)(size_t i, void *arg);
+
+int	distance_ncpu(void);
+int	distance_pool_size(void);
+int	distance_parallel_for(size_t n, int nthreads, distance_work_fn fn,
+    void *arg);
+int	distance_parallel_for_cost(size_t n, int nthreads, distance_work_fn fn,
+    void *arg, distance_cost_fn cost);
+/* non-zero once the calling thread's distance_cancel() flag is set */
+int	distance_cancelled(void);
+
+/* a task to run once on a thread of the pool, owned by the submitter */
+struct distance_task {
+	void		(*fn)(void *);
+	void		*arg;
+	struct distance_task *next;
+};
+
+int	distance_pool_submit(struct distance_task *t);
+
+/*
+   bit-parallel edit distance (Myers 1999, with Hyyrö's multi-word
+   blocks). the pattern runs down the rows in blocks of 64, every
+   column of the text is processed one 64-bit word per block. struct
+   myers_peq holds the match masks of the pattern: for one byte tokens
+   a direct table indexed by the byte, for wider tokens a small open
+   addressing hash of the distinct tokens the pattern contains.
+ */
+#define MYERS_WORD	64
+
+struct myers_peq {
+	size_t		 m;		/* pattern length, in tokens */
+	size_t		 nblocks;	/* (m + 63) / 64 */
+	size_t		 width;		/* token size, 1, 2, 4 or 8 */
+	uint64_t	 hbit;		/* row m's bit in the last block */
+	uint64_t	*direct;	/* [256][nblocks], width 1 */
+	uint64_t	*keys;		/* [cap], wider tokens */
+	unsigned char	*used;		/* [cap] */
+	uint64_t	*masks;		/* [cap][nblocks] */
+	size_t		 cap;		/* power of two */
+	uint64_t	*zero;		/* [nblocks], tokens not in pattern */
+	void		*mem;		/* the one allocation behind these */
+};
+
+int	myers_peq_init(struct myers_peq *peq, const void *pat, size_t m,
+    size_t width);
+void	myers_peq_free(struct myers_peq *peq);
+/*
+   global distance of the pattern against text, as for levenshtein_d,
+   or k + 1 as soon as it must be more than k
+ */
+size_t	myers_distance(const struct myers_peq *peq, const void *text,
+    size_t n, size_t k);
+/* the same for byte patterns of 1 to 64 bytes, peq is a [256] table */
+size_t	myers_distance_word(const uint64_t *peq, size_t m, const void *text,
+    size_t n, size_t k);
+/* every distance of a byte pattern to a prefix of text, row[0..n] */
+int	myers_row(const struct myers_peq *peq, const void *text, size_t n,
+    size_t *row);
+
+/*
+   semi-global search state, search.c. the current column of the
+   matrix for a byte pattern; row 0 is all zeros so a match may start
+   anywhere. every offset whose row m is at most k goes to cb.
+ */
+struct myers_search {
+	const struct myers_peq *peq;
+	uint64_t	*pv;
+	uint64_t	*mv;
+	size_t		 score;		/* row m of the current column */
+	size_t		 pos;		/* text offset of the next column */
+	size_t		 k;
+	distance_hit_fn	 cb;
+	void		*arg;
+	int		 nhits;
+	int		 done;		/* the callback asked to stop */
+};
+
+void	myers_search_start(struct myers_search *ms,
+    const struct myers_peq *peq, uint64_t *vec, size_t pos, size_t k,
+    distance_hit_fn cb, void *arg);
+void	myers_search_feed(struct myers_search *ms, const void *text,
+    size_t n);
+
+/*
+   diagonal transition levenshtein distance, lv.c: the distance if at
+   most k, else k + 1, or (size_t) -1 if out of memory
+ */
+size_t	lv_distance(const void *d1, size_t n, const void *d2, size_t m,
+    size_t k);
+
+/*
+   a mapped corpus file, corpus.c. the offsets are not checked when the
+   file is opened, an entry that falls outside the data comes back
+   empty.
+ */
+#define CORPUS_HIST	32		/* bins of the folded histograms */
+
+struct distance_corpus {
+	void		*map;
+	size_t		 size;
+	size_t		 count;
+	const uint64_t	*offsets;	/* [count + 1] */
+	const unsigned char *data;
+	uint64_t	 datalen;
+	const uint8_t	*hist;		/* [count][CORPUS_HIST] or NULL */
+};
+
+void	corpus_hist(const unsigned char *s, size_t len, uint8_t *hist);
+
+static __inline const unsigned char *
+corpus_entry(const struct distance_corpus *c, size_t i, size_t *len)
+{
+	uint64_t        lo = c->offsets[i], hi = c->offsets[i + 1];
+
+	if (lo > hi || hi > c->datalen)
+		lo = hi = 0;
+	*len = hi - lo;
+	return (c->data + lo);
+}
+
+/* token i of a sequence of width byte tokens */
+static __inline uint64_t
+token_get(const void *p, size_t i, size_t width)
+{
+	const unsigned char *b = (const unsigned char *) p + i * width;
+	uint16_t        v16;
+	uint32_t        v32;
+	uint64_t        v64;
+
+	switch (width) {
+	case 1:
+		return (*b);
+	case 2:
+		memcpy(&v16, b, 2);
+		return (v16);
+	case 4:
+		memcpy(&v32, b, 4);
+		return (v32);
+	default:
+		memcpy(&v64, b, 8);
+		return (v64);
+	}
+}
+
+static __inline size_t
+token_hash(uint64_t v, size_t cap)
+{
+	return ((size_t) ((v * 0x9e3779b97f4a7c15ULL) >> 32) & (cap - 1));
+}
+
+/* the nblocks match masks of token v */
+static __inline const uint64_t *
+myers_peq_lookup(const struct myers_peq *peq, uint64_t v)
+{
+	size_t          h;
+
+	if (peq->direct != NULL)
+		return (peq->direct + v * peq->nblocks);
+	for (h = token_hash(v, peq->cap); peq->used[h];
+	    h = (h + 1) & (peq->cap - 1))
+		if (peq->keys[h] == v)
+			return (peq->masks + h * peq->nblocks);
+	return (peq->zero);
+}
+
+/*
+   advance one block of the pattern by one text column. pv and mv are
+   the vertical +1 and -1 deltas of the block, eq the match mask of the
+   column's token, hin the horizontal delta coming in at the top of the
+   block. returns the horizontal delta leaving at row hbit.
+ */
+static __inline int
+myers_block(uint64_t *pv, uint64_t *mv, uint64_t eq, int hin, uint64_t hbit)
+{
+	uint64_t        Pv = *pv, Mv = *mv, Xv, Xh, Ph, Mh;
+	int             hout = 0;
+
+	Xv = eq | Mv;
+	if (hin < 0)
+		eq |= 1;
+	Xh = (((eq & Pv) + Pv) ^ Pv) | eq;
+	Ph = Mv | ~(Xh | Pv);
+	Mh = Pv & Xh;
+	if (Ph & hbit)
+		hout = 1;
+	else if (Mh & hbit)
+		hout = -1;
+	Ph <<= 1;
+	Mh <<= 1;
+	if (hin < 0)
+		Mh |= 1;
+	else if (hin > 0)
+		Ph |= 1;
+	*pv = Mh | ~(Xv | Ph);
+	*mv = Ph & Xv;
+
+	return (hout);
+}
+
+/*
+   statistics hooks, see struct distance_stats. they compile to nothing
+   unless the library is built with DISTANCE_STATS.
+ */
+#ifdef DISTANCE_STATS
+extern __thread struct distance_stats *distance_stats_tls;
+struct distance_stats *distance_stats_self(void);
+
+#define STATS_SELF()							\
+	(distance_stats_tls != NULL ? distance_stats_tls : distance_stats_self())
+#define STATS_ADD(field, n)	(STATS_SELF()->field += (n))
+#define STATS_CALL(metric, len1, len2, ncells, kernel)			\
+	distance_stats_call((metric), (len1), (len2), (ncells), (kernel))
+
+static __inline void
+distance_stats_call(int metric, size_t len1, size_t len2,
+    unsigned long long ncells, int kernel)
+{
+	struct distance_stats *st = STATS_SELF();
+	size_t          l = max(len1, len2);
+	int             b;
+
+	b = l == 0 ? 0 : (int) (sizeof(long long) * 8) -
+	    __builtin_clzll((unsigned long long) l);
+	if (b >= DISTANCE_LEN_BUCKETS)
+		b = DISTANCE_LEN_BUCKETS - 1;
+	st->calls[metric]++;
+	st->calls_by_len[metric][b]++;
+	st->cells[metric] += ncells;
+	st->bytes[metric] += len1 + len2;
+	st->kernels[kernel]++;
+}
+#else
+#define STATS_ADD(field, n)	do { } while (0)
+#define STATS_CALL(metric, len1, len2, ncells, kernel)	do { } while (0)
+#endif	/* DISTANCE_STATS */
+
+__END_DECLS
+
+#endif	/* _DISTANCE_INT_H_ */
@@ -0,0 +1,286 @@
+/*	$Id$ */
+
+/*
+   lower bound filters for threshold queries. when a query is compared
+   with many candidates and only those within k edits matter, most
+   candidates are far away and can be ruled out by something much
+   cheaper than the distance itself. each stage below is a lower bound
+   on the levenshtein distance, so a candidate it rejects is more than
+   k away and the result is exactly what levenshtein_d would give:
+
+   length	the distance is at least the difference in length.
+
+   histogram	the bag distance, max(excess of s over t, excess of t
+		over s) over the 256 byte counts. an edit changes each
+		excess by at most one.
+
+   q-gram	E. Ukkonen, "Approximate string-matching with q-grams
+		and maximal matches", Theoretical Computer Science, 92,
+		191-211, 1992. an edit destroys at most q of the
+		q-grams of a string, so two strings within k edits share
+		at least max(n, m) - q + 1 - k * q of them. the q-grams
+		are counted in hashed buckets, collisions only add to the
+		shared count so the bound stays a lower bound.
+
+   for a corpus file with histograms (corpus.c) the bag distance over
+   the folded histograms is tried before the full one, it needs only
+   32 bytes of precomputed data per entry.
+
+   then the survivors are verified with levenshtein_bounded_d. for
+   damerau_d only the length stage applies, its swaps of adjascent
+   bytes cost nothing and are not bounded by the other two.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+#define FILTER_Q	2
+#define FILTER_QBITS	12
+#define FILTER_QSIZE	(1 << FILTER_QBITS)
+
+#define FILTER_GRAM(p, i)						\
+	((((unsigned) (p)[i] << 8 | (p)[(i) + 1]) * 0x9e37u >> 4) &	\
+	    (FILTER_QSIZE - 1))
+
+struct filter {
+	int		 metric;
+	int		 stages;
+	const unsigned char *q;
+	size_t		 qlen;
+	int		 k;
+	int		 hist[256];		/* bytes of the query */
+	int		 grams[FILTER_QSIZE];	/* q-grams of the query */
+	uint8_t		 folded[CORPUS_HIST];	/* of the query, see corpus.c */
+	const void * const *b;
+	const size_t	*blen;
+	const struct distance_corpus *c;	/* instead of b and blen */
+	double		*out;
+	struct distance_filter_stats fs;	/* totals, added atomically */
+};
+
+/* the bag distance between the query and t */
+DISTANCE_CLONES
+static size_t
+filter_bag(const int *hist, const unsigned char *t, size_t m, int *h)
+{
+	size_t          i;
+	int             over = 0, under = 0, x;
+
+	memcpy(h, hist, 256 * sizeof(int));
+	for (i = 0; i < m; i++)
+		h[t[i]]--;
+	/* a plain loop over the bins, which vectorizes */
+	for (i = 0; i < 256; i++) {
+		x = h[i];
+		over += x > 0 ? x : 0;
+		under += x < 0 ? -x : 0;
+	}
+	return (max(over, under));
+}
+
+/* the bag distance over the folded histograms of the query and t */
+static size_t
+filter_folded(const uint8_t *q, const uint8_t *t)
+{
+	int             i, over = 0, under = 0, x;
+
+	for (i = 0; i < CORPUS_HIST; i++) {
+		x = (int) q[i] - (int) t[i];
+		over += x > 0 ? x : 0;
+		under += x < 0 ? -x : 0;
+	}
+	return (max(over, under));
+}
+
+/* the number of q-grams t shares with the query */
+static size_t
+filter_shared(int *grams, const unsigned char *t, size_t m)
+{
+	size_t          i, shared = 0;
+	unsigned        g;
+
+	if (m < FILTER_Q)
+		return (0);
+	for (i = 0; i + FILTER_Q <= m; i++) {
+		g = FILTER_GRAM(t, i);
+		if (grams[g]-- > 0)
+			shared++;
+	}
+	/* put the counts back for the next candidate */
+	for (i = 0; i + FILTER_Q <= m; i++)
+		grams[FILTER_GRAM(t, i)]++;
+	return (shared);
+}
+
+static void
+filter_work(size_t lo, size_t hi, void *p)
+{
+	struct filter  *fl = p;
+	struct distance_filter_stats fs;
+	const unsigned char *t;
+	size_t          j, m, n, diff, need;
+	int            *grams, h[256], d;
+
+	memset(&fs, 0, sizeof(fs));
+	grams = NULL;
+	if (fl->stages & DISTANCE_FILTER_QGRAM_BIT &&
+	    (grams = malloc(sizeof(fl->grams))) != NULL) {
+		STATS_ADD(allocs, 1);
+		memcpy(grams, fl->grams, sizeof(fl->grams));
+	}
+
+	n = fl->qlen;
+	for (j = lo; j < hi; j++) {
+		if (fl->c != NULL)
+			t = corpus_entry(fl->c, j, &m);
+		else {
+			t = fl->b[j];
+			m = fl->blen[j];
+		}
+		fl->out[j] = -1;
+		fs.tested++;
+		diff = n > m ? n - m : m - n;
+		if (fl->stages & DISTANCE_FILTER_LENGTH_BIT &&
+		    diff > (size_t) fl->k) {
+			fs.rejected[DISTANCE_FILTER_LENGTH]++;
+			continue;
+		}
+		if (fl->metric == DISTANCE_DAMERAU) {
+			d = damerau_d(fl->q, n, t, m);
+			if (d < 0 || d > fl->k) {
+				fs.rejected[DISTANCE_FILTER_VERIFY]++;
+				continue;
+			}
+			fl->out[j] = d;
+			continue;
+		}
+		if (fl->stages & DISTANCE_FILTER_HISTOGRAM_BIT &&
+		    fl->c != NULL && fl->c->hist != NULL &&
+		    filter_folded(fl->folded, fl->c->hist + j * CORPUS_HIST) >
+		    (size_t) fl->k) {
+			fs.rejected[DISTANCE_FILTER_HISTOGRAM]++;
+			continue;
+		}
+		if (fl->stages & DISTANCE_FILTER_HISTOGRAM_BIT &&
+		    filter_bag(fl->hist, t, m, h) > (size_t) fl->k) {
+			fs.rejected[DISTANCE_FILTER_HISTOGRAM]++;
+			continue;
+		}
+		if (grams != NULL) {
+			need = max(n, m) + 1;
+			need = need > FILTER_Q + (size_t) fl->k * FILTER_Q ?
+			    need - FILTER_Q - (size_t) fl->k * FILTER_Q : 0;
+			if (need > 0 && filter_shared(grams, t, m) < need) {
+				fs.rejected[DISTANCE_FILTER_QGRAM]++;
+				continue;
+			}
+		}
+		d = levenshtein_bounded_d(fl->q, n, t, m, fl->k);
+		if (d < 0 || d > fl->k) {
+			fs.rejected[DISTANCE_FILTER_VERIFY]++;
+			continue;
+		}
+		fl->out[j] = d;
+	}
+
+	free(grams);
+	__sync_fetch_and_add(&fl->fs.tested, fs.tested);
+	for (d = 0; d < DISTANCE_FILTER_NSTAGES; d++)
+		__sync_fetch_and_add(&fl->fs.rejected[d], fs.rejected[d]);
+}
+
+static int
+filter_run(struct filter *fl, size_t nb, struct distance_filter_stats *fs,
+    int nthreads)
+{
+	size_t          i;
+	int             n, s;
+
+	for (i = 0; i < fl->qlen; i++)
+		fl->hist[fl->q[i]]++;
+	for (i = 0; i + FILTER_Q <= fl->qlen; i++)
+		fl->grams[FILTER_GRAM(fl->q, i)]++;
+	corpus_hist(fl->q, fl->qlen, fl->folded);
+
+	if (distance_parallel_for(nb, nthreads, filter_work, fl) == -1) {
+		free(fl);
+		return (-1);
+	}
+
+	if (fs != NULL) {
+		fs->tested += fl->fs.tested;
+		for (s = 0; s < DISTANCE_FILTER_NSTAGES; s++)
+			fs->rejected[s] += fl->fs.rejected[s];
+	}
+	for (i = 0, n = 0; i < nb; i++)
+		if (fl->out[i] >= 0)
+			n++;
+	free(fl);
+	return (n);
+}
+
+static struct filter *
+filter_new(int metric, int stages, const void *q, size_t qlen, int k,
+    double *out)
+{
+	struct filter  *fl;
+
+	if ((metric != DISTANCE_LEVENSHTEIN && metric != DISTANCE_DAMERAU) ||
+	    k < 0 || out == NULL)
+		return (NULL);
+	if ((fl = calloc(1, sizeof(*fl))) == NULL)
+		return (NULL);
+	STATS_ADD(allocs, 1);
+	fl->metric = metric;
+	fl->stages = stages;
+	fl->q = q;
+	fl->qlen = qlen;
+	fl->k = k;
+	fl->out = out;
+	return (fl);
+}
+
+/*
+   fills out[j] with the distance between q and b[j] if it is at most
+   k, otherwise -1. metric is DISTANCE_LEVENSHTEIN or DISTANCE_DAMERAU,
+   stages a mask of the DISTANCE_FILTER_*_BIT filters to run before
+   the distance is computed. if fs is not NULL the candidates each
+   stage turned away are added to it. returns the number of candidates
+   within k, or -1 on bad arguments, if out of memory or if cancelled.
+ */
+int
+distance_filter(int metric, int stages, const void *q, size_t qlen,
+    const void * const *b, const size_t *blen, size_t nb, int k,
+    double *out, struct distance_filter_stats *fs, int nthreads)
+{
+	struct filter  *fl;
+
+	if (nb == 0)
+		return (k < 0 ? -1 : 0);
+	if ((fl = filter_new(metric, stages, q, qlen, k, out)) == NULL)
+		return (-1);
+	fl->b = b;
+	fl->blen = blen;
+	return (filter_run(fl, nb, fs, nthreads));
+}
+
+/* distance_filter() over the entries of a corpus file */
+int
+distance_corpus_filter(const struct distance_corpus *c, int metric,
+    int stages, const void *q, size_t qlen, int k, double *out,
+    struct distance_filter_stats *fs, int nthreads)
+{
+	struct filter  *fl;
+
+	if (c == NULL)
+		return (-1);
+	if (c->count == 0)
+		return (k < 0 ? -1 : 0);
+	if ((fl = filter_new(metric, stages, q, qlen, k, out)) == NULL)
+		return (-1);
+	fl->c = c;
+	return (filter_run(fl, c->count, fs, nthreads));
+}
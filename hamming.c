@@ -3,6 +3,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "distance.h"
+#include "distance_int.h"
+
 /*
    R. W. Hamming, "Error Detecting and Error Correcting Codes", Bell System
    Tech Journal, 9, 147-160, April 1950.
@@ -12,31 +15,33 @@
    two string differ, i.e., have different characters.
  */
 
+DISTANCE_CLONES
 int
 hamming_d(const void *d1, size_t len1, const void *d2, size_t len2)
 {
-	int             H = 0, n, m;
-	char           *s, *t;
+	int             H = 0;
+	size_t          i, n, m;
+	const unsigned char *s, *t;
 
-	s = (char *) d1;
-	t = (char *) d2;
+	s = d1;
+	t = d2;
 	n = len1;
 	m = len2;
 
 	/* strings must be of equal size and non-zero length */
-	if (n == 0 || (n != m))
+	if (n == 0 || (n != m)) {
+		STATS_CALL(DISTANCE_HAMMING, len1, len2, 0,
+		    DISTANCE_KERNEL_TRIVIAL);
 		return -1;
-
-	/* strings equal? */
-	if (strncmp(s, t, n) == 0)
-		return 0;
-
-	while (*s != NULL) {
-		if (strncmp(s, t, 1) != 0)
-			H++;
-		s++;
-		t++;
 	}
+	STATS_CALL(DISTANCE_HAMMING, len1, len2, len1, DISTANCE_KERNEL_LINEAR);
+
+	/*
+	   walk the given length rather than up to a NUL so binary input
+	   works; a branch free count lets the compiler vectorise this.
+	 */
+	for (i = 0; i < n; i++)
+		H += s[i] != t[i];
 
 	return (H);
 }
@@ -4,6 +4,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "distance.h"
+#include "distance_int.h"
+
 /*
   Jaccard 1912, "The distribution of the flora of the alpine zone", 
   New Phytologist 11:37-50
@@ -17,37 +20,40 @@
   This can more easily be described as ( |X & Y| ) / ( | X or Y | )
  */
 
+DISTANCE_CLONES
 float
 jaccard_d(const void *d1, size_t len1, const void *d2, size_t len2)
 {
-	float           n, m, same, diff;
+	float           n, m;
 	float 		J;
-	char           *s, *t;
+	size_t		i, same;
+	const unsigned char *s, *t;
 
-	s = (char *)d1;
-	t = (char *)d2;
+	s = d1;
+	t = d2;
 	n = len1;
 	m = len2;
 
 	/* strings must be of equal size and non-zero length */
-	if (n == 0 || (n != m))
+	if (n == 0 || (n != m)) {
+		STATS_CALL(DISTANCE_JACCARD, len1, len2, 0,
+		    DISTANCE_KERNEL_TRIVIAL);
 		return(-1.0);
+	}
+	STATS_CALL(DISTANCE_JACCARD, len1, len2, len1, DISTANCE_KERNEL_LINEAR);
+
+	/*
+	   one branch free pass over the given length (not up to a NUL),
+	   which the compiler can vectorise.
+	 */
+	same = 0;
+	for (i = 0; i < len1; i++)
+		same += s[i] != t[i];
 
 	/* strings equal? */
-	if (strncmp(s, t, n) == 0)
+	if (same == 0)
 		return(0.0);
 
-	same = 0;
-	diff = 0;
-	while (*s != NULL) {
-		if (strncmp(s, t, 1) != 0)
-			same++;
-		else
-			diff++;
-		s++;
-		t++;
-	}
-
-	J = ((same)/(diff+same));
+	J = ((float) same / n);
 	return(1 - J);
 }
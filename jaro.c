@@ -0,0 +1,310 @@
+/*	$Id$ */
+
+/*
+   M. A. Jaro, "Advances in record-linkage methodology as applied to
+   matching the 1985 census of Tampa, Florida", Journal of the American
+   Statistical Association, 84, 406, 414-420, 1989.
+
+   W. E. Winkler, "String comparator metrics and enhanced decision rules
+   in the Fellegi-Sunter model of record linkage", Proc. Section on
+   Survey Research Methods, American Statistical Association, 354-359,
+   1990.
+
+   a byte of d2 matches the first byte of d1 that is equal to it, not
+   yet matched and less than half the longer length away. with m
+   matches, of which t are out of order once both sides are read in
+   order, the jaro similarity is (m / len1 + m / len2 + (m - t / 2) /
+   m) / 3. winkler adds p times the rest up to 1 for each of the first
+   (at most 4) bytes the two have in common, when the similarity is
+   above 0.7. the distances are 1 minus these.
+
+   d1 is kept as one bit mask per byte value, the positions it holds
+   that byte at, so the match for a byte of d2 is the lowest bit of
+   its mask, less those already matched, cut to the window. the
+   matched bytes of d1 are then read off the set bits in order to
+   count the transpositions. for d1 of up to 64 bytes all of this is a
+   handful of word operations per byte of d2, longer d1 take one word
+   per 64 bytes. jaro_winkler_many() builds the masks of its query once
+   for all the candidates.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+#define JARO_BOOST	0.7	/* winkler only adjusts above this */
+#define JARO_PREFIX	4	/* longest prefix counted */
+
+/* the similarity from the match and half transposition counts */
+static __inline double
+jaro_sim(size_t m, size_t t, size_t len1, size_t len2)
+{
+	if (m == 0)
+		return (0.0);
+	return (((double) m / len1 + (double) m / len2 +
+	    (double) (m - t / 2) / m) / 3.0);
+}
+
+static __inline double
+jaro_winkler_sim(double sim, const unsigned char *s, size_t len1,
+    const unsigned char *t, size_t len2, double p)
+{
+	size_t          l, lmax;
+
+	if (p == 0.0 || sim <= JARO_BOOST)
+		return (sim);
+	lmax = min(min(len1, len2), JARO_PREFIX);
+	for (l = 0; l < lmax && s[l] == t[l]; l++)
+		;
+	return (sim + l * p * (1.0 - sim));
+}
+
+/* the window either side, in bytes */
+static __inline size_t
+jaro_window(size_t len1, size_t len2)
+{
+	size_t          w = max(len1, len2) / 2;
+
+	return (w > 0 ? w - 1 : 0);
+}
+
+/*
+   the similarity of d1 of len1 bytes, 1 to 64, with its masks in
+   peq[256], and d2. tm holds the matched bytes of d2 and has room for
+   len1 + 1 of them.
+ */
+static double
+jaro_word(const uint64_t *peq, const unsigned char *s, size_t len1,
+    const unsigned char *t, size_t len2, unsigned char *tm)
+{
+	uint64_t        flag = 0, bits, win;
+	size_t          j, n, w, nm = 0, nt = 0;
+
+	/*
+	   the window starts as bits 0 to w and moves up a bit a byte once
+	   j passes w, bits above len1 are never set in peq. no branches on
+	   the data, as a match is a coin toss for the predictor.
+	 */
+	w = jaro_window(len1, len2);
+	win = w + 1 >= MYERS_WORD ? ~0ULL : (1ULL << (w + 1)) - 1;
+	n = min(len2, len1 + w);
+	for (j = 0; j < n; j++) {
+		bits = peq[t[j]] & ~flag & win;
+		bits &= -bits;
+		flag |= bits;
+		tm[nm] = t[j];
+		nm += bits != 0;
+		win = j < w ? win << 1 | 1 : win << 1;
+	}
+	for (j = 0; flag != 0; flag &= flag - 1)
+		nt += s[__builtin_ctzll(flag)] != tm[j++];
+	return (jaro_sim(nm, nt, len1, len2));
+}
+
+/*
+   the same for d1 of any length, with nb words of masks per byte
+   value in peq[256 * nb] and nb words of scratch in flag
+ */
+static double
+jaro_blocks(const uint64_t *peq, size_t nb, const unsigned char *s,
+    size_t len1, const unsigned char *t, size_t len2, uint64_t *flag,
+    unsigned char *tm)
+{
+	const uint64_t *eq;
+	uint64_t        bits;
+	size_t          j, k, lo, hi, w, nm = 0, nt = 0;
+
+	memset(flag, 0, nb * sizeof(*flag));
+	w = jaro_window(len1, len2);
+	for (j = 0; j < len2 && (lo = j > w ? j - w : 0) < len1; j++) {
+		hi = min(j + w + 1, len1) - 1;		/* inclusive here */
+		eq = peq + (size_t) t[j] * nb;
+		for (k = lo / MYERS_WORD; k <= hi / MYERS_WORD; k++) {
+			bits = eq[k] & ~flag[k];
+			if (k == lo / MYERS_WORD)
+				bits &= ~0ULL << (lo % MYERS_WORD);
+			if (k == hi / MYERS_WORD)
+				bits &= ~0ULL >> (MYERS_WORD - 1 -
+				    hi % MYERS_WORD);
+			if (bits != 0) {
+				flag[k] |= bits & -bits;
+				tm[nm++] = t[j];
+				break;
+			}
+		}
+	}
+	for (j = 0, k = 0; k < nb; k++)
+		for (bits = flag[k]; bits != 0; bits &= bits - 1)
+			nt += s[k * MYERS_WORD + __builtin_ctzll(bits)] !=
+			    tm[j++];
+	return (jaro_sim(nm, nt, len1, len2));
+}
+
+/* the masks of d1, nb words per byte value */
+static void
+jaro_peq(uint64_t *peq, size_t nb, const unsigned char *s, size_t len1)
+{
+	size_t          i;
+
+	memset(peq, 0, 256 * nb * sizeof(*peq));
+	for (i = 0; i < len1; i++)
+		peq[(size_t) s[i] * nb + i / MYERS_WORD] |=
+		    1ULL << (i % MYERS_WORD);
+}
+
+/* the similarity, or -1 if out of memory */
+static double
+jaro_any(const void *d1, size_t len1, const void *d2, size_t len2)
+{
+	uint64_t        tab[256], *peq;
+	unsigned char   tm[MYERS_WORD + 1], *mem;
+	size_t          nb;
+	double          sim;
+
+	if (len1 == 0 || len2 == 0) {
+		STATS_CALL(DISTANCE_JARO, len1, len2, 0,
+		    DISTANCE_KERNEL_TRIVIAL);
+		return (len1 == len2 ? 1.0 : 0.0);
+	}
+	nb = (len1 + MYERS_WORD - 1) / MYERS_WORD;
+	STATS_CALL(DISTANCE_JARO, len1, len2,
+	    (unsigned long long) len2 * nb, DISTANCE_KERNEL_BITPARALLEL);
+	if (nb == 1) {
+		jaro_peq(tab, 1, d1, len1);
+		return (jaro_word(tab, d1, len1, d2, len2, tm));
+	}
+
+	/* the masks, the matched flags and the matched bytes in one */
+	if ((mem = malloc((257 * nb) * sizeof(uint64_t) + len1)) == NULL)
+		return (-1.0);
+	STATS_ADD(allocs, 1);
+	peq = (uint64_t *) mem;
+	jaro_peq(peq, nb, d1, len1);
+	sim = jaro_blocks(peq, nb, d1, len1, d2, len2, peq + 256 * nb,
+	    mem + 257 * nb * sizeof(uint64_t));
+	free(mem);
+	return (sim);
+}
+
+/*
+   the jaro distance, 1 minus the similarity: 0 for equal inputs, 1 for
+   inputs with nothing in common (or one of them empty). returns -1 if
+   out of memory.
+ */
+DISTANCE_CLONES
+double
+jaro_d(const void *d1, size_t len1, const void *d2, size_t len2)
+{
+	double          sim;
+
+	if ((sim = jaro_any(d1, len1, d2, len2)) < 0)
+		return (-1.0);
+	return (1.0 - sim);
+}
+
+/*
+   the jaro-winkler distance with prefix scale p, usually 0.1 and at
+   most 0.25 to stay within 0 to 1. p of 0 gives the jaro distance.
+ */
+DISTANCE_CLONES
+double
+jaro_winkler_d(const void *d1, size_t len1, const void *d2, size_t len2,
+    double p)
+{
+	double          sim;
+
+	if ((sim = jaro_any(d1, len1, d2, len2)) < 0)
+		return (-1.0);
+	return (1.0 - jaro_winkler_sim(sim, d1, len1, d2, len2, p));
+}
+
+struct jaro_many {
+	const unsigned char *q;
+	size_t		 qlen;
+	const uint64_t	*peq;
+	size_t		 nb;
+	double		 p;
+	const void * const *b;
+	const size_t	*blen;
+	double		*out;
+	int		 failed;
+};
+
+static void
+jaro_many_range(size_t lo, size_t hi, void *arg)
+{
+	struct jaro_many *jm = arg;
+	uint64_t        fbuf[8], *flag = fbuf;
+	unsigned char   tbuf[512], *tm = tbuf, *mem = NULL;
+	size_t          j, len;
+	double          sim;
+
+	if (jm->nb > 8 || jm->qlen > sizeof(tbuf)) {
+		if ((mem = malloc(jm->nb * sizeof(uint64_t) +
+		    jm->qlen)) == NULL) {
+			jm->failed = 1;
+			return;
+		}
+		STATS_ADD(allocs, 1);
+		flag = (uint64_t *) mem;
+		tm = mem + jm->nb * sizeof(uint64_t);
+	}
+	for (j = lo; j < hi; j++) {
+		len = jm->blen[j];
+		if (jm->qlen == 0 || len == 0) {
+			STATS_CALL(DISTANCE_JARO, jm->qlen, len, 0,
+			    DISTANCE_KERNEL_TRIVIAL);
+			jm->out[j] = jm->qlen == len ? 0.0 : 1.0;
+			continue;
+		}
+		STATS_CALL(DISTANCE_JARO, jm->qlen, len,
+		    (unsigned long long) len * jm->nb,
+		    DISTANCE_KERNEL_BITPARALLEL);
+		if (jm->nb == 1)
+			sim = jaro_word(jm->peq, jm->q, jm->qlen, jm->b[j],
+			    len, tm);
+		else
+			sim = jaro_blocks(jm->peq, jm->nb, jm->q, jm->qlen,
+			    jm->b[j], len, flag, tm);
+		jm->out[j] = 1.0 - jaro_winkler_sim(sim, jm->q, jm->qlen,
+		    jm->b[j], len, jm->p);
+	}
+	free(mem);
+}
+
+/*
+   jaro_winkler_d() between q and every b[j], into out[j], with the
+   masks of q built once. p of 0 gives jaro_d(). the work is spread
+   over nthreads threads, 0 means one per CPU. returns 0, or -1 if out
+   of memory or cancelled.
+ */
+int
+jaro_winkler_many(const void *q, size_t qlen, const void * const *b,
+    const size_t *blen, size_t nb, double p, double *out, int nthreads)
+{
+	struct jaro_many jm;
+	uint64_t        tab[256], *peq = tab;
+	int             ret;
+
+	memset(&jm, 0, sizeof(jm));
+	jm.q = q;
+	jm.qlen = qlen;
+	jm.nb = max((qlen + MYERS_WORD - 1) / MYERS_WORD, 1);
+	jm.p = p;
+	jm.b = b;
+	jm.blen = blen;
+	jm.out = out;
+	if (jm.nb > 1) {
+		if ((peq = malloc(256 * jm.nb * sizeof(uint64_t))) == NULL)
+			return (-1);
+		STATS_ADD(allocs, 1);
+	}
+	jaro_peq(peq, jm.nb, q, qlen);
+	jm.peq = peq;
+	ret = distance_parallel_for(nb, nthreads, jaro_many_range, &jm);
+	if (peq != tab)
+		free(peq);
+	return (ret == -1 || jm.failed ? -1 : 0);
+}
@@ -0,0 +1,427 @@
+/*	$Id$ */
+
+/*
+   an approximate k nearest neighbour graph of many inputs under any
+   distance_fn, for when the n * n distances of the exact graph are too
+   many.
+
+   W. Dong, M. Charikar, K. Li, "Efficient k-nearest neighbor graph
+   construction for generic similarity measures", Proc. WWW 2011,
+   577-586, 2011. a neighbour of a neighbour is likely a neighbour: each
+   input starts with k random neighbours, and every round compares the
+   neighbours of each input with each other (the local join) and keeps
+   the closer ones. only pairs with at least one neighbour new since
+   the last round are compared, and only a sample, rho, of the new ones
+   at that, so a round costs far less than the last. the rounds stop
+   when one changes fewer than delta * n * k neighbours.
+
+   the lists of neighbours are the caller's output array, k entries per
+   input back to back, with a byte each saying if the entry is new.
+   the local joins run in parallel; a list is only changed under one of
+   KNNG_LOCKS mutexes, picked by input.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+#define KNNG_LOCKS	1024
+
+struct knng {
+	distance_fn	 f;
+	void		*arg;
+	const void * const *b;
+	const size_t	*blen;
+	size_t		 n;
+	size_t		 k;
+	size_t		 s;		/* new neighbours sampled per round */
+	struct distance_match *g;	/* [n][k], the graph */
+	unsigned char	*isnew;		/* [n][k] */
+	size_t		*nw;		/* [n][2 * s], new candidates */
+	size_t		*nnw;
+	size_t		*old;		/* [n][k + s], old candidates */
+	size_t		*nold;
+	size_t		*seen;		/* reverse candidates offered */
+	unsigned	 round;
+	unsigned long long evaluated;	/* added atomically */
+	unsigned long long updates;
+	int		 failed;
+	pthread_mutex_t	 locks[KNNG_LOCKS];
+};
+
+/* xorshift, the next random number from x */
+static __inline uint64_t
+knng_rand(uint64_t *x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	return (*x);
+}
+
+/* the seed of input i in the current round */
+static __inline uint64_t
+knng_seed(const struct knng *kg, size_t i)
+{
+	uint64_t        x = (i + 1) * 0x9e3779b97f4a7c15ULL ^ kg->round;
+
+	x ^= x >> 31;
+	return (x == 0 ? 1 : x);
+}
+
+static double
+knng_dist(const struct knng *kg, size_t i, size_t j)
+{
+	double          d;
+
+	d = kg->f(kg->b[i], kg->blen[i], kg->b[j], kg->blen[j], kg->arg);
+	/* an error is no neighbour, as in vptree.c */
+	return (d < 0 ? HUGE_VAL : d);
+}
+
+/*
+   offers j at distance d to the list of i. returns 1 if it took the
+   place of the furthest neighbour, 0 if it is no closer or already in
+   the list.
+ */
+static int
+knng_update(struct knng *kg, size_t i, size_t j, double d)
+{
+	struct distance_match *row = kg->g + i * kg->k;
+	pthread_mutex_t *lock = &kg->locks[i % KNNG_LOCKS];
+	size_t          x, far = 0;
+
+	pthread_mutex_lock(lock);
+	for (x = 0; x < kg->k; x++) {
+		if (row[x].index == j) {
+			pthread_mutex_unlock(lock);
+			return (0);
+		}
+		if (row[x].distance > row[far].distance)
+			far = x;
+	}
+	if (!(d < row[far].distance)) {
+		pthread_mutex_unlock(lock);
+		return (0);
+	}
+	row[far].index = j;
+	row[far].distance = d;
+	kg->isnew[i * kg->k + far] = 1;
+	pthread_mutex_unlock(lock);
+	return (1);
+}
+
+/* k random neighbours for each input, all new */
+static void
+knng_init(size_t lo, size_t hi, void *p)
+{
+	struct knng    *kg = p;
+	struct distance_match *row;
+	size_t          i, j, x, y;
+	uint64_t        r;
+
+	for (i = lo; i < hi; i++) {
+		row = kg->g + i * kg->k;
+		r = knng_seed(kg, i);
+		for (x = 0; x < kg->k; x++) {
+			/* few inputs to pick from, take the next ones */
+			if (2 * kg->k >= kg->n)
+				j = (i + 1 + x) % kg->n;
+			else
+				do {
+					j = knng_rand(&r) % kg->n;
+					for (y = 0; y < x; y++)
+						if (row[y].index == j)
+							break;
+				} while (j == i || y < x);
+			row[x].index = j;
+			row[x].distance = knng_dist(kg, i, j);
+			kg->isnew[i * kg->k + x] = 1;
+		}
+	}
+	__sync_fetch_and_add(&kg->evaluated,
+	    (unsigned long long) (hi - lo) * kg->k);
+}
+
+/*
+   the candidates of each input from its own list: up to s of its new
+   neighbours, which are then old, and all its old ones
+ */
+static void
+knng_sample(size_t lo, size_t hi, void *p)
+{
+	struct knng    *kg = p;
+	size_t          i, x, y, t, cand[256], *c, nc;
+	unsigned char  *isnew;
+	uint64_t        r;
+
+	if ((c = kg->k <= 256 ? cand : malloc(kg->k * sizeof(size_t))) ==
+	    NULL) {
+		kg->failed = 1;
+		return;
+	}
+	for (i = lo; i < hi; i++) {
+		isnew = kg->isnew + i * kg->k;
+		kg->nnw[i] = kg->nold[i] = 0;
+		for (x = 0, nc = 0; x < kg->k; x++)
+			if (isnew[x])
+				c[nc++] = x;
+			else
+				kg->old[i * (kg->k + kg->s) + kg->nold[i]++] =
+				    kg->g[i * kg->k + x].index;
+		/* a random s of the new ones, by a partial shuffle */
+		r = knng_seed(kg, i);
+		for (y = 0; y < nc && y < kg->s; y++) {
+			x = y + knng_rand(&r) % (nc - y);
+			t = c[x];
+			c[x] = c[y];
+			c[y] = t;
+			isnew[t] = 0;
+			kg->nw[i * 2 * kg->s + kg->nnw[i]++] =
+			    kg->g[i * kg->k + t].index;
+		}
+	}
+	if (c != cand)
+		free(c);
+}
+
+/* adds j to a candidate list of n entries, unless it is there */
+static __inline void
+knng_add(size_t *list, size_t *n, size_t j)
+{
+	size_t          x;
+
+	for (x = 0; x < *n; x++)
+		if (list[x] == j)
+			return;
+	list[(*n)++] = j;
+}
+
+/*
+   the reverse candidates: i is offered to each of its candidates and
+   each keeps a random s of the offers, by reservoir sampling
+ */
+static void
+knng_reverse(struct knng *kg, int isold)
+{
+	size_t          i, j, x, nfwd, *fwd, *cap, base, *list, *nlist, slot;
+	size_t         *n0;
+	uint64_t        r = knng_seed(kg, kg->n) ^ isold;
+
+	list = isold ? kg->old : kg->nw;
+	nlist = isold ? kg->nold : kg->nnw;
+	base = isold ? kg->k + kg->s : 2 * kg->s;
+	/* the forward candidates end where the reverse ones start */
+	if ((n0 = malloc(kg->n * sizeof(size_t))) == NULL) {
+		kg->failed = 1;
+		return;
+	}
+	STATS_ADD(allocs, 1);
+	memcpy(n0, nlist, kg->n * sizeof(size_t));
+	memset(kg->seen, 0, kg->n * sizeof(size_t));
+	for (i = 0; i < kg->n; i++) {
+		fwd = list + i * base;
+		nfwd = n0[i];
+		for (x = 0; x < nfwd; x++) {
+			j = fwd[x];
+			cap = &kg->seen[j];
+			if (*cap < kg->s) {
+				knng_add(list + j * base, &nlist[j], i);
+			} else {
+				slot = knng_rand(&r) % (*cap + 1);
+				/* replace a reverse entry, never a forward one */
+				if (slot < kg->s && n0[j] + slot < nlist[j])
+					list[j * base + n0[j] + slot] = i;
+			}
+			(*cap)++;
+		}
+	}
+	free(n0);
+}
+
+/* the local join of every input's candidates */
+static void
+knng_join(size_t lo, size_t hi, void *p)
+{
+	struct knng    *kg = p;
+	const size_t   *nw, *old;
+	size_t          i, x, y, a, c;
+	unsigned long long ev = 0, up = 0;
+	double          d;
+
+	for (i = lo; i < hi; i++) {
+		nw = kg->nw + i * 2 * kg->s;
+		old = kg->old + i * (kg->k + kg->s);
+		for (x = 0; x < kg->nnw[i]; x++) {
+			a = nw[x];
+			for (y = x + 1; y < kg->nnw[i]; y++) {
+				c = nw[y];
+				if (a == c)
+					continue;
+				d = knng_dist(kg, a, c);
+				ev++;
+				up += knng_update(kg, a, c, d);
+				up += knng_update(kg, c, a, d);
+			}
+			for (y = 0; y < kg->nold[i]; y++) {
+				c = old[y];
+				if (a == c)
+					continue;
+				d = knng_dist(kg, a, c);
+				ev++;
+				up += knng_update(kg, a, c, d);
+				up += knng_update(kg, c, a, d);
+			}
+		}
+	}
+	__sync_fetch_and_add(&kg->evaluated, ev);
+	__sync_fetch_and_add(&kg->updates, up);
+}
+
+static int
+knng_cmp(const void *x, const void *y)
+{
+	const struct distance_match *m1 = x, *m2 = y;
+
+	if (m1->distance != m2->distance)
+		return (m1->distance < m2->distance ? -1 : 1);
+	return ((m1->index > m2->index) - (m1->index < m2->index));
+}
+
+/*
+   an approximate k nearest neighbour graph of the n inputs b[i] under
+   f. out[i * k] to out[i * k + k - 1] are set to the neighbours of
+   b[i], closest first; k must be less than n. rho, in (0, 1], is the
+   share of new neighbours sampled per round, delta the share of
+   changes a round must make for another to follow. if st is not NULL
+   the distances computed, rounds run and neighbours changed are added
+   to it. returns 0, or -1 on bad arguments, if out of memory or if
+   cancelled.
+ */
+int
+distance_knng(distance_fn f, void *arg, const void * const *b,
+    const size_t *blen, size_t n, size_t k, double rho, double delta,
+    struct distance_match *out, struct distance_knng_stats *st,
+    int nthreads)
+{
+	struct knng    *kg;
+	unsigned long long last;
+	size_t          i;
+	int             ret = -1;
+
+	if (f == NULL || k == 0 || k >= n || out == NULL || !(rho > 0) ||
+	    rho > 1 || delta < 0)
+		return (-1);
+	if ((kg = calloc(1, sizeof(*kg))) == NULL)
+		return (-1);
+	STATS_ADD(allocs, 1);
+	kg->f = f;
+	kg->arg = arg;
+	kg->b = b;
+	kg->blen = blen;
+	kg->n = n;
+	kg->k = k;
+	kg->s = (size_t) ceil(rho * k);
+	kg->g = out;
+	kg->isnew = malloc(n * k);
+	kg->nw = malloc(n * 2 * kg->s * sizeof(size_t));
+	kg->nnw = malloc(n * sizeof(size_t));
+	kg->old = malloc(n * (k + kg->s) * sizeof(size_t));
+	kg->nold = malloc(n * sizeof(size_t));
+	kg->seen = malloc(n * sizeof(size_t));
+	if (kg->isnew == NULL || kg->nw == NULL || kg->nnw == NULL ||
+	    kg->old == NULL || kg->nold == NULL || kg->seen == NULL)
+		goto done;
+	STATS_ADD(allocs, 6);
+	for (i = 0; i < KNNG_LOCKS; i++)
+		pthread_mutex_init(&kg->locks[i], NULL);
+
+	if (distance_parallel_for(n, nthreads, knng_init, kg) == -1)
+		kg->failed = 1;
+	while (!kg->failed) {
+		kg->round++;
+		if (distance_parallel_for(n, nthreads, knng_sample, kg) == -1)
+			kg->failed = 1;
+		else {
+			knng_reverse(kg, 0);
+			knng_reverse(kg, 1);
+		}
+		last = kg->updates;
+		if (kg->failed)
+			break;
+		if (distance_parallel_for(n, nthreads, knng_join, kg) == -1)
+			kg->failed = 1;
+		if (kg->updates - last <= delta * n * k)
+			break;
+	}
+	for (i = 0; i < n; i++)
+		qsort(out + i * k, k, sizeof(*out), knng_cmp);
+
+	for (i = 0; i < KNNG_LOCKS; i++)
+		pthread_mutex_destroy(&kg->locks[i]);
+	if (st != NULL) {
+		st->evaluated += kg->evaluated;
+		st->rounds += kg->round;
+		st->updates += kg->updates;
+	}
+	ret = kg->failed ? -1 : 0;
+done:
+	free(kg->isnew);
+	free(kg->nw);
+	free(kg->nnw);
+	free(kg->old);
+	free(kg->nold);
+	free(kg->seen);
+	free(kg);
+	return (ret);
+}
+
+static int
+knng_dcmp(const void *x, const void *y)
+{
+	double          d1 = *(const double *) x, d2 = *(const double *) y;
+
+	return ((d1 > d2) - (d1 < d2));
+}
+
+/*
+   the recall of a graph from distance_knng(): the share of the true k
+   nearest neighbours it has, measured exactly on nsample inputs spread
+   evenly over the n. a neighbour as close as the true k-th counts, so
+   ties do not lower it. returns a value from 0 to 1, or -1 on bad
+   arguments or if out of memory.
+ */
+double
+distance_knng_recall(distance_fn f, void *arg, const void * const *b,
+    const size_t *blen, size_t n, size_t k, const struct distance_match *g,
+    size_t nsample, int nthreads)
+{
+	size_t          i, q, x, found = 0;
+	double         *d, kth;
+
+	if (f == NULL || k == 0 || k >= n || g == NULL || nsample == 0)
+		return (-1);
+	nsample = min(nsample, n);
+	if ((d = malloc(n * sizeof(double))) == NULL)
+		return (-1);
+	STATS_ADD(allocs, 1);
+	for (i = 0; i < nsample; i++) {
+		q = i * n / nsample;
+		distance_many(f, arg, b[q], blen[q], b, blen, n, d, nthreads);
+		for (x = 0; x < n; x++)
+			if (d[x] < 0)
+				d[x] = HUGE_VAL;
+		d[q] = HUGE_VAL;
+		qsort(d, n, sizeof(double), knng_dcmp);
+		kth = d[k - 1];
+		for (x = 0; x < k; x++)
+			if (g[q * k + x].distance <= kth)
+				found++;
+	}
+	free(d);
+	return ((double) found / (nsample * k));
+}
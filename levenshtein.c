@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "distance.h"
+#include "distance_int.h"
 
 /*
    V. I. Levenshtein, "Binary codes capable of correcting deletions,
@@ -20,46 +21,164 @@
    see: http://www.merriampark.com/ld.htm
  */
 
+/*
+   the distances are computed with the bit-parallel kernel in myers.c,
+   the shorter input is the pattern down the rows so it fits in as few
+   words as possible. patterns of up to 64 bytes need one word and a
+   match table on the stack.
+ */
+static int
+levenshtein_bp(const void *d1, size_t len1, const void *d2, size_t len2,
+    size_t width, size_t k)
+{
+	struct myers_peq peq;
+	uint64_t        tab[256];
+	const unsigned char *p;
+	const void     *tmp;
+	size_t          i, d;
+
+	if (len1 > len2) {
+		tmp = d1;
+		d1 = d2;
+		d2 = tmp;
+		i = len1;
+		len1 = len2;
+		len2 = i;
+	}
+	if (width == 1 && len1 <= MYERS_WORD) {
+		memset(tab, 0, sizeof(tab));
+		for (p = d1, i = 0; i < len1; i++)
+			tab[p[i]] |= 1ULL << i;
+		return ((int) myers_distance_word(tab, len1, d2, len2, k));
+	}
+	if (myers_peq_init(&peq, d1, len1, width) == -1)
+		return (-1);
+	d = myers_distance(&peq, d2, len2, k);
+	myers_peq_free(&peq);
+	return ((int) d);
+}
+
+/*
+   long inputs that are nearly the same are better served by the
+   diagonal kernel in lv.c, whose cost grows with the square of the
+   distance rather than the product of the lengths. it wins while the
+   distance is below about 1/64 of the length, where it does about as
+   much work as one bit-parallel pass.
+ */
+#define LV_MIN_LEN	1024
+#define LV_LIMIT(len1, len2)	(max(len1, len2) / MYERS_WORD)
+
+/*
+   the slides plus the diagonals, about d * d of them, are added to
+   *cells. the caller records the call, once however many tries it
+   takes.
+ */
+static int
+levenshtein_lv(const void *d1, size_t len1, const void *d2, size_t len2,
+    size_t k, unsigned long long *cells)
+{
+	size_t          d;
+
+	if ((d = lv_distance(d1, len1, d2, len2, k)) == (size_t) -1)
+		return (-1);
+	*cells += (unsigned long long) max(len1, len2) +
+	    (unsigned long long) d * d;
+	return ((int) d);
+}
+
 /* Compute levenshtein distance between d1 and d2 */
 
 int
 levenshtein_d(const void *d1, size_t len1, const void *d2, size_t len2)
 {
-	int             k, i, j, n, m, cost, *d, distance, a, b, c;
-	char           *s, *t;
-
-	//Step 1
-	s = (char *) d1;
-	t = (char *) d2;
-	n = len1;
-	m = len2;
-	if (n != 0 && m != 0) {
-		d = malloc((sizeof(int)) * (m + 1) * (n + 1));
-		m++;
-		n++;
-		//Step 2
-		for (k = 0; k < n; k++)
-			d[k] = k;
-		for (k = 0; k < m; k++)
-			d[k * n] = k;
-			//Step 3 and 4
-			for (i = 1; i < n; i++)
-				for (j = 1; j < m; j++) {
-					//Step 5
-					if (s[i - 1] == t[j - 1])
-						cost = 0;
-					else
-						cost = 1;
-					//Step 6
-					a = d[(j - 1) * n + i] + 1;
-					b = d[j * n + i - 1] + 1;
-					c = d[(j - 1) * n + i - 1] + cost;
-					d[j * n + i] = (min(a,(min(b,c))));
-				}
-			distance = d[n * m - 1];
-		free(d);
-		return distance;
-	} else
-		return (max(m,n));
-	// return the full string cost if one is zero length
+	unsigned long long cells = 0;
+	size_t          k;
+	int             d;
+
+	if (len1 == 0 || len2 == 0) {
+		/* return the full string cost if one is zero length */
+		STATS_CALL(DISTANCE_LEVENSHTEIN, len1, len2, 0,
+		    DISTANCE_KERNEL_TRIVIAL);
+		return (max(len1, len2));
+	}
+	/*
+	   guess a small distance, and grow the guess while it pays. the
+	   call is counted once, under the kernel that gave the answer,
+	   with the cells of the tries that did not
+	 */
+	if (min(len1, len2) >= LV_MIN_LEN) {
+		k = max(len1, len2) - min(len1, len2);
+		for (k = max(k, 64); k <= LV_LIMIT(len1, len2); k *= 4) {
+			d = levenshtein_lv(d1, len1, d2, len2, k, &cells);
+			if (d == -1 || (size_t) d <= k) {
+				STATS_CALL(DISTANCE_LEVENSHTEIN, len1, len2,
+				    cells, DISTANCE_KERNEL_DIAGONAL);
+				return (d);
+			}
+		}
+	}
+	STATS_CALL(DISTANCE_LEVENSHTEIN, len1, len2,
+	    cells + (unsigned long long) len1 * len2,
+	    DISTANCE_KERNEL_BITPARALLEL);
+	return (levenshtein_bp(d1, len1, d2, len2, 1, SIZE_MAX));
+}
+
+/*
+   the same over tokens of width bytes (1, 2, 4 or 8), for example
+   codepoints or interned word ids. lengths are counted in tokens.
+ */
+int
+levenshtein_tok_d(const void *d1, size_t len1, const void *d2, size_t len2,
+    size_t width)
+{
+	if (width != 1 && width != 2 && width != 4 && width != 8)
+		return (-1);
+	if (len1 == 0 || len2 == 0) {
+		STATS_CALL(DISTANCE_LEVENSHTEIN, len1, len2, 0,
+		    DISTANCE_KERNEL_TRIVIAL);
+		return (max(len1, len2));
+	}
+	STATS_CALL(DISTANCE_LEVENSHTEIN, len1, len2,
+	    (unsigned long long) len1 * len2, DISTANCE_KERNEL_BITPARALLEL);
+	return (levenshtein_bp(d1, len1, d2, len2, width, SIZE_MAX));
+}
+
+/*
+   the levenshtein distance if it is at most k, otherwise k + 1. gives
+   up as soon as the answer is known to be more than k, which for a
+   tight k is long before the end of the inputs.
+ */
+int
+levenshtein_bounded_d(const void *d1, size_t len1, const void *d2,
+    size_t len2, int k)
+{
+	unsigned long long cells;
+	size_t          diff;
+	int             d;
+
+	if (k < 0)
+		return (-1);
+	diff = len1 > len2 ? len1 - len2 : len2 - len1;
+	if (diff > (size_t) k) {
+		/* at least one edit per byte of difference in length */
+		STATS_ADD(band_exits, 1);
+		STATS_CALL(DISTANCE_LEVENSHTEIN, len1, len2, 0,
+		    DISTANCE_KERNEL_TRIVIAL);
+		return (k + 1);
+	}
+	if (len1 == 0 || len2 == 0) {
+		STATS_CALL(DISTANCE_LEVENSHTEIN, len1, len2, 0,
+		    DISTANCE_KERNEL_TRIVIAL);
+		return (max(len1, len2));
+	}
+	if ((size_t) k <= LV_LIMIT(len1, len2)) {
+		cells = 0;
+		d = levenshtein_lv(d1, len1, d2, len2, k, &cells);
+		STATS_CALL(DISTANCE_LEVENSHTEIN, len1, len2, cells,
+		    DISTANCE_KERNEL_DIAGONAL);
+		return (d);
+	}
+	STATS_CALL(DISTANCE_LEVENSHTEIN, len1, len2,
+	    (unsigned long long) len1 * len2, DISTANCE_KERNEL_BITPARALLEL);
+	return (levenshtein_bp(d1, len1, d2, len2, 1, k));
 }
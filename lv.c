@@ -0,0 +1,130 @@
+/*	$Id$ */
+
+/*
+   G. M. Landau and U. Vishkin, "Fast parallel and serial approximate
+   string matching", Journal of Algorithms, 10, 2, 157-169, 1989.
+
+   E. Ukkonen, "Algorithms for approximate string matching",
+   Information and Control, 64, 100-118, 1985.
+
+   diagonal transition: instead of filling the matrix, follow each
+   diagonal j - i = d and keep only how far along it e edits can get.
+   from the furthest point with e - 1 edits one more edit reaches a
+   neighbouring cell, and from there the inputs are compared directly
+   for as long as they agree (the slide), which costs nothing in the
+   distance. the work is O(n + d * d) for inputs of length n and
+   distance d when the slides are cheap, so two revisions of a long
+   document that differ in a few places are compared in about the time
+   it takes to read them.
+
+   the slides compare 16 bytes at a time with SSE2 and 8 at a time
+   otherwise, finding the first difference from the mask or the xor of
+   the words.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "distance.h"
+#include "distance_int.h"
+
+/* length of the common prefix of a and b, at most len */
+static __inline size_t
+lv_slide(const unsigned char *a, const unsigned char *b, size_t len)
+{
+	size_t          i = 0;
+#ifdef __SSE2__
+	unsigned int    mask;
+#endif
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t        x, y;
+#endif
+
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+		    _mm_loadu_si128((const __m128i *) (a + i)),
+		    _mm_loadu_si128((const __m128i *) (b + i))));
+		if (mask != 0xffff)
+			return (i + __builtin_ctz(~mask));
+	}
+#endif
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		if (x != y)
+			return (i + (__builtin_ctzll(x ^ y) >> 3));
+	}
+#endif
+	for (; i < len && a[i] == b[i]; i++)
+		;
+	return (i);
+}
+
+/*
+   the levenshtein distance between s and t if it is at most k,
+   otherwise k + 1. returns (size_t) -1 if out of memory.
+ */
+DISTANCE_CLONES
+size_t
+lv_distance(const void *d1, size_t n, const void *d2, size_t m, size_t k)
+{
+	const unsigned char *s = d1, *t = d2;
+	ptrdiff_t      *buf, *prev, *cur, *tmp, i, d, lo, hi, target, e;
+	size_t          w;
+
+	target = (ptrdiff_t) m - (ptrdiff_t) n;
+	if ((size_t) (target < 0 ? -target : target) > k) {
+		STATS_ADD(band_exits, 1);
+		return (k + 1);
+	}
+	k = min(k, max(n, m));
+
+	/* diagonals -k - 1 .. k + 1, the outer two always out of reach */
+	w = 2 * k + 3;
+	if ((buf = malloc(2 * w * sizeof(ptrdiff_t))) == NULL)
+		return ((size_t) -1);
+	STATS_ADD(allocs, 1);
+	prev = buf + k + 1;
+	cur = prev + w;
+
+	i = lv_slide(s, t, min(n, m));
+	if (target == 0 && (size_t) i == n) {
+		free(buf);
+		return (0);
+	}
+	for (d = -(ptrdiff_t) k - 1; d <= (ptrdiff_t) k + 1; d++)
+		prev[d] = cur[d] = PTRDIFF_MIN / 2;
+	prev[0] = i;
+
+	for (e = 1; e <= (ptrdiff_t) k; e++) {
+		/* diagonals that can still reach both inputs */
+		lo = max(-e, -(ptrdiff_t) n);
+		hi = min(e, (ptrdiff_t) m);
+		for (d = lo; d <= hi; d++) {
+			/* substitute, insert t[j], or delete s[i] */
+			i = max(prev[d] + 1, max(prev[d - 1], prev[d + 1] + 1));
+			i = min(i, min((ptrdiff_t) n, (ptrdiff_t) m - d));
+			if (i < 0 || i + d < 0) {
+				cur[d] = PTRDIFF_MIN / 2;
+				continue;
+			}
+			i += lv_slide(s + i, t + i + d, min(n - i, m - i - d));
+			cur[d] = i;
+		}
+		if (cur[target] == (ptrdiff_t) n) {
+			free(buf);
+			return (e);
+		}
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+	}
+	free(buf);
+	STATS_ADD(threshold_exits, 1);
+	return (k + 1);
+}
@@ -0,0 +1,356 @@
+/*	$Id$ */
+
+/*
+   multi-pattern approximate matching: find every place in a text where
+   any of a set of patterns occurs with at most k edits.
+
+   G. Navarro and M. Raffinot, "Flexible Pattern Matching in Strings",
+   Cambridge University Press, 2002, section 6.5 (PEX).
+
+   an occurrence with at most k edits of a pattern cut into k + 1
+   pieces leaves at least one piece untouched, so it contains that
+   piece exactly. the pieces of every pattern go into one Aho-Corasick
+   automaton (A. Aho and M. Corasick, "Efficient string matching: an
+   aid to bibliographic search", Communications of the ACM, 18, 6,
+   333-340, 1975) and a single pass over the text finds every piece
+   hit, whatever the number of patterns. each hit marks a window of the
+   text around it where an occurrence could be, overlapping windows of
+   a pattern are merged and only those windows are verified with the
+   bit-parallel search of search.c. the verified result is exactly what
+   levenshtein_search() reports for each pattern over the whole text.
+
+   the automaton keeps the children of a node in a sibling list, except
+   for the root, which has a dense table since nearly every byte of the
+   text starts there.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+struct ac_node {
+	int		 child;		/* first child, 0 for none */
+	int		 sibling;	/* next child of the parent */
+	int		 fail;		/* longest proper suffix in the trie */
+	int		 dict;		/* nearest suffix with a piece, 0 none */
+	int		 piece;		/* first piece ending here, -1 none */
+	unsigned char	 c;		/* byte on the edge from the parent */
+};
+
+struct ac_piece {
+	size_t		 pattern;
+	size_t		 off;		/* offset in the pattern */
+	size_t		 len;
+	int		 next;		/* next piece ending at the same node */
+};
+
+struct matcher_pattern {
+	struct myers_peq peq;
+	size_t		 m;
+};
+
+struct distance_matcher {
+	struct ac_node	*nodes;		/* node 0 is the root */
+	int		 nnodes;
+	int		 root[256];	/* dense children of the root */
+	struct ac_piece	*pieces;
+	int		 npieces;
+	struct matcher_pattern *pats;
+	size_t		 npats;
+	size_t		 k;
+	size_t		 maxblocks;
+};
+
+/* a window of the text that may hold an occurrence of a pattern */
+struct matcher_cand {
+	size_t		 pattern;
+	size_t		 lo;
+	size_t		 hi;		/* exclusive */
+};
+
+static int
+ac_child(const struct distance_matcher *dm, int s, unsigned char c)
+{
+	int             x;
+
+	if (s == 0)
+		return (dm->root[c]);
+	for (x = dm->nodes[s].child; x != 0; x = dm->nodes[x].sibling)
+		if (dm->nodes[x].c == c)
+			return (x);
+	return (0);
+}
+
+static int
+ac_insert(struct distance_matcher *dm, const unsigned char *p, size_t len,
+    int *cap)
+{
+	struct ac_node *n;
+	size_t          i;
+	int             s = 0, x;
+
+	for (i = 0; i < len; i++) {
+		if ((x = ac_child(dm, s, p[i])) != 0) {
+			s = x;
+			continue;
+		}
+		if (dm->nnodes == *cap) {
+			n = realloc(dm->nodes, 2 * *cap * sizeof(*n));
+			if (n == NULL)
+				return (-1);
+			STATS_ADD(allocs, 1);
+			dm->nodes = n;
+			*cap *= 2;
+		}
+		x = dm->nnodes++;
+		n = &dm->nodes[x];
+		memset(n, 0, sizeof(*n));
+		n->piece = -1;
+		n->c = p[i];
+		if (s == 0)
+			dm->root[p[i]] = x;
+		else {
+			n->sibling = dm->nodes[s].child;
+			dm->nodes[s].child = x;
+		}
+		s = x;
+	}
+	return (s);
+}
+
+/* breadth first, so a node's fail target is done before the node */
+static int
+ac_link(struct distance_matcher *dm)
+{
+	int            *queue, head = 0, tail = 0, s, x, f, c;
+
+	if ((queue = malloc(dm->nnodes * sizeof(int))) == NULL)
+		return (-1);
+	STATS_ADD(allocs, 1);
+	for (c = 0; c < 256; c++)
+		if ((x = dm->root[c]) != 0) {
+			dm->nodes[x].fail = 0;
+			queue[tail++] = x;
+		}
+	while (head < tail) {
+		s = queue[head++];
+		for (x = dm->nodes[s].child; x != 0; x = dm->nodes[x].sibling) {
+			for (f = dm->nodes[s].fail;
+			    f != 0 && ac_child(dm, f, dm->nodes[x].c) == 0;
+			    f = dm->nodes[f].fail)
+				;
+			f = ac_child(dm, f, dm->nodes[x].c);
+			dm->nodes[x].fail = f;
+			dm->nodes[x].dict = dm->nodes[f].piece != -1 ? f :
+			    dm->nodes[f].dict;
+			queue[tail++] = x;
+		}
+	}
+	free(queue);
+	return (0);
+}
+
+void
+distance_matcher_free(struct distance_matcher *dm)
+{
+	size_t          i;
+
+	if (dm == NULL)
+		return;
+	if (dm->pats != NULL)
+		for (i = 0; i < dm->npats; i++)
+			myers_peq_free(&dm->pats[i].peq);
+	free(dm->pats);
+	free(dm->pieces);
+	free(dm->nodes);
+	free(dm);
+}
+
+/*
+   compiles npats patterns to be matched with at most k edits. returns
+   NULL if out of memory or k is negative.
+ */
+struct distance_matcher *
+distance_matcher_new(const void * const *pats, const size_t *lens,
+    size_t npats, int k)
+{
+	struct distance_matcher *dm;
+	struct ac_piece *pc;
+	size_t          i, j, m, np;
+	int             s, cap = 64;
+
+	if (k < 0)
+		return (NULL);
+	if ((dm = calloc(1, sizeof(*dm))) == NULL)
+		return (NULL);
+	STATS_ADD(allocs, 1);
+	dm->k = k;
+	dm->npats = npats;
+	dm->maxblocks = 1;
+	dm->pats = calloc(npats + 1, sizeof(struct matcher_pattern));
+	dm->pieces = malloc((npats * (k + 1) + 1) * sizeof(struct ac_piece));
+	dm->nodes = malloc(cap * sizeof(struct ac_node));
+	if (dm->pats == NULL || dm->pieces == NULL || dm->nodes == NULL)
+		goto fail;
+	STATS_ADD(allocs, 3);
+	memset(&dm->nodes[0], 0, sizeof(struct ac_node));
+	dm->nodes[0].piece = -1;
+	dm->nnodes = 1;
+
+	for (i = 0; i < npats; i++) {
+		m = dm->pats[i].m = lens[i];
+		if (m == 0)
+			continue;
+		if (myers_peq_init(&dm->pats[i].peq, pats[i], m, 1) == -1)
+			goto fail;
+		dm->maxblocks = max(dm->maxblocks, dm->pats[i].peq.nblocks);
+		/* a pattern of k bytes or less matches everywhere */
+		if (m <= (size_t) k)
+			continue;
+		np = (size_t) k + 1;
+		for (j = 0; j < np; j++) {
+			pc = &dm->pieces[dm->npieces];
+			pc->pattern = i;
+			pc->off = j * m / np;
+			pc->len = (j + 1) * m / np - pc->off;
+			s = ac_insert(dm, (const unsigned char *) pats[i] +
+			    pc->off, pc->len, &cap);
+			if (s == -1)
+				goto fail;
+			pc->next = dm->nodes[s].piece;
+			dm->nodes[s].piece = dm->npieces++;
+		}
+	}
+	if (ac_link(dm) == -1)
+		goto fail;
+	return (dm);
+
+fail:
+	distance_matcher_free(dm);
+	return (NULL);
+}
+
+static int
+cand_cmp(const void *x, const void *y)
+{
+	const struct matcher_cand *c1 = x, *c2 = y;
+
+	if (c1->pattern != c2->pattern)
+		return (c1->pattern < c2->pattern ? -1 : 1);
+	return ((c1->lo > c2->lo) - (c1->lo < c2->lo));
+}
+
+struct matcher_scan {
+	distance_pattern_fn cb;
+	void		*arg;
+	size_t		 pattern;
+};
+
+static int
+matcher_hit(size_t end, int distance, void *arg)
+{
+	struct matcher_scan *ms = arg;
+
+	if (ms->cb == NULL)
+		return (0);
+	return (ms->cb(ms->pattern, end, distance, ms->arg));
+}
+
+/*
+   reports every (pattern, end offset) where a pattern occurs in text
+   with at most k edits, as levenshtein_search() would for each pattern.
+   returns the number of reports, or -1 if out of memory.
+ */
+int
+distance_matcher_scan(const struct distance_matcher *dm, const void *text,
+    size_t n, distance_pattern_fn cb, void *arg)
+{
+	const unsigned char *t = text;
+	const struct ac_piece *pc;
+	struct matcher_cand *cand = NULL, *nc;
+	struct matcher_scan sc;
+	struct myers_search ms;
+	uint64_t       *vec;
+	size_t          i, j, ncand = 0, capc = 0, start, lo, hi, m;
+	int             s, x, p, nhits = 0, stop = 0;
+
+	if ((vec = malloc(2 * dm->maxblocks * sizeof(uint64_t))) == NULL)
+		return (-1);
+	STATS_ADD(allocs, 1);
+
+	/* one pass of the automaton, collecting candidate windows */
+	for (s = 0, j = 0; j < n; j++) {
+		while (s != 0 && (x = ac_child(dm, s, t[j])) == 0)
+			s = dm->nodes[s].fail;
+		s = ac_child(dm, s, t[j]);
+		for (x = dm->nodes[s].piece != -1 ? s : dm->nodes[s].dict;
+		    x != 0; x = dm->nodes[x].dict) {
+			for (p = dm->nodes[x].piece; p != -1; p = pc->next) {
+				pc = &dm->pieces[p];
+				m = dm->pats[pc->pattern].m;
+				/* the piece sits at text offset start */
+				start = j + 1 - pc->len;
+				lo = start > pc->off + dm->k ?
+				    start - pc->off - dm->k : 0;
+				hi = min(n, start - pc->off + m + dm->k);
+				if (ncand == capc) {
+					capc = capc ? 2 * capc : 64;
+					nc = realloc(cand, capc * sizeof(*nc));
+					if (nc == NULL) {
+						free(cand);
+						free(vec);
+						return (-1);
+					}
+					STATS_ADD(allocs, 1);
+					cand = nc;
+				}
+				cand[ncand].pattern = pc->pattern;
+				cand[ncand].lo = lo;
+				cand[ncand].hi = hi;
+				ncand++;
+			}
+		}
+	}
+	/* patterns too short to cut into pieces are checked everywhere */
+	for (i = 0; i < dm->npats; i++) {
+		if (dm->pats[i].m == 0 || dm->pats[i].m > dm->k)
+			continue;
+		if (ncand == capc) {
+			capc = capc ? 2 * capc : 64;
+			if ((nc = realloc(cand, capc * sizeof(*nc))) == NULL) {
+				free(cand);
+				free(vec);
+				return (-1);
+			}
+			cand = nc;
+		}
+		cand[ncand].pattern = i;
+		cand[ncand].lo = 0;
+		cand[ncand].hi = n;
+		ncand++;
+	}
+
+	/* merge the windows of each pattern and verify them */
+	qsort(cand, ncand, sizeof(*cand), cand_cmp);
+	sc.cb = cb;
+	sc.arg = arg;
+	for (i = 0; i < ncand && !stop; i = j) {
+		lo = cand[i].lo;
+		hi = cand[i].hi;
+		for (j = i + 1; j < ncand && cand[j].pattern ==
+		    cand[i].pattern && cand[j].lo <= hi; j++)
+			hi = max(hi, cand[j].hi);
+		sc.pattern = cand[i].pattern;
+		myers_search_start(&ms, &dm->pats[sc.pattern].peq, vec, lo,
+		    dm->k, matcher_hit, &sc);
+		myers_search_feed(&ms, t + lo, hi - lo);
+		nhits += ms.nhits;
+		stop = ms.done;
+	}
+
+	free(cand);
+	free(vec);
+	return (nhits);
+}
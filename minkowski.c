@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include "distance.h"
+#include "distance_int.h"
 
 /*
    The Minkowski distance is related to the geometric distance between
@@ -17,6 +18,7 @@
    range may 'dilute' the distances of the small-range elements.
  */
 
+DISTANCE_CLONES
 float
 minkowski_d(const void *d1, size_t len1, const void *d2, size_t len2, 
 	    int power)
@@ -32,6 +34,9 @@ minkowski_d(const void *d1, size_t len1, const void *d2, size_t len2,
 	m = len2;
 	if (n != 0 && m != 0) {
 		d = malloc((sizeof(int)) * (m + 1) * (n + 1));
+		STATS_ADD(allocs, 1);
+		STATS_CALL(DISTANCE_MINKOWSKI, len1, len2,
+		    (unsigned long long) len1 * len2, DISTANCE_KERNEL_FULL);
 		m++;
 		n++;
 		//Step 2
@@ -57,7 +62,10 @@ minkowski_d(const void *d1, size_t len1, const void *d2, size_t len2,
 			distance = d[n * m - 1];
 		free(d);
 		return distance;
-	} else
+	} else {
+		STATS_CALL(DISTANCE_MINKOWSKI, len1, len2, 0,
+		    DISTANCE_KERNEL_TRIVIAL);
 		return (max(m,n));
+	}
 	// return the full string cost if one is zero length
 }
@@ -0,0 +1,252 @@
+/*	$Id$ */
+
+/*
+   G. Myers, "A fast bit-vector algorithm for approximate string
+   matching based on dynamic programming", Journal of the ACM, 46, 3,
+   395-415, 1999.
+
+   H. Hyyrö, "A bit-vector algorithm for computing Levenshtein and
+   Damerau edit distances", Nordic Journal of Computing, 10, 29-39,
+   2003.
+
+   the dynamic programming matrix of the levenshtein distance only
+   ever changes by -1, 0 or +1 between neighbouring cells, so a column
+   can be kept as two bit vectors of vertical deltas and 64 rows are
+   advanced with a handful of word operations. patterns longer than a
+   word are cut into blocks of 64 rows, each passing its horizontal
+   delta on to the block below. the cost is O(n * m / 64) instead of
+   O(n * m) and the memory is O(m / 64) words plus the match masks.
+
+   the kernels work on tokens of 1, 2, 4 or 8 bytes and are written out
+   once per width, so reading a token compiles to a single load.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+/* smallest power of two at least n */
+static size_t
+pow2(size_t n)
+{
+	size_t          p = 1;
+
+	while (p < n)
+		p <<= 1;
+	return (p);
+}
+
+/*
+   builds the match masks of the m token pattern. returns 0, or -1 if
+   out of memory or for a bad width.
+ */
+int
+myers_peq_init(struct myers_peq *peq, const void *pat, size_t m, size_t width)
+{
+	uint64_t        v, *masks;
+	size_t          i, h, nb;
+
+	if (width != 1 && width != 2 && width != 4 && width != 8)
+		return (-1);
+	memset(peq, 0, sizeof(*peq));
+	peq->m = m;
+	peq->width = width;
+	peq->nblocks = nb = (m + MYERS_WORD - 1) / MYERS_WORD;
+	if (nb == 0)
+		nb = 1;
+	peq->hbit = 1ULL << ((m - 1) % MYERS_WORD);
+
+	if (width == 1) {
+		/* one row per byte value plus the (unused) zero row */
+		if ((peq->mem = calloc(257 * nb, sizeof(uint64_t))) == NULL)
+			return (-1);
+		STATS_ADD(allocs, 1);
+		peq->direct = peq->mem;
+		peq->zero = peq->direct + 256 * nb;
+		for (i = 0; i < m; i++) {
+			v = token_get(pat, i, 1);
+			peq->direct[v * nb + i / MYERS_WORD] |=
+			    1ULL << (i % MYERS_WORD);
+		}
+		return (0);
+	}
+
+	/* at most m distinct tokens, keep the table half empty */
+	peq->cap = pow2(2 * m < 16 ? 16 : 2 * m);
+	peq->mem = calloc(1, (peq->cap * (nb + 1) + nb) * sizeof(uint64_t) +
+	    peq->cap);
+	if (peq->mem == NULL)
+		return (-1);
+	STATS_ADD(allocs, 1);
+	peq->keys = peq->mem;
+	peq->masks = peq->keys + peq->cap;
+	peq->zero = peq->masks + peq->cap * nb;
+	peq->used = (unsigned char *) (peq->zero + nb);
+	for (i = 0; i < m; i++) {
+		v = token_get(pat, i, width);
+		for (h = token_hash(v, peq->cap); peq->used[h];
+		    h = (h + 1) & (peq->cap - 1))
+			if (peq->keys[h] == v)
+				break;
+		peq->used[h] = 1;
+		peq->keys[h] = v;
+		masks = peq->masks + h * nb;
+		masks[i / MYERS_WORD] |= 1ULL << (i % MYERS_WORD);
+	}
+	return (0);
+}
+
+void
+myers_peq_free(struct myers_peq *peq)
+{
+	free(peq->mem);
+	memset(peq, 0, sizeof(*peq));
+}
+
+/*
+   the distances below stop as soon as they are sure to exceed k and
+   then return k + 1. k larger than both lengths never stops early.
+
+   the last block holds row m at hbit, every other block passes row 64
+   on. rows below m in the last block never feed back upwards, so they
+   need no special masks.
+ */
+#define MYERS_DISTANCE(W)						\
+static size_t								\
+myers_distance_##W(const struct myers_peq *peq, const void *text,	\
+    size_t n, size_t k, uint64_t *pv, uint64_t *mv)			\
+{									\
+	const uint64_t *eq;						\
+	size_t          b, j, nb = peq->nblocks, score = peq->m;	\
+	int             h;						\
+									\
+	for (b = 0; b < nb; b++) {					\
+		pv[b] = ~0ULL;						\
+		mv[b] = 0;						\
+	}								\
+	for (j = 0; j < n; j++) {					\
+		eq = myers_peq_lookup(peq, token_get(text, j, W));	\
+		/* row 0 of a global alignment grows by one a column */	\
+		h = 1;							\
+		for (b = 0; b + 1 < nb; b++)				\
+			h = myers_block(&pv[b], &mv[b], eq[b], h,	\
+			    1ULL << (MYERS_WORD - 1));			\
+		h = myers_block(&pv[b], &mv[b], eq[b], h, peq->hbit);	\
+		score += h;						\
+		/* each column left can take at most one off */	\
+		if (score > k + (n - j - 1)) {				\
+			STATS_ADD(threshold_exits, 1);			\
+			return (k + 1);					\
+		}							\
+	}								\
+	return (score);							\
+}
+
+MYERS_DISTANCE(1)
+MYERS_DISTANCE(2)
+MYERS_DISTANCE(4)
+MYERS_DISTANCE(8)
+
+DISTANCE_CLONES
+size_t
+myers_distance(const struct myers_peq *peq, const void *text, size_t n,
+    size_t k)
+{
+	uint64_t        buf[2 * 8], *pv;
+	size_t          d;
+
+	if (peq->m == 0)
+		return (n <= k ? n : k + 1);
+	k = min(k, max(peq->m, n));
+	if (peq->nblocks <= 8)
+		pv = buf;
+	else if ((pv = malloc(2 * peq->nblocks * sizeof(uint64_t))) == NULL)
+		return ((size_t) -1);
+	else
+		STATS_ADD(allocs, 1);
+
+	switch (peq->width) {
+	case 1:
+		d = myers_distance_1(peq, text, n, k, pv, pv + peq->nblocks);
+		break;
+	case 2:
+		d = myers_distance_2(peq, text, n, k, pv, pv + peq->nblocks);
+		break;
+	case 4:
+		d = myers_distance_4(peq, text, n, k, pv, pv + peq->nblocks);
+		break;
+	default:
+		d = myers_distance_8(peq, text, n, k, pv, pv + peq->nblocks);
+		break;
+	}
+
+	if (pv != buf)
+		free(pv);
+	return (d);
+}
+
+/*
+   single word version for byte patterns of 1 to 64 bytes, the common
+   case for words and short lines. the caller fills peq on the stack
+   so there is no allocation at all.
+ */
+DISTANCE_CLONES
+size_t
+myers_distance_word(const uint64_t *peq, size_t m, const void *text,
+    size_t n, size_t k)
+{
+	const unsigned char *t = text;
+	uint64_t        pv = ~0ULL, mv = 0, hbit = 1ULL << (m - 1);
+	size_t          j, score = m;
+
+	k = min(k, max(m, n));
+	for (j = 0; j < n; j++) {
+		score += myers_block(&pv, &mv, peq[t[j]], 1, hbit);
+		if (score > k + (n - j - 1)) {
+			STATS_ADD(threshold_exits, 1);
+			return (k + 1);
+		}
+	}
+	return (score);
+}
+
+/*
+   the last row of the matrix of a byte pattern against text: row[j]
+   is the distance between the pattern and the first j bytes of text,
+   for j from 0 to n. this is what Hirschberg's alignment needs from
+   each half. returns -1 if out of memory.
+ */
+DISTANCE_CLONES
+int
+myers_row(const struct myers_peq *peq, const void *text, size_t n,
+    size_t *row)
+{
+	const unsigned char *t = text;
+	const uint64_t *eq;
+	uint64_t       *pv, *mv;
+	size_t          b, j, nb = peq->nblocks;
+	int             h;
+
+	if ((pv = malloc(2 * nb * sizeof(uint64_t))) == NULL)
+		return (-1);
+	STATS_ADD(allocs, 1);
+	mv = pv + nb;
+	for (b = 0; b < nb; b++) {
+		pv[b] = ~0ULL;
+		mv[b] = 0;
+	}
+	row[0] = peq->m;
+	for (j = 0; j < n; j++) {
+		eq = peq->direct + (size_t) t[j] * nb;
+		h = 1;
+		for (b = 0; b + 1 < nb; b++)
+			h = myers_block(&pv[b], &mv[b], eq[b], h,
+			    1ULL << (MYERS_WORD - 1));
+		h = myers_block(&pv[b], &mv[b], eq[b], h, peq->hbit);
+		row[j + 1] = row[j] + h;
+	}
+	free(pv);
+	return (0);
+}
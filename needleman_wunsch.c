@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "distance.h"
+#include "distance_int.h"
 
 /**
    S. B. Needleman and C. D. Wunsch, "A general method applicable to the
@@ -16,54 +17,243 @@
    high cost.
  */
 
+/* the matrix has 255 entries per side, larger bytes share the last */
+#define NW_IDX(c)	((c) > 254 ? 254 : (c))
+
+/*
+   the first row and column hold the insertion cost of the first byte
+   of one input against each byte of the other, reading a NUL past the
+   end of the other input.
+ */
+#define NW_EDGE_I(s, n, t, m, i)					\
+	NW_IDX((i) < (m) ? (t)[i] : 0)
+#define NW_EDGE_J(s, n, t, m, j)					\
+	NW_IDX((j) < (n) ? (s)[j] : 0)
+
+DISTANCE_CLONES
 double
 needleman_wunsch_d(const void *d1, size_t len1, const void *d2, size_t len2, struct matrix *mt)
 {
-	double 		cost, a, b, c, *d, distance;
-	int		k, i, j, n, m, from, to;
-	char           *s, *t;
+	double 		cost, a, b, c, *d, *prev, *cur, *tmp, distance;
+	size_t		i, j, n, m;
+	unsigned char	from, to;
+	const unsigned char *s, *t;
 
 	//Step 1
-	s = (char *) d1;
-	t = (char *) d2;
+	s = d1;
+	t = d2;
 	n = len1;
 	m = len2;
 	if (n != 0 && m != 0) {
-		d = malloc((sizeof(double)) * (m + 1) * (n + 1));
-		m++;
-		n++;
+		/* two rows of the matrix, the one before and this one */
+		d = malloc((sizeof(double)) * 2 * (m + 1));
+		if (d == NULL)
+			return (-1);
+		STATS_ADD(allocs, 1);
+		STATS_CALL(DISTANCE_NEEDLEMAN_WUNSCH, len1, len2,
+		    (unsigned long long) len1 * len2, DISTANCE_KERNEL_FULL);
+		prev = d;
+		cur = d + m + 1;
 		//Step 2
-		for (k = 0; k < n; k++) {
-			from = s[0];
-			to = t[k];
-			d[k] = mt->insertion[from][to];
-		}
-		for (k = 0; k < m; k++) {
-			from = s[k];
-			to = t[0];
-			d[k * n] = mt->insertion[from][to];
-		}
-		d[0] = 0;		// XXX
+		for (j = 0; j <= m; j++)
+			prev[j] = mt->insertion[NW_EDGE_J(s, n, t, m, j)]
+			    [NW_IDX(t[0])];
+		prev[0] = 0;		// XXX
 		//Step 3 and 4
-		for (i = 1; i < n; i++)
-			for (j = 1; j < m; j++) {
-				from = s[i - 1];
-				to = t[j - 1];
+		for (i = 1; i <= n; i++) {
+			cur[0] = mt->insertion[NW_IDX(s[0])]
+			    [NW_EDGE_I(s, n, t, m, i)];
+			from = NW_IDX(s[i - 1]);
+			for (j = 1; j <= m; j++) {
+				to = NW_IDX(t[j - 1]);
 				//Step 5
 				if (s[i - 1] == t[j - 1])
 					cost = 0;
 				else
 					cost = mt->conversion[from][to];
 				//Step 6
-				a = d[(j - 1) * n + i] + mt->insertion[from][to];
-				b = d[j * n + i - 1] + mt->insertion[from][to];
-				c = d[(j - 1) * n + i - 1] + cost;
-				d[j * n + i] = (min(a,(min(b,c))));
+				a = cur[j - 1] + mt->insertion[from][to];
+				b = prev[j] + mt->insertion[from][to];
+				c = prev[j - 1] + cost;
+				cur[j] = (min(a,(min(b,c))));
 			}
-		distance = d[n * m - 1];
+			tmp = prev;
+			prev = cur;
+			cur = tmp;
+		}
+		distance = prev[m];
 		free(d);
 		return distance;
-	} else
+	} else {
+		STATS_CALL(DISTANCE_NEEDLEMAN_WUNSCH, len1, len2, 0,
+		    DISTANCE_KERNEL_TRIVIAL);
 		return (max(m,n));
+	}
 	// return the full string cost if one is zero length
 }
+
+/*
+   fixed point. most cost matrices are written with a digit or two
+   after the point, so every cost is an integer once scaled by a small
+   power of two or ten. matrix_quantize() finds the smallest such scale
+   and needleman_wunsch_q_d() then runs on integers, in 16 bit cells
+   when the lengths and costs guarantee they cannot overflow, and
+   otherwise in saturating 16 bit cells that fall back to 32 and then
+   64 bits if a cell reaches the limit.
+ */
+static const int nw_scales[] = {
+	1, 2, 4, 5, 8, 10, 16, 20, 25, 32, 50, 64, 100, 128, 256, 1000,
+	1024, 10000
+};
+
+static int
+nw_quantize(double v, int scale, int *out)
+{
+	double          x = v * scale, r;
+
+	r = x < 0 ? -(double) (long long) (-x + 0.5) :
+	    (double) (long long) (x + 0.5);
+	if (r > INT32_MAX / 4 || r < -(INT32_MAX / 4))
+		return (-1);
+	if ((x - r > 1e-6 * max(1, r < 0 ? -r : r)) ||
+	    (r - x > 1e-6 * max(1, r < 0 ? -r : r)))
+		return (-1);
+	*out = (int) r;
+	return (0);
+}
+
+/*
+   fills q with the costs of m scaled to integers. returns 0, or -1 if
+   some cost is not a multiple of 1 / 10000 or too large.
+ */
+int
+matrix_quantize(const struct matrix *m, struct matrix_q *q)
+{
+	size_t          k;
+	int             x, y, v, ok, maxcost;
+
+	for (k = 0; k < sizeof(nw_scales) / sizeof(nw_scales[0]); k++) {
+		ok = 1;
+		maxcost = 0;
+		for (x = 0; x < 255 && ok; x++)
+			for (y = 0; y < 255 && ok; y++) {
+				if (nw_quantize(m->conversion[x][y],
+				    nw_scales[k], &v) == -1) {
+					ok = 0;
+					break;
+				}
+				q->conversion[x][y] = v;
+				maxcost = max(maxcost, v < 0 ? -v : v);
+				if (nw_quantize(m->insertion[x][y],
+				    nw_scales[k], &v) == -1) {
+					ok = 0;
+					break;
+				}
+				q->insertion[x][y] = v;
+				maxcost = max(maxcost, v < 0 ? -v : v);
+			}
+		if (ok) {
+			q->scale = nw_scales[k];
+			q->maxcost = maxcost;
+			return (0);
+		}
+	}
+	return (-1);
+}
+
+/*
+   one kernel per cell type. SAT saturates every cell, the edges
+   included, at the limits of T and reports 1 in *over if any cell got
+   there.
+ */
+#define NW_STORE(cell, v, LO, HI, SAT, hit) do {			\
+	long long       v_ = (v);					\
+									\
+	if (SAT && (v_ >= HI || v_ <= LO)) {				\
+		(hit) = 1;						\
+		v_ = v_ >= HI ? HI : LO;				\
+	}								\
+	(cell) = v_;							\
+} while (0)
+
+#define NW_Q(T, LO, HI, SAT)						\
+static long long							\
+nw_q_##T(const unsigned char *s, size_t n, const unsigned char *t,	\
+    size_t m, const struct matrix_q *q, T *prev, T *cur, int *over)	\
+{									\
+	long long       a, b, c, cost, ins;				\
+	size_t          i, j;						\
+	unsigned char   from, to;					\
+	T              *tmp;						\
+	int             hit = 0;					\
+									\
+	for (j = 0; j <= m; j++)					\
+		NW_STORE(prev[j], q->insertion[NW_EDGE_J(s, n, t, m,	\
+		    j)][NW_IDX(t[0])], LO, HI, SAT, hit);		\
+	prev[0] = 0;							\
+	for (i = 1; i <= n; i++) {					\
+		NW_STORE(cur[0], q->insertion[NW_IDX(s[0])]		\
+		    [NW_EDGE_I(s, n, t, m, i)], LO, HI, SAT, hit);	\
+		from = NW_IDX(s[i - 1]);				\
+		for (j = 1; j <= m; j++) {				\
+			to = NW_IDX(t[j - 1]);				\
+			ins = q->insertion[from][to];			\
+			cost = s[i - 1] == t[j - 1] ? 0 :		\
+			    q->conversion[from][to];			\
+			a = cur[j - 1] + ins;				\
+			b = prev[j] + ins;				\
+			c = prev[j - 1] + cost;				\
+			NW_STORE(cur[j], min(a, min(b, c)), LO, HI,	\
+			    SAT, hit);					\
+		}							\
+		tmp = prev;						\
+		prev = cur;						\
+		cur = tmp;						\
+	}								\
+	*over = hit;							\
+	return (prev[m]);						\
+}
+
+NW_Q(int16_t, INT16_MIN, INT16_MAX, 1)
+NW_Q(int32_t, INT32_MIN, INT32_MAX, 1)
+NW_Q(int64_t, INT64_MIN, INT64_MAX, 0)
+
+/* needleman_wunsch_d() with the costs of matrix_quantize() */
+DISTANCE_CLONES
+double
+needleman_wunsch_q_d(const void *d1, size_t len1, const void *d2,
+    size_t len2, const struct matrix_q *q)
+{
+	void           *d;
+	long long       r;
+	int             over = 1;
+
+	if (len1 == 0 || len2 == 0) {
+		STATS_CALL(DISTANCE_NEEDLEMAN_WUNSCH, len1, len2, 0,
+		    DISTANCE_KERNEL_TRIVIAL);
+		return (max(len1, len2));
+	}
+	if ((d = malloc(sizeof(int64_t) * 2 * (len2 + 1))) == NULL)
+		return (-1);
+	STATS_ADD(allocs, 1);
+	STATS_CALL(DISTANCE_NEEDLEMAN_WUNSCH, len1, len2,
+	    (unsigned long long) len1 * len2, DISTANCE_KERNEL_NARROW);
+
+	/*
+	   start with the narrowest cells that hold every single cost. a
+	   path adds up to (len1 + len2 + 1) * maxcost, which may not fit,
+	   so a kernel that saturated, edges included, hands over to the
+	   next wider one.
+	 */
+	if (q->maxcost < INT16_MAX)
+		r = nw_q_int16_t(d1, len1, d2, len2, q, d,
+		    (int16_t *) d + len2 + 1, &over);
+	if (over && (double) q->maxcost < INT32_MAX)
+		r = nw_q_int32_t(d1, len1, d2, len2, q, d,
+		    (int32_t *) d + len2 + 1, &over);
+	if (over)
+		r = nw_q_int64_t(d1, len1, d2, len2, q, d,
+		    (int64_t *) d + len2 + 1, &over);
+	free(d);
+	return ((double) r / q->scale);
+}
@@ -0,0 +1,566 @@
+/*	$Id$ */
+
+/*
+   the thread pool behind every parallel call in the library. the
+   threads are started once, on first use, and shared by all callers,
+   so batch calls made from many threads of a server do not each start
+   their own. distance_pool_set() sizes it, or distance_pool_executor()
+   hands the threads over to an executor the application already has.
+
+   a call to distance_parallel_for() is a job. the range [0, n) is cut
+   into one contiguous slice per thread taking part, the caller
+   included, and each takes chunks off the front of its own slice. a
+   thread that runs out steals the back half of another's slice,
+   trying the slices next to its own first, so that uneven costs (long
+   strings next to short ones) still keep every thread busy and each
+   thread keeps to a few contiguous stretches of the inputs. when the
+   cost of each item can be estimated (the product of the lengths for
+   an edit distance) a chunk is as many items as make up a fair share
+   of the total cost, instead of a fixed count.
+
+   the caller works on its own job too, and only waits for chunks other
+   threads are in the middle of, so a job never waits for a thread to
+   be free. that makes nested calls safe (a pool thread calling
+   distance_parallel_for() from inside a job) and means a job still
+   finishes if no thread can be started at all.
+
+   distance_pool_submit() runs a task on a pool thread, such as the
+   batches of async.c, so that they share the pool's threads instead of
+   each starting one. the threads help with jobs before they start a
+   task, and the pool keeps one thread even when sized to 1, for tasks.
+
+   a thread can set a cancel flag with distance_cancel(): once it is
+   set, the jobs the thread started, the nested ones included, hand out
+   no more chunks and distance_parallel_for() returns -1.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "distance_int.h"
+
+#define POOL_MAX_THREADS	256
+#define POOL_CHUNKS		16	/* chunks per thread, about */
+
+struct pool_slice {
+	pthread_mutex_t	 lock;
+	size_t		 lo;
+	size_t		 hi;
+} __attribute__((aligned(64)));
+
+struct pool_job {
+	distance_work_fn fn;
+	void		*arg;
+	distance_cost_fn cost;
+	uint64_t	 target;	/* cost of a chunk, with cost */
+	size_t		 chunk;		/* items in a chunk, without */
+	const volatile int *cancel;
+	int		 nslices;
+	int		 joined;	/* slices taken, atomically */
+	size_t		 left;		/* items not yet done, atomically */
+	int		 refs;		/* atomically */
+	int		 done;		/* under lock */
+	int		 exited;	/* helpers out of pool_work(), under lock */
+	int		 wanted;	/* helpers asked of the pool, not come */
+	struct pool_job	*next;		/* in the pool's queue */
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cv;
+	struct pool_slice slices[1];	/* [nslices] */
+};
+
+static struct {
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cv;
+	int		 size;		/* threads wanted, the callers' included */
+	int		 flags;
+	int		 nworkers;	/* threads started */
+	struct pool_job	*queue;		/* jobs asking for helpers */
+	struct distance_task *tasks;	/* tasks to start, oldest first */
+	struct distance_task **tail;
+	struct distance_executor ex;	/* used if ex.submit is set */
+} pool = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, NULL,
+	NULL, &pool.tasks, { NULL, NULL, 0 }
+};
+
+/* the pool threads wanted, with pool.lock held */
+#define POOL_WORKERS()	(pool.size > 1 ? pool.size - 1 : 1)
+
+/* the cancel flag of the calling thread, or of the job it works on */
+static __thread const volatile int *pool_cancel;
+
+int
+distance_ncpu(void)
+{
+	long            n;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+	n = 1;
+#endif
+	if (n < 1)
+		n = 1;
+	if (n > POOL_MAX_THREADS)
+		n = POOL_MAX_THREADS;
+	return ((int) n);
+}
+
+/* what nthreads 0 means: the executor's or the pool's size */
+int
+distance_pool_size(void)
+{
+	int             n;
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.ex.submit != NULL && pool.ex.nthreads > 0)
+		n = pool.ex.nthreads;
+	else
+		n = pool.size > 0 ? pool.size : distance_ncpu();
+	pthread_mutex_unlock(&pool.lock);
+	return (n);
+}
+
+/* returns non-zero if the calling thread's work has been cancelled */
+int
+distance_cancelled(void)
+{
+	return (pool_cancel != NULL &&
+	    __atomic_load_n(pool_cancel, __ATOMIC_RELAXED));
+}
+
+/*
+   sets the cancel flag of the calling thread, NULL for none. the
+   parallel calls the thread makes stop soon after *flag becomes
+   non-zero and return an error.
+ */
+void
+distance_cancel(const volatile int *flag)
+{
+	pool_cancel = flag;
+}
+
+static void
+pool_release(struct pool_job *job)
+{
+	int             i;
+
+	if (__sync_sub_and_fetch(&job->refs, 1) != 0)
+		return;
+	for (i = 0; i < job->nslices; i++)
+		pthread_mutex_destroy(&job->slices[i].lock);
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->cv);
+	free(job);
+}
+
+/*
+   takes a chunk off the front of slice s into [*lo, *hi). returns 0,
+   or -1 if the slice is empty.
+ */
+static int
+pool_take(struct pool_job *job, struct pool_slice *s, size_t *lo,
+    size_t *hi)
+{
+	uint64_t        c;
+	size_t          i;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->lo >= s->hi) {
+		pthread_mutex_unlock(&s->lock);
+		return (-1);
+	}
+	i = s->lo;
+	if (job->cost != NULL)
+		for (c = 0; i < s->hi && c < job->target; i++)
+			c += job->cost(i, job->arg);
+	else
+		i = min(s->hi, i + job->chunk);
+	*lo = s->lo;
+	*hi = s->lo = i;
+	pthread_mutex_unlock(&s->lock);
+	return (0);
+}
+
+/*
+   moves the back half of another slice into slice me, nearest first.
+   returns 0, or -1 if there was nothing left to steal.
+ */
+static int
+pool_steal(struct pool_job *job, int me)
+{
+	struct pool_slice *v, *s = &job->slices[me];
+	size_t          lo, hi, mid;
+	int             d, k;
+
+	for (d = 1; d < job->nslices; d++) {
+		k = (me + d) % job->nslices;
+		v = &job->slices[k];
+		pthread_mutex_lock(&v->lock);
+		if (v->lo >= v->hi) {
+			pthread_mutex_unlock(&v->lock);
+			continue;
+		}
+		mid = v->lo + (v->hi - v->lo) / 2;
+		lo = mid;
+		hi = v->hi;
+		v->hi = mid;
+		pthread_mutex_unlock(&v->lock);
+		pthread_mutex_lock(&s->lock);
+		s->lo = lo;
+		s->hi = hi;
+		pthread_mutex_unlock(&s->lock);
+		return (0);
+	}
+	return (-1);
+}
+
+/* marks n items done, waking the caller after the last */
+static void
+pool_finish(struct pool_job *job, size_t n)
+{
+	if (__sync_sub_and_fetch(&job->left, n) != 0)
+		return;
+	pthread_mutex_lock(&job->lock);
+	job->done = 1;
+	pthread_cond_broadcast(&job->cv);
+	pthread_mutex_unlock(&job->lock);
+}
+
+/* after a cancel, drops what is left of every slice */
+static void
+pool_drain(struct pool_job *job)
+{
+	struct pool_slice *s;
+	size_t          n;
+	int             k;
+
+	for (k = 0; k < job->nslices; k++) {
+		s = &job->slices[k];
+		pthread_mutex_lock(&s->lock);
+		n = s->hi - s->lo;
+		s->lo = s->hi;
+		pthread_mutex_unlock(&s->lock);
+		if (n > 0)
+			pool_finish(job, n);
+	}
+}
+
+/* one thread's part of a job, on slice me */
+static void
+pool_work(struct pool_job *job, int me)
+{
+	const volatile int *saved = pool_cancel;
+	size_t          lo, hi;
+
+	/* nested jobs started from here are cancelled with this one */
+	pool_cancel = job->cancel;
+	for (;;) {
+		if (job->cancel != NULL &&
+		    __atomic_load_n(job->cancel, __ATOMIC_RELAXED)) {
+			pool_drain(job);
+			break;
+		}
+		if (pool_take(job, &job->slices[me], &lo, &hi) == -1) {
+			if (pool_steal(job, me) == -1)
+				break;
+			continue;
+		}
+		job->fn(lo, hi, job->arg);
+		pool_finish(job, hi - lo);
+	}
+	pool_cancel = saved;
+}
+
+/* a helper joining a job, run by a pool thread or the executor */
+static void
+pool_help(void *p)
+{
+	struct pool_job *job = p;
+	int             me;
+
+	me = __sync_fetch_and_add(&job->joined, 1);
+	if (me < job->nslices) {
+		pool_work(job, me);
+		pthread_mutex_lock(&job->lock);
+		job->exited++;
+		pthread_cond_broadcast(&job->cv);
+		pthread_mutex_unlock(&job->lock);
+	}
+	pool_release(job);
+}
+
+static void
+pool_pin(int cpu)
+{
+#if defined(__linux__) && defined(CPU_SET)
+	cpu_set_t       set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu % distance_ncpu(), &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+static void *
+pool_thread(void *p)
+{
+	struct pool_job *job;
+	struct distance_task *t;
+	int             id = (int) (intptr_t) p;
+
+	/* the caller's thread is the first CPU's, the pool's the others */
+	if (pool.flags & DISTANCE_POOL_AFFINITY)
+		pool_pin(id + 1);
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		/* a smaller pool lets the last threads go */
+		if (id >= POOL_WORKERS() && id == pool.nworkers - 1)
+			break;
+		if ((job = pool.queue) == NULL && (t = pool.tasks) != NULL) {
+			if ((pool.tasks = t->next) == NULL)
+				pool.tail = &pool.tasks;
+			pthread_mutex_unlock(&pool.lock);
+			/* t may be gone once it has run */
+			t->fn(t->arg);
+			pthread_mutex_lock(&pool.lock);
+			continue;
+		}
+		if (job == NULL) {
+			pthread_cond_wait(&pool.cv, &pool.lock);
+			continue;
+		}
+		if (--job->wanted == 0)
+			pool.queue = job->next;
+		pthread_mutex_unlock(&pool.lock);
+		pool_help(job);
+		pthread_mutex_lock(&pool.lock);
+	}
+	pool.nworkers--;
+	pthread_cond_broadcast(&pool.cv);
+	pthread_mutex_unlock(&pool.lock);
+	return (NULL);
+}
+
+/* starts pool threads up to the size, with pool.lock held */
+static void
+pool_start(void)
+{
+	pthread_attr_t  attr;
+	pthread_t       tid;
+
+	if (pool.size == 0)
+		pool.size = distance_ncpu();
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (pool.nworkers < POOL_WORKERS()) {
+		if (pthread_create(&tid, &attr, pool_thread,
+		    (void *) (intptr_t) pool.nworkers) != 0)
+			break;
+		pool.nworkers++;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+   sizes the pool to nthreads threads, the thread making a parallel call
+   counted as one of them; 0 means one per CPU. with the
+   DISTANCE_POOL_AFFINITY flag each pool thread is kept to a CPU of its
+   own. may be called at any time, threads above the new size leave
+   once idle. returns 0, or -1 on bad arguments.
+ */
+int
+distance_pool_set(int nthreads, int flags)
+{
+	if (nthreads < 0 || nthreads > POOL_MAX_THREADS ||
+	    (flags & ~DISTANCE_POOL_AFFINITY) != 0)
+		return (-1);
+	pthread_mutex_lock(&pool.lock);
+	pool.size = nthreads > 0 ? nthreads : distance_ncpu();
+	pool.flags = flags;
+	if (pool.nworkers > 0)
+		pool_start();
+	pthread_cond_broadcast(&pool.cv);
+	pthread_mutex_unlock(&pool.lock);
+	return (0);
+}
+
+/*
+   runs the helpers of every parallel call on ex instead of the pool's
+   own threads, NULL to go back to them. ex is copied.
+ */
+void
+distance_pool_executor(const struct distance_executor *ex)
+{
+	pthread_mutex_lock(&pool.lock);
+	if (ex != NULL && ex->submit != NULL)
+		pool.ex = *ex;
+	else
+		pool.ex.submit = NULL;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+   runs fn over [0, n) on up to nthreads threads, 0 meaning the size of
+   the pool, in chunks each costing about the same by cost, which may
+   be NULL for items of even cost. returns 0, or -1 if cancelled.
+ */
+int
+distance_parallel_for_cost(size_t n, int nthreads, distance_work_fn fn,
+    void *arg, distance_cost_fn cost)
+{
+	struct distance_executor ex;
+	struct pool_job *job, **jp;
+	uint64_t        total;
+	size_t          i, per, lo, hi;
+	int             k, nhelp, nin, unfilled;
+
+	if (n == 0)
+		return (0);
+	if (distance_cancelled())
+		return (-1);
+	if (nthreads <= 0)
+		nthreads = distance_pool_size();
+	pthread_mutex_lock(&pool.lock);
+	ex = pool.ex;
+	pthread_mutex_unlock(&pool.lock);
+	if (nthreads > POOL_MAX_THREADS)
+		nthreads = POOL_MAX_THREADS;
+	if ((size_t) nthreads > n)
+		nthreads = (int) n;
+
+	if (nthreads == 1 || (job = calloc(1, sizeof(*job) +
+	    (nthreads - 1) * sizeof(struct pool_slice))) == NULL) {
+		if (pool_cancel == NULL) {
+			fn(0, n, arg);
+			return (0);
+		}
+		/* in chunks still, to notice a cancel */
+		per = max(n / POOL_CHUNKS, 1);
+		for (lo = 0; lo < n && !distance_cancelled(); lo = hi) {
+			hi = min(n, lo + per);
+			fn(lo, hi, arg);
+		}
+		return (distance_cancelled() ? -1 : 0);
+	}
+	job->fn = fn;
+	job->arg = arg;
+	job->cost = cost;
+	job->cancel = pool_cancel;
+	job->nslices = nthreads;
+	job->joined = 1;
+	job->left = n;
+	job->chunk = max(n / ((size_t) nthreads * POOL_CHUNKS), 1);
+	if (cost != NULL) {
+		for (i = 0, total = 0; i < n; i++)
+			total += cost(i, arg);
+		job->target = max(total / ((uint64_t) nthreads * POOL_CHUNKS),
+		    1);
+	}
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cv, NULL);
+	per = n / nthreads;
+	for (k = 0; k < nthreads; k++) {
+		pthread_mutex_init(&job->slices[k].lock, NULL);
+		job->slices[k].lo = k * per;
+		job->slices[k].hi = k == nthreads - 1 ? n : (k + 1) * per;
+	}
+	nhelp = nthreads - 1;
+	job->refs = 1 + nhelp;
+
+	if (ex.submit != NULL) {
+		for (k = 0; k < nhelp; k++)
+			ex.submit(pool_help, job, ex.ctx);
+	} else {
+		pthread_mutex_lock(&pool.lock);
+		if (pool.size == 0 || pool.nworkers < POOL_WORKERS())
+			pool_start();
+		job->wanted = nhelp;
+		job->next = pool.queue;
+		pool.queue = job;
+		pthread_cond_broadcast(&pool.cv);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	pool_work(job, 0);
+	pthread_mutex_lock(&job->lock);
+	while (!job->done)
+		pthread_cond_wait(&job->cv, &job->lock);
+	pthread_mutex_unlock(&job->lock);
+
+	/*
+	   pool_work() reads the caller's cancel flag, which may be gone
+	   once this returns. so helpers yet to join are turned away, and
+	   those that did join are waited for: the job is done, they only
+	   have to find that out.
+	 */
+	k = __sync_fetch_and_add(&job->joined, job->nslices);
+	nin = min(k, job->nslices) - 1;
+	pthread_mutex_lock(&job->lock);
+	while (job->exited < nin)
+		pthread_cond_wait(&job->cv, &job->lock);
+	pthread_mutex_unlock(&job->lock);
+
+	/* helpers that never came are not waited for, they do nothing */
+	if (ex.submit == NULL) {
+		pthread_mutex_lock(&pool.lock);
+		unfilled = job->wanted;
+		if (unfilled > 0)
+			for (jp = &pool.queue; *jp != NULL; jp = &(*jp)->next)
+				if (*jp == job) {
+					*jp = job->next;
+					break;
+				}
+		job->wanted = 0;
+		pthread_mutex_unlock(&pool.lock);
+		while (unfilled-- > 0)
+			pool_release(job);
+	}
+	k = job->cancel != NULL &&
+	    __atomic_load_n(job->cancel, __ATOMIC_RELAXED) ? -1 : 0;
+	pool_release(job);
+	return (k);
+}
+
+/*
+   runs t->fn(t->arg) on a pool thread, or on the executor if there is
+   one. t must stay in place until it has started. returns 0, or -1 if
+   no thread could be started.
+ */
+int
+distance_pool_submit(struct distance_task *t)
+{
+	struct distance_executor ex;
+
+	pthread_mutex_lock(&pool.lock);
+	ex = pool.ex;
+	if (ex.submit == NULL) {
+		if (pool.size == 0 || pool.nworkers < POOL_WORKERS())
+			pool_start();
+		if (pool.nworkers == 0) {
+			pthread_mutex_unlock(&pool.lock);
+			return (-1);
+		}
+		t->next = NULL;
+		*pool.tail = t;
+		pool.tail = &t->next;
+		pthread_cond_broadcast(&pool.cv);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	if (ex.submit != NULL)
+		ex.submit(t->fn, t->arg, ex.ctx);
+	return (0);
+}
+
+/* distance_parallel_for_cost() with items of even cost */
+int
+distance_parallel_for(size_t n, int nthreads, distance_work_fn fn, void *arg)
+{
+	return (distance_parallel_for_cost(n, nthreads, fn, arg, NULL));
+}
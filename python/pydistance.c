@@ -1,3 +1,4 @@
+#define PY_SSIZE_T_CLEAN
 #include <sys/types.h>
 #include "Python.h"
 #include "distance.h"
@@ -141,6 +142,39 @@ pydistance_jaccard(PyObject *na, PyObject *args)
 	return PyFloat_FromDouble((long) ret);
 }
 
+static char	pydistance__jaro__doc__[] =
+"jaro(string1, string2)\n\n"
+"The Jaro distance, 1 minus the Jaro similarity of two strings: the\n"
+"characters they have in common near the same position and how many of\n"
+"those are out of order. 0 for identical strings, 1 for strings with\n"
+"nothing in common. It suits short strings such as names.";
+
+static PyObject *
+pydistance_jaro(PyObject *na, PyObject *args)
+{
+	char *str1, *str2;
+
+	if (!PyArg_ParseTuple(args, "ss", &str1, &str2)) return NULL;
+	return PyFloat_FromDouble(jaro_d(str1, strlen(str1), str2,
+	    strlen(str2)));
+}
+
+static char	pydistance__jaro_winkler__doc__[] =
+"jaro_winkler(string1, string2, p=0.1)\n\n"
+"The Jaro-Winkler distance, the Jaro distance lowered for strings that\n"
+"start with the same (up to 4) characters, by p for each.";
+
+static PyObject *
+pydistance_jaro_winkler(PyObject *na, PyObject *args)
+{
+	char *str1, *str2;
+	double p = 0.1;
+
+	if (!PyArg_ParseTuple(args, "ss|d", &str1, &str2, &p)) return NULL;
+	return PyFloat_FromDouble(jaro_winkler_d(str1, strlen(str1), str2,
+	    strlen(str2), p));
+}
+
 static char	pydistance__minkowski__doc__[] =
 "minkowski(string1, string2, power)\n\n"
 "The Minkowski distance between two strings is the geometric distance\n"
@@ -364,19 +398,399 @@ pydistance_nw_matrix_setInsertion(struct nw_matrix * self, PyObject *args)
 	return PyFloat_FromDouble(0.0);
 }
 
+/* batch interfaces, these run every comparison in C without the GIL */
+
+static PyTypeObject distance_MatrixType;
+
+struct pymetric {
+	char		*name;
+	distance_fn	 f;
+	int		 power;		/* for the minkowski family */
+};
+
+static struct pymetric pymetrics[] = {
+	{ "levenshtein",	levenshtein_fn,		0 },
+	{ "damerau",		damerau_fn,		0 },
+	{ "hamming",		hamming_fn,		0 },
+	{ "jaccard",		jaccard_fn,		0 },
+	{ "jaro",		jaro_fn,		0 },
+	{ "jaro_winkler",	jaro_winkler_fn,	0 },
+	{ "minkowski",		minkowski_fn,		0 },
+	{ "manhattan",		minkowski_fn,		1 },
+	{ "euclid",		minkowski_fn,		2 },
+	{ "needleman_wunsch",	needleman_wunsch_fn,	0 },
+	{ NULL,			NULL,			0 }
+};
+
+/*
+   resolve a metric name and its extra arguments into a distance_fn and
+   the argument it wants. *power must stay alive as long as *arg is used.
+ */
+static int
+get_metric(char *name, PyObject *matrix, int *power, distance_fn *f,
+    void **arg)
+{
+	struct pymetric *pm;
+
+	for (pm = pymetrics; pm->name != NULL; pm++)
+		if (strcmp(pm->name, name) == 0)
+			break;
+	if (pm->name == NULL) {
+		PyErr_Format(PyExc_ValueError, "unknown metric '%s'", name);
+		return (-1);
+	}
+	*f = pm->f;
+	*arg = NULL;
+	if (pm->f == minkowski_fn) {
+		if (pm->power != 0)
+			*power = pm->power;
+		*arg = power;
+	} else if (pm->f == needleman_wunsch_fn) {
+		if (matrix == NULL ||
+		    !PyObject_TypeCheck(matrix, &distance_MatrixType)) {
+			PyErr_SetString(PyExc_TypeError,
+			    "needleman_wunsch needs matrix=distance.nw_matrix");
+			return (-1);
+		}
+		*arg = &((struct nw_matrix *) matrix)->_m;
+	}
+	return (0);
+}
+
+/*
+   borrow the string buffers out of a Python sequence. the returned
+   fast sequence keeps them alive and must be released by the caller,
+   as must *data and *lens.
+ */
+static PyObject *
+get_strings(PyObject *seq, const void ***data, size_t **lens, Py_ssize_t *n)
+{
+	PyObject       *fast;
+	Py_ssize_t      i, len;
+	char           *s;
+
+	if ((fast = PySequence_Fast(seq, "expected a sequence of strings"))
+	    == NULL)
+		return (NULL);
+	*n = PySequence_Fast_GET_SIZE(fast);
+	*data = malloc(sizeof(void *) * (*n + 1));
+	*lens = malloc(sizeof(size_t) * (*n + 1));
+	if (*data == NULL || *lens == NULL) {
+		free(*data);
+		free(*lens);
+		Py_DECREF(fast);
+		PyErr_NoMemory();
+		return (NULL);
+	}
+	for (i = 0; i < *n; i++) {
+		if (PyString_AsStringAndSize(PySequence_Fast_GET_ITEM(fast, i),
+		    &s, &len) == -1) {
+			free(*data);
+			free(*lens);
+			Py_DECREF(fast);
+			return (NULL);
+		}
+		(*data)[i] = s;
+		(*lens)[i] = len;
+	}
+	return (fast);
+}
+
+/*
+   wrap a buffer of doubles as a numpy array of the given shape when
+   numpy is installed, otherwise as (nested) lists. steals buf.
+ */
+static PyObject *
+build_result(double *buf, Py_ssize_t rows, Py_ssize_t cols, int flat)
+{
+	PyObject       *np, *arr, *row, *ret;
+	void           *dst;
+	Py_ssize_t      i, j, n, dstlen;
+
+	n = flat ? cols : rows * cols;
+	if ((np = PyImport_ImportModule("numpy")) != NULL) {
+		if (flat)
+			arr = PyObject_CallMethod(np, "empty", "(n)", n);
+		else
+			arr = PyObject_CallMethod(np, "empty", "((nn))",
+			    rows, cols);
+		Py_DECREF(np);
+		if (arr == NULL)
+			goto fail;
+		if (PyObject_AsWriteBuffer(arr, &dst, &dstlen) == -1 ||
+		    dstlen != (Py_ssize_t) (n * sizeof(double))) {
+			Py_DECREF(arr);
+			goto fail;
+		}
+		memcpy(dst, buf, n * sizeof(double));
+		free(buf);
+		return (arr);
+	}
+	PyErr_Clear();
+
+	if (flat) {
+		if ((ret = PyList_New(n)) == NULL)
+			goto fail;
+		for (i = 0; i < n; i++)
+			PyList_SET_ITEM(ret, i, PyFloat_FromDouble(buf[i]));
+	} else {
+		if ((ret = PyList_New(rows)) == NULL)
+			goto fail;
+		for (i = 0; i < rows; i++) {
+			if ((row = PyList_New(cols)) == NULL) {
+				Py_DECREF(ret);
+				goto fail;
+			}
+			for (j = 0; j < cols; j++)
+				PyList_SET_ITEM(row, j,
+				    PyFloat_FromDouble(buf[i * cols + j]));
+			PyList_SET_ITEM(ret, i, row);
+		}
+	}
+	free(buf);
+	return (ret);
+fail:
+	free(buf);
+	return (NULL);
+}
+
+static char	pydistance__cdist__doc__[] =
+"cdist(list1, list2, metric='levenshtein', workers=0, matrix=None, power=1)\n\n"
+"Compute the distance between every string in list1 and every string in\n"
+"list2. The result is a len(list1) x len(list2) numpy array, or a list of\n"
+"lists when numpy is not installed. All comparisons run in C on up to\n"
+"workers threads, 0 meaning one per CPU. The needleman_wunsch metric\n"
+"needs a distance.nw_matrix passed as matrix, minkowski uses power.";
+
+static PyObject *
+pydistance_cdist(PyObject *na, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"list1", "list2", "metric", "workers",
+	    "matrix", "power", NULL};
+	PyObject *l1, *l2, *f1, *f2, *matrix = NULL;
+	char *metric = "levenshtein";
+	const void **a, **b;
+	size_t *alen, *blen;
+	Py_ssize_t na1, nb1;
+	int workers = 0, power = 1;
+	double *out;
+	distance_fn f;
+	void *arg;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|siOi", kwlist,
+	    &l1, &l2, &metric, &workers, &matrix, &power))
+		return NULL;
+	if (get_metric(metric, matrix, &power, &f, &arg) == -1)
+		return NULL;
+	if ((f1 = get_strings(l1, &a, &alen, &na1)) == NULL)
+		return NULL;
+	if ((f2 = get_strings(l2, &b, &blen, &nb1)) == NULL) {
+		free(a); free(alen); Py_DECREF(f1);
+		return NULL;
+	}
+	if ((out = malloc(sizeof(double) * (na1 * nb1 + 1))) == NULL) {
+		free(a); free(alen); Py_DECREF(f1);
+		free(b); free(blen); Py_DECREF(f2);
+		return PyErr_NoMemory();
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	distance_cdist(f, arg, a, alen, na1, b, blen, nb1, out, workers);
+	Py_END_ALLOW_THREADS
+
+	free(a); free(alen); Py_DECREF(f1);
+	free(b); free(blen); Py_DECREF(f2);
+	return build_result(out, na1, nb1, 0);
+}
+
+static char	pydistance__pdist__doc__[] =
+"pdist(list, metric='levenshtein', workers=0, matrix=None, power=1)\n\n"
+"Compute the distance between every pair of strings in list, returned\n"
+"in condensed form: a flat array of the n * (n - 1) / 2 distances for\n"
+"the pairs (0, 1), (0, 2), ... (1, 2), ... the same layout used by\n"
+"scipy.spatial.distance.pdist(). Arguments are as for cdist().";
+
+static PyObject *
+pydistance_pdist(PyObject *na, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"list", "metric", "workers", "matrix",
+	    "power", NULL};
+	PyObject *l1, *f1, *matrix = NULL;
+	char *metric = "levenshtein";
+	const void **a;
+	size_t *alen;
+	Py_ssize_t n, np;
+	int workers = 0, power = 1;
+	double *out;
+	distance_fn f;
+	void *arg;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|siOi", kwlist,
+	    &l1, &metric, &workers, &matrix, &power))
+		return NULL;
+	if (get_metric(metric, matrix, &power, &f, &arg) == -1)
+		return NULL;
+	if ((f1 = get_strings(l1, &a, &alen, &n)) == NULL)
+		return NULL;
+	np = n < 2 ? 0 : n * (n - 1) / 2;
+	if ((out = malloc(sizeof(double) * (np + 1))) == NULL) {
+		free(a); free(alen); Py_DECREF(f1);
+		return PyErr_NoMemory();
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	distance_pdist(f, arg, a, alen, n, out, workers);
+	Py_END_ALLOW_THREADS
+
+	free(a); free(alen); Py_DECREF(f1);
+	return build_result(out, 1, np, 1);
+}
+
+static char	pydistance__extract__doc__[] =
+"extract(query, choices, k=5, max_distance=-1, metric='levenshtein',\n"
+"        workers=0, matrix=None, power=1)\n\n"
+"Find the k strings in choices closest to query and return them as a\n"
+"list of (index, distance) tuples, closest first. Choices further away\n"
+"than max_distance are left out, a negative max_distance means no limit.\n"
+"Other arguments are as for cdist().";
+
+static PyObject *
+pydistance_extract(PyObject *na, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"query", "choices", "k", "max_distance",
+	    "metric", "workers", "matrix", "power", NULL};
+	PyObject *l1, *f1, *ret, *matrix = NULL;
+	char *metric = "levenshtein", *q;
+	Py_ssize_t qlen, n;
+	const void **b;
+	size_t *blen;
+	int i, k = 5, workers = 0, power = 1, found;
+	double max_distance = -1;
+	struct distance_match *out;
+	distance_fn f;
+	void *arg;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s#O|idsiOi", kwlist,
+	    &q, &qlen, &l1, &k, &max_distance, &metric, &workers, &matrix,
+	    &power))
+		return NULL;
+	if (k < 0)
+		return raisePydistanceError("k must not be negative");
+	if (get_metric(metric, matrix, &power, &f, &arg) == -1)
+		return NULL;
+	if ((f1 = get_strings(l1, &b, &blen, &n)) == NULL)
+		return NULL;
+	if ((out = malloc(sizeof(struct distance_match) * (k + 1))) == NULL) {
+		free(b); free(blen); Py_DECREF(f1);
+		return PyErr_NoMemory();
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	found = distance_extract(f, arg, q, qlen, b, blen, n, k, max_distance,
+	    out, workers);
+	Py_END_ALLOW_THREADS
+
+	free(b); free(blen); Py_DECREF(f1);
+	if (found == -1) {
+		free(out);
+		return raisePydistanceError("Couldn't allocate memory.");
+	}
+	if ((ret = PyList_New(found)) == NULL) {
+		free(out);
+		return NULL;
+	}
+	for (i = 0; i < found; i++)
+		PyList_SET_ITEM(ret, i, Py_BuildValue("(nd)",
+		    (Py_ssize_t) out[i].index, out[i].distance));
+	free(out);
+	return ret;
+}
+
+static char	pydistance__cluster__doc__[] =
+"cluster(list, eps, min_samples=1, metric='levenshtein', workers=0,\n"
+"        matrix=None, power=1)\n\n"
+"Group the strings in list into clusters with DBSCAN and return a list\n"
+"of labels, one per string. Strings within eps of min_samples strings\n"
+"(themselves included) are core strings, core strings within eps of each\n"
+"other share a cluster and other strings join the cluster of a core\n"
+"string within eps, or are noise and get the label -1. Clusters are\n"
+"numbered from 0 in the order of their first strings. With min_samples 1\n"
+"this is single linkage cut at eps. Neighbours come from a metric tree,\n"
+"not all pairs, so the metric should be a true metric (levenshtein,\n"
+"damerau is not). Other arguments are as for cdist().";
+
+static PyObject *
+pydistance_cluster(PyObject *na, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"list", "eps", "min_samples", "metric",
+	    "workers", "matrix", "power", NULL};
+	PyObject *l1, *f1, *ret, *matrix = NULL;
+	char *metric = "levenshtein";
+	const void **b;
+	size_t *blen;
+	Py_ssize_t i, n;
+	int min_samples = 1, workers = 0, power = 1, nc, *labels;
+	double eps;
+	distance_fn f;
+	void *arg;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Od|isiOi", kwlist,
+	    &l1, &eps, &min_samples, &metric, &workers, &matrix, &power))
+		return NULL;
+	if (eps < 0 || min_samples < 0)
+		return raisePydistanceError("eps and min_samples must not be "
+		    "negative");
+	if (get_metric(metric, matrix, &power, &f, &arg) == -1)
+		return NULL;
+	if ((f1 = get_strings(l1, &b, &blen, &n)) == NULL)
+		return NULL;
+	if ((labels = malloc(sizeof(int) * (n + 1))) == NULL) {
+		free(b); free(blen); Py_DECREF(f1);
+		return PyErr_NoMemory();
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	nc = distance_cluster(f, arg, b, blen, n, eps, min_samples, labels,
+	    workers);
+	Py_END_ALLOW_THREADS
+
+	free(b); free(blen); Py_DECREF(f1);
+	if (nc == -1) {
+		free(labels);
+		return raisePydistanceError("Couldn't allocate memory.");
+	}
+	if ((ret = PyList_New(n)) == NULL) {
+		free(labels);
+		return NULL;
+	}
+	for (i = 0; i < n; i++)
+		PyList_SET_ITEM(ret, i, PyInt_FromLong((long) labels[i]));
+	free(labels);
+	return ret;
+}
+
 #define mkMethod(x)                                             \
     {#x, pydistance_##x, METH_VARARGS, pydistance__##x##__doc__}
+#define mkKwMethod(x)                                           \
+    {#x, (PyCFunction)pydistance_##x, METH_VARARGS | METH_KEYWORDS, \
+     pydistance__##x##__doc__}
 
 static PyMethodDef pydistance_methods[] = {
 	mkMethod(levenshtein),
 	mkMethod(hamming),
 	mkMethod(damerau),
 	mkMethod(jaccard),
+	mkMethod(jaro),
+	mkMethod(jaro_winkler),
 	mkMethod(minkowski),
 	mkMethod(manhattan),
 	mkMethod(euclid),
 	mkMethod(bloom),
 	mkMethod(needleman_wunsch),
+	mkKwMethod(cdist),
+	mkKwMethod(pdist),
+	mkKwMethod(extract),
+	mkKwMethod(cluster),
 	{NULL, NULL}
 };
 
@@ -14,8 +14,9 @@ setup(
 		"distancemodule",
 		sources = ["pydistance.c"],
 		include_dirs = [".."],
-		libraries = ["distance"],
-		library_dirs = [".."]
+		# link the static library so the module needs nothing at runtime
+		extra_objects = ["../libdistance.a"],
+		libraries = ["m", "pthread"],
 		) ],
 	url = "http://monkey.org/~jose/software/libdistance/",
 )
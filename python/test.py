@@ -39,6 +39,13 @@ class DistanceTest(unittest.TestCase):
         self.assertEquals(distance.jaccard(s1, s2), -1)
         # print distance.jaccard(s2, s4)
 
+    def testJaro(self):
+        self.assertAlmostEqual(distance.jaro('MARTHA', 'MARHTA'),
+            1 - 0.944444, 5)
+        self.assertAlmostEqual(distance.jaro_winkler('MARTHA', 'MARHTA'),
+            1 - 0.961111, 5)
+        self.assertEquals(distance.jaro('abc', 'xyz'), 1)
+
     def testMD(self):
         str1 = "hello my name is jose"
         str2 = "hello m yname is jose"
@@ -66,6 +73,28 @@ class DistanceTest(unittest.TestCase):
         self.failUnlessAlmostEqual(distance.needleman_wunsch(str1, str3, m), 0.2, 2)
         del(m)
 
+    def testBatch(self):
+        a = ["hello", "hlelo", "help"]
+        b = ["hello", "jello", "yellow", "world"]
+        d = distance.cdist(a, b, workers = 2)
+        for i in range(len(a)):
+            for j in range(len(b)):
+                self.assertEquals(d[i][j], distance.levenshtein(a[i], b[j]))
+        self.assertEquals(list(distance.pdist(a)), [2, 2, 2])
+        self.assertEquals(distance.extract("hello", b, k = 2),
+                          [(0, 0.0), (1, 1.0)])
+        self.assertEquals(len(distance.extract("hello", b, k = 4,
+                                               max_distance = 1)), 2)
+        self.assertRaises(ValueError, distance.cdist, a, b, metric = "nope")
+
+    def testCluster(self):
+        v = ['Vi--agra', 'Via-gra', 'Viagra', 'Viaqra', 'hello', 'hlelo',
+             'jello', 'world']
+        self.assertEquals(distance.cluster(v, 1),
+                          [0, 1, 1, 1, 2, 3, 2, 4])
+        self.assertEquals(distance.cluster(v, 2, min_samples = 3),
+                          [0, 0, 0, 0, 1, 1, 1, -1])
+
 if __name__ == '__main__':
     # When this module is executed from the command-line, run all its tests
     unittest.main()
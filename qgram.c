@@ -0,0 +1,403 @@
+/*	$Id$ */
+
+/*
+   q-gram profiles: the q-grams of an input, each run of q bytes, and
+   how often each occurs. unlike jaccard_d, which compares position by
+   position, they do not care where in the inputs a q-gram is, so they
+   suit text of different lengths and text with its parts reordered.
+
+   E. Ukkonen, "Approximate string-matching with q-grams and maximal
+   matches", Theoretical Computer Science, 92, 191-211, 1992. the
+   q-gram distance is the sum over all q-grams of the difference of
+   their counts, at most 2q times the edit distance. the
+   cosine distance is 1 minus the cosine of the angle between the two
+   count vectors, the dice distance 1 minus twice the q-grams in common
+   over the q-grams of both.
+
+   a profile is built once per input: a q-gram of up to 4 bytes is its
+   own 32 bit id, a longer one is hashed to 32 bits (so two may collide).
+   the ids are sorted and kept with their counts, so comparing two
+   profiles is a merge of two sorted arrays that gives the sum of the
+   smaller counts and the dot product at once, with the totals and
+   norms kept in the profile. the merge compares blocks of 4 ids of
+   each side against each other with SSE2, all 16 pairs in 4 compares,
+   and moves on by the block with the smaller last id.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "distance.h"
+#include "distance_int.h"
+
+#define QGRAM_SHORT	64	/* sorted without qsort() up to this */
+
+struct distance_qgram {
+	size_t		 n;		/* distinct q-grams */
+	uint64_t	 total;		/* q-grams, len - q + 1 */
+	double		 norm;		/* of the count vector */
+	uint32_t	*id;		/* sorted */
+	uint32_t	*count;
+};
+
+/* what a merge of two profiles adds up */
+struct qgram_sums {
+	uint64_t	 common;	/* sum of the smaller counts */
+	uint64_t	 dot;		/* sum of the products */
+};
+
+static int
+qgram_idcmp(const void *a, const void *b)
+{
+	uint32_t        x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/* the id of the q-gram at s */
+static __inline uint32_t
+qgram_id(const unsigned char *s, size_t q)
+{
+	uint64_t        h = 0xcbf29ce484222325ULL;
+	uint32_t        id = 0;
+	size_t          i;
+
+	if (q <= 4) {
+		for (i = 0; i < q; i++)
+			id = id << 8 | s[i];
+		return (id);
+	}
+	/* FNV-1a, folded */
+	for (i = 0; i < q; i++)
+		h = (h ^ s[i]) * 0x100000001b3ULL;
+	return ((uint32_t) (h ^ h >> 32));
+}
+
+/*
+   the profile of the q-grams of d, or NULL if out of memory or q is 0.
+   an input shorter than q has an empty profile.
+ */
+struct distance_qgram *
+distance_qgram_new(const void *d, size_t len, size_t q)
+{
+	struct distance_qgram *qp;
+	const unsigned char *s = d;
+	uint32_t       *id, x;
+	size_t          i, k, n;
+	double          sq = 0;
+
+	if (q == 0)
+		return (NULL);
+	n = len >= q ? len - q + 1 : 0;
+	/* the ids shrink in place, the counts go after them */
+	if ((qp = malloc(sizeof(*qp) + 2 * n * sizeof(uint32_t))) == NULL)
+		return (NULL);
+	STATS_ADD(allocs, 1);
+	id = (uint32_t *) (qp + 1);
+	for (i = 0; i < n; i++)
+		id[i] = qgram_id(s + i, q);
+	if (n > QGRAM_SHORT)
+		qsort(id, n, sizeof(*id), qgram_idcmp);
+	else
+		/* insertion sort, for names and words */
+		for (i = 1; i < n; i++) {
+			x = id[i];
+			for (k = i; k > 0 && id[k - 1] > x; k--)
+				id[k] = id[k - 1];
+			id[k] = x;
+		}
+
+	qp->id = id;
+	qp->count = id + n;
+	qp->total = n;
+	for (i = 0, k = 0; i < n; k++) {
+		qp->id[k] = id[i];
+		for (qp->count[k] = 0; i < n && id[i] == qp->id[k]; i++)
+			qp->count[k]++;
+		sq += (double) qp->count[k] * qp->count[k];
+	}
+	qp->n = k;
+	qp->norm = sqrt(sq);
+	return (qp);
+}
+
+void
+distance_qgram_free(struct distance_qgram *qp)
+{
+	free(qp);
+}
+
+/* the number of q-grams in the profile */
+size_t
+distance_qgram_count(const struct distance_qgram *qp)
+{
+	return ((size_t) qp->total);
+}
+
+/*
+   the merge of a and b. the id arrays are unique, so a pair of equal
+   ids is only ever in one pair of blocks.
+ */
+static __inline void
+qgram_merge(const struct distance_qgram *a, const struct distance_qgram *b,
+    struct qgram_sums *s)
+{
+	const uint32_t *ia = a->id, *ib = b->id, *ca = a->count,
+	               *cb = b->count;
+	size_t          i = 0, j = 0, na = a->n, nb = b->n;
+	uint64_t        common = 0, dot = 0;
+#ifdef __SSE2__
+	__m128i         va, vb, wa, wb, eq[4], x, y, lt, mn, vmin, vdot,
+	                zero = _mm_setzero_si128();
+	uint64_t        t[2];
+	uint32_t        amax, bmax;
+	int             r;
+
+	vmin = vdot = zero;
+	while (i + 4 <= na && j + 4 <= nb) {
+		va = _mm_loadu_si128((const __m128i *) (ia + i));
+		vb = _mm_loadu_si128((const __m128i *) (ib + j));
+		/* lane k of a against lane k + r of b */
+		for (r = 0; r < 4; r++) {
+			eq[r] = _mm_cmpeq_epi32(va, vb);
+			vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+		}
+		amax = ia[i + 3];
+		bmax = ib[j + 3];
+		/* most blocks have nothing in common, skip the counts */
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(eq[0], eq[1]),
+		    _mm_or_si128(eq[2], eq[3]))) != 0) {
+			wa = _mm_loadu_si128((const __m128i *) (ca + i));
+			wb = _mm_loadu_si128((const __m128i *) (cb + j));
+			for (r = 0; r < 4; r++) {
+				x = _mm_and_si128(eq[r], wa);
+				y = _mm_and_si128(eq[r], wb);
+				/* counts are below 2^31, signed will do */
+				lt = _mm_cmplt_epi32(x, y);
+				mn = _mm_or_si128(_mm_and_si128(lt, x),
+				    _mm_andnot_si128(lt, y));
+				vmin = _mm_add_epi64(vmin, _mm_add_epi64(
+				    _mm_unpacklo_epi32(mn, zero),
+				    _mm_unpackhi_epi32(mn, zero)));
+				vdot = _mm_add_epi64(vdot, _mm_add_epi64(
+				    _mm_mul_epu32(x, y), _mm_mul_epu32(
+				    _mm_srli_epi64(x, 32),
+				    _mm_srli_epi64(y, 32))));
+				wb = _mm_shuffle_epi32(wb,
+				    _MM_SHUFFLE(0, 3, 2, 1));
+			}
+		}
+		if (amax <= bmax)
+			i += 4;
+		if (bmax <= amax)
+			j += 4;
+	}
+	_mm_storeu_si128((__m128i *) t, vmin);
+	common = t[0] + t[1];
+	_mm_storeu_si128((__m128i *) t, vdot);
+	dot = t[0] + t[1];
+#endif
+	while (i < na && j < nb) {
+		if (ia[i] < ib[j])
+			i++;
+		else if (ia[i] > ib[j])
+			j++;
+		else {
+			common += min(ca[i], cb[j]);
+			dot += (uint64_t) ca[i] * cb[j];
+			i++;
+			j++;
+		}
+	}
+	s->common = common;
+	s->dot = dot;
+}
+
+/* the distance of the given metric from the sums of a merge */
+static double
+qgram_dist(int metric, const struct distance_qgram *a,
+    const struct distance_qgram *b, const struct qgram_sums *s)
+{
+	switch (metric) {
+	case DISTANCE_QGRAM_COSINE:
+		if (a->total == 0 || b->total == 0)
+			return (a->total == b->total ? 0.0 : 1.0);
+		return (max(1.0 - s->dot / (a->norm * b->norm), 0.0));
+	case DISTANCE_QGRAM_DICE:
+		if (a->total + b->total == 0)
+			return (0.0);
+		return (1.0 - 2.0 * s->common / (a->total + b->total));
+	default:
+		return ((double) (a->total + b->total - 2 * s->common));
+	}
+}
+
+/*
+   the distance between two profiles, built with the same q: metric is
+   DISTANCE_QGRAM_UKKONEN, DISTANCE_QGRAM_COSINE or DISTANCE_QGRAM_DICE.
+   returns -1 for an unknown metric.
+ */
+DISTANCE_CLONES
+double
+distance_qgram_d(int metric, const struct distance_qgram *a,
+    const struct distance_qgram *b)
+{
+	struct qgram_sums s;
+
+	if (metric < DISTANCE_QGRAM_UKKONEN || metric > DISTANCE_QGRAM_DICE)
+		return (-1.0);
+	STATS_CALL(DISTANCE_QGRAM, a->total, b->total, a->n + b->n,
+	    DISTANCE_KERNEL_LINEAR);
+	qgram_merge(a, b, &s);
+	return (qgram_dist(metric, a, b, &s));
+}
+
+struct qgram_many {
+	int		 metric;
+	const struct distance_qgram *q;
+	const struct distance_qgram * const *b;
+	double		*out;
+};
+
+DISTANCE_CLONES
+static void
+qgram_many_range(size_t lo, size_t hi, void *arg)
+{
+	struct qgram_many *qm = arg;
+	struct qgram_sums s;
+	size_t          j;
+
+	for (j = lo; j < hi; j++) {
+		STATS_CALL(DISTANCE_QGRAM, qm->q->total, qm->b[j]->total,
+		    qm->q->n + qm->b[j]->n, DISTANCE_KERNEL_LINEAR);
+		qgram_merge(qm->q, qm->b[j], &s);
+		qm->out[j] = qgram_dist(qm->metric, qm->q, qm->b[j], &s);
+	}
+}
+
+static uint64_t
+qgram_many_cost(size_t j, void *arg)
+{
+	struct qgram_many *qm = arg;
+
+	return (qm->q->n + qm->b[j]->n);
+}
+
+/*
+   distance_qgram_d() between the profile q and every profile b[j],
+   into out[j], spread over nthreads threads, 0 means one per CPU.
+   returns 0, or -1 for an unknown metric or if cancelled.
+ */
+int
+distance_qgram_many(int metric, const struct distance_qgram *q,
+    const struct distance_qgram * const *b, size_t nb, double *out,
+    int nthreads)
+{
+	struct qgram_many qm;
+
+	if (metric < DISTANCE_QGRAM_UKKONEN || metric > DISTANCE_QGRAM_DICE)
+		return (-1);
+	qm.metric = metric;
+	qm.q = q;
+	qm.b = b;
+	qm.out = out;
+	return (distance_parallel_for_cost(nb, nthreads, qgram_many_range,
+	    &qm, qgram_many_cost));
+}
+
+struct qgram_build {
+	const void * const *b;
+	const size_t	*blen;
+	size_t		 q;
+	struct distance_qgram **out;
+	int		 failed;
+};
+
+static void
+qgram_build_range(size_t lo, size_t hi, void *arg)
+{
+	struct qgram_build *qb = arg;
+	size_t          i;
+
+	for (i = lo; i < hi; i++)
+		if ((qb->out[i] = distance_qgram_new(qb->b[i], qb->blen[i],
+		    qb->q)) == NULL)
+			qb->failed = 1;
+}
+
+/*
+   the profiles of the n inputs b[i], into out[i], built on nthreads
+   threads. returns 0, or -1 if out of memory or cancelled, with none
+   of them left.
+ */
+int
+distance_qgram_profiles(const void * const *b, const size_t *blen,
+    size_t n, size_t q, struct distance_qgram **out, int nthreads)
+{
+	struct qgram_build qb;
+	size_t          i;
+
+	if (q == 0)
+		return (-1);
+	memset(out, 0, n * sizeof(*out));
+	qb.b = b;
+	qb.blen = blen;
+	qb.q = q;
+	qb.out = out;
+	qb.failed = 0;
+	if (distance_parallel_for(n, nthreads, qgram_build_range,
+	    &qb) == -1 || qb.failed) {
+		for (i = 0; i < n; i++) {
+			distance_qgram_free(out[i]);
+			out[i] = NULL;
+		}
+		return (-1);
+	}
+	return (0);
+}
+
+/* one pair of inputs, through two profiles */
+static double
+qgram_pair(int metric, const void *d1, size_t len1, const void *d2,
+    size_t len2, size_t q)
+{
+	struct distance_qgram *a, *b;
+	double          d = -1.0;
+
+	a = distance_qgram_new(d1, len1, q);
+	b = distance_qgram_new(d2, len2, q);
+	if (a != NULL && b != NULL)
+		d = distance_qgram_d(metric, a, b);
+	distance_qgram_free(a);
+	distance_qgram_free(b);
+	return (d);
+}
+
+/*
+   the three distances between two inputs, building their profiles
+   each time. returns -1 if out of memory or q is 0.
+ */
+double
+qgram_d(const void *d1, size_t len1, const void *d2, size_t len2,
+    size_t q)
+{
+	return (qgram_pair(DISTANCE_QGRAM_UKKONEN, d1, len1, d2, len2, q));
+}
+
+double
+qgram_cosine_d(const void *d1, size_t len1, const void *d2, size_t len2,
+    size_t q)
+{
+	return (qgram_pair(DISTANCE_QGRAM_COSINE, d1, len1, d2, len2, q));
+}
+
+double
+qgram_dice_d(const void *d1, size_t len1, const void *d2, size_t len2,
+    size_t q)
+{
+	return (qgram_pair(DISTANCE_QGRAM_DICE, d1, len1, d2, len2, q));
+}
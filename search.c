@@ -0,0 +1,188 @@
+/*	$Id$ */
+
+/*
+   approximate substring search: report every place in a text where
+   the pattern occurs with at most k edits (P. Sellers, "The theory
+   and computation of evolutionary distances: pattern recognition",
+   Journal of Algorithms, 1, 359-373, 1980).
+
+   this is the levenshtein matrix with row 0 all zeros, a match may
+   start anywhere in the text for free. the columns are computed with
+   the bit-parallel kernel of myers.c, and only the current column is
+   ever kept, so the text is streamed through in one pass in constant
+   memory however long it is. files are mapped rather than read, so
+   searching a spool does not copy it through a buffer either.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+/* read size when a file cannot be mapped (pipes, special files) */
+#define SEARCH_CHUNK	65536
+
+struct search {
+	struct myers_peq peq;
+	uint64_t	*vec;
+	struct myers_search ms;
+};
+
+/*
+   starts a search at text offset pos. vec holds the 2 * nblocks words
+   of the current column, the caller owns it and peq.
+ */
+void
+myers_search_start(struct myers_search *ms, const struct myers_peq *peq,
+    uint64_t *vec, size_t pos, size_t k, distance_hit_fn cb, void *arg)
+{
+	size_t          b;
+
+	memset(ms, 0, sizeof(*ms));
+	ms->peq = peq;
+	ms->pv = vec;
+	ms->mv = vec + peq->nblocks;
+	for (b = 0; b < peq->nblocks; b++) {
+		ms->pv[b] = ~0ULL;
+		ms->mv[b] = 0;
+	}
+	ms->score = peq->m;
+	ms->pos = pos;
+	ms->k = k;
+	ms->cb = cb;
+	ms->arg = arg;
+}
+
+/* runs the next n bytes of the text through the automaton */
+DISTANCE_CLONES
+void
+myers_search_feed(struct myers_search *ms, const void *text, size_t n)
+{
+	const unsigned char *t = text;
+	const uint64_t *eq;
+	size_t          b, j, nb = ms->peq->nblocks;
+	uint64_t        top = 1ULL << (MYERS_WORD - 1);
+	int             h;
+
+	for (j = 0; j < n && !ms->done; j++) {
+		eq = ms->peq->direct + (size_t) t[j] * nb;
+		/* row 0 is free, nothing comes in at the top */
+		h = 0;
+		for (b = 0; b + 1 < nb; b++)
+			h = myers_block(&ms->pv[b], &ms->mv[b], eq[b], h, top);
+		ms->score += myers_block(&ms->pv[b], &ms->mv[b], eq[b], h,
+		    ms->peq->hbit);
+		if (ms->score <= ms->k) {
+			ms->nhits++;
+			if (ms->cb != NULL &&
+			    ms->cb(ms->pos + j, (int) ms->score, ms->arg) != 0)
+				ms->done = 1;
+		}
+	}
+	ms->pos += j;
+	STATS_CALL(DISTANCE_LEVENSHTEIN, ms->peq->m, j,
+	    (unsigned long long) ms->peq->m * j, DISTANCE_KERNEL_BITPARALLEL);
+}
+
+static int
+search_init(struct search *s, const void *pat, size_t m, int k,
+    distance_hit_fn cb, void *arg)
+{
+	if (myers_peq_init(&s->peq, pat, m, 1) == -1)
+		return (-1);
+	if ((s->vec = malloc(2 * s->peq.nblocks * sizeof(uint64_t))) == NULL) {
+		myers_peq_free(&s->peq);
+		return (-1);
+	}
+	STATS_ADD(allocs, 1);
+	myers_search_start(&s->ms, &s->peq, s->vec, 0, k, cb, arg);
+	return (0);
+}
+
+static void
+search_free(struct search *s)
+{
+	free(s->vec);
+	myers_peq_free(&s->peq);
+}
+
+/*
+   calls cb(end, distance, arg) for every offset end in text at which
+   an approximate occurrence of the pattern ends, distance being the
+   fewest edits of any such occurrence (at most k). a non zero return
+   from cb stops the search. returns the number of offsets reported,
+   or -1 on error.
+ */
+int
+levenshtein_search(const void *pat, size_t m, const void *text, size_t n,
+    int k, distance_hit_fn cb, void *arg)
+{
+	struct search   s;
+
+	if (m == 0 || k < 0)
+		return (-1);
+	if (search_init(&s, pat, m, k, cb, arg) == -1)
+		return (-1);
+	myers_search_feed(&s.ms, text, n);
+	search_free(&s);
+	return (s.ms.nhits);
+}
+
+/* the same over the contents of the file at path */
+int
+levenshtein_search_file(const void *pat, size_t m, const char *path, int k,
+    distance_hit_fn cb, void *arg)
+{
+	struct search   s;
+	struct stat     sb;
+	unsigned char  *buf;
+	void           *map;
+	ssize_t         r;
+	int             fd, ret = -1;
+
+	if (m == 0 || k < 0)
+		return (-1);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (-1);
+	if (search_init(&s, pat, m, k, cb, arg) == -1) {
+		close(fd);
+		return (-1);
+	}
+
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+	    (map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) !=
+	    MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+		madvise(map, sb.st_size, MADV_SEQUENTIAL);
+#endif
+		myers_search_feed(&s.ms, map, sb.st_size);
+		munmap(map, sb.st_size);
+		ret = 0;
+	} else if ((buf = malloc(SEARCH_CHUNK)) != NULL) {
+		ret = 0;
+		while (!s.ms.done) {
+			r = read(fd, buf, SEARCH_CHUNK);
+			if (r == -1 && errno == EINTR)
+				continue;
+			if (r <= 0) {
+				if (r == -1)
+					ret = -1;
+				break;
+			}
+			myers_search_feed(&s.ms, buf, r);
+		}
+		free(buf);
+	}
+
+	close(fd);
+	search_free(&s);
+	return (ret == -1 ? -1 : s.ms.nhits);
+}
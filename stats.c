@@ -0,0 +1,129 @@
+/*	$Id$ */
+
+/*
+   optional runtime counters. every thread that computes a distance gets
+   its own struct distance_stats the first time it touches one, and all
+   of them are kept on a list so distance_stats_get() can add them up.
+   the blocks of threads that have exited are handed to the next new
+   thread rather than freed, so their counts are never lost and the
+   number of blocks never exceeds the peak number of threads.
+
+   reading the counters of a running thread is not synchronised, the
+   totals may be off by the calls in flight, which is fine for what
+   they are for.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+#ifdef DISTANCE_STATS
+
+struct stats_block {
+	struct distance_stats	 st;
+	struct stats_block	*next;		/* every block */
+	struct stats_block	*next_free;	/* blocks of exited threads */
+};
+
+__thread struct distance_stats *distance_stats_tls;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static struct stats_block *stats_all;
+static struct stats_block *stats_free;
+/* used when a block cannot be allocated, shared and racy but harmless */
+static struct stats_block stats_fallback;
+
+static void
+stats_release(void *p)
+{
+	struct stats_block *b = p;
+
+	pthread_mutex_lock(&stats_lock);
+	b->next_free = stats_free;
+	stats_free = b;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void
+stats_init(void)
+{
+	pthread_key_create(&stats_key, stats_release);
+	stats_fallback.next = stats_all;
+	stats_all = &stats_fallback;
+}
+
+struct distance_stats *
+distance_stats_self(void)
+{
+	struct stats_block *b;
+
+	pthread_once(&stats_once, stats_init);
+
+	pthread_mutex_lock(&stats_lock);
+	if ((b = stats_free) != NULL)
+		stats_free = b->next_free;
+	else if ((b = calloc(1, sizeof(*b))) != NULL) {
+		b->next = stats_all;
+		stats_all = b;
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	if (b == NULL)
+		return (distance_stats_tls = &stats_fallback.st);
+	pthread_setspecific(stats_key, b);
+	return (distance_stats_tls = &b->st);
+}
+
+int
+distance_stats_get(struct distance_stats *st)
+{
+	struct stats_block *b;
+	unsigned long long *dst, *src;
+	size_t          i, n;
+
+	memset(st, 0, sizeof(*st));
+	n = sizeof(*st) / sizeof(unsigned long long);
+	dst = (unsigned long long *) st;
+
+	pthread_mutex_lock(&stats_lock);
+	for (b = stats_all; b != NULL; b = b->next) {
+		src = (unsigned long long *) &b->st;
+		for (i = 0; i < n; i++)
+			dst[i] += src[i];
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	return (0);
+}
+
+void
+distance_stats_reset(void)
+{
+	struct stats_block *b;
+
+	pthread_mutex_lock(&stats_lock);
+	for (b = stats_all; b != NULL; b = b->next)
+		memset(&b->st, 0, sizeof(b->st));
+	pthread_mutex_unlock(&stats_lock);
+}
+
+#else	/* !DISTANCE_STATS */
+
+int
+distance_stats_get(struct distance_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	return (-1);
+}
+
+void
+distance_stats_reset(void)
+{
+}
+
+#endif	/* DISTANCE_STATS */
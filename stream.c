@@ -0,0 +1,266 @@
+/*	$Id$ */
+
+/*
+   incremental distance for input that grows a byte at a time, such as
+   a query being typed or a stream being classified. the fixed string
+   is the pattern of the bit-parallel kernel (myers.c) and the growing
+   one is its text, so each appended byte is one more column: O(m / 64)
+   words of work instead of the whole O(n * m) matrix again.
+
+   the column after every byte is kept on a stack, so taking bytes off
+   the end (backspace) only pops it. a column is the vertical +1 and -1
+   deltas of each block and row m's value, which is the distance. a
+   stream that is never popped far, such as one being classified, sets
+   a depth: only the last depth + 1 columns are needed then, and those
+   before them are dropped once the stack is full, by moving the rest
+   down, so it stays within about twice that.
+
+   the prefix distance, the distance from the text to the closest
+   prefix of the fixed string, is the smallest value in the column.
+   the value of row i is the column number plus the +1 deltas less the
+   -1 deltas above it, and the smallest comes right after a -1, so only
+   those rows are looked at.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+struct distance_stream {
+	struct myers_peq peq;
+	size_t		 nb;		/* words per column, one or more */
+	uint64_t	*cols;		/* [cap + 1][2][nb], pv then mv */
+	size_t		*scores;	/* [cap + 1], row m of each column */
+	size_t		 n;		/* bytes appended */
+	size_t		 base;		/* the column cols starts with */
+	size_t		 depth;		/* bytes that can be popped, 0 for all */
+	size_t		 cap;
+};
+
+/* the column after j bytes, j at least base */
+#define STREAM_PV(ds, j)	((ds)->cols + ((j) - (ds)->base) * 2 * (ds)->nb)
+#define STREAM_MV(ds, j)	(STREAM_PV(ds, j) + (ds)->nb)
+#define STREAM_SCORE(ds, j)	((ds)->scores[(j) - (ds)->base])
+
+/* the first column that can still be popped back to */
+static size_t
+stream_floor(const struct distance_stream *ds)
+{
+	if (ds->depth > 0 && ds->n - ds->base > ds->depth)
+		return (ds->n - ds->depth);
+	return (ds->base);
+}
+
+/* room for cap + 1 columns. returns 0, or -1 if out of memory */
+static int
+stream_resize(struct distance_stream *ds, size_t cap)
+{
+	uint64_t       *c;
+	size_t         *s;
+
+	if (cap >= SIZE_MAX / (2 * ds->nb * sizeof(uint64_t)))
+		return (-1);
+	if ((c = realloc(ds->cols,
+	    (cap + 1) * 2 * ds->nb * sizeof(uint64_t))) == NULL)
+		return (-1);
+	ds->cols = c;
+	if (cap < ds->cap)
+		ds->cap = cap;
+	if ((s = realloc(ds->scores, (cap + 1) * sizeof(size_t))) == NULL)
+		return (-1);
+	ds->scores = s;
+	STATS_ADD(allocs, 2);
+	ds->cap = cap;
+	return (0);
+}
+
+/* drops the columns before stream_floor() */
+static void
+stream_drop(struct distance_stream *ds)
+{
+	size_t          k = stream_floor(ds) - ds->base;
+
+	if (k == 0)
+		return;
+	memmove(ds->cols, ds->cols + k * 2 * ds->nb,
+	    (ds->n - ds->base - k + 1) * 2 * ds->nb * sizeof(uint64_t));
+	memmove(ds->scores, ds->scores + k,
+	    (ds->n - ds->base - k + 1) * sizeof(size_t));
+	ds->base += k;
+}
+
+/* room for one more column. returns 0, or -1 if out of memory */
+static int
+stream_room(struct distance_stream *ds)
+{
+	if (ds->n - ds->base < ds->cap)
+		return (0);
+	/* half the stack or more is below the floor */
+	if (ds->depth > 0 && ds->cap >= 2 * ds->depth) {
+		stream_drop(ds);
+		return (0);
+	}
+	if (ds->cap > SIZE_MAX / 2)
+		return (-1);
+	return (stream_resize(ds, ds->cap * 2));
+}
+
+void
+distance_stream_free(struct distance_stream *ds)
+{
+	if (ds == NULL)
+		return;
+	myers_peq_free(&ds->peq);
+	free(ds->cols);
+	free(ds->scores);
+	free(ds);
+}
+
+/*
+   a stream comparing the m bytes of s with the bytes appended to it,
+   none yet. s need not be kept. returns NULL if out of memory.
+ */
+struct distance_stream *
+distance_stream_new(const void *s, size_t m)
+{
+	struct distance_stream *ds;
+	size_t          b;
+
+	if ((ds = calloc(1, sizeof(*ds))) == NULL)
+		return (NULL);
+	STATS_ADD(allocs, 1);
+	if (m > 0 && myers_peq_init(&ds->peq, s, m, 1) == -1) {
+		free(ds);
+		return (NULL);
+	}
+	ds->peq.m = m;
+	ds->nb = m > 0 ? ds->peq.nblocks : 1;
+	if (stream_resize(ds, 16) == -1) {
+		distance_stream_free(ds);
+		return (NULL);
+	}
+	/* column 0, row i is i */
+	for (b = 0; b < ds->nb; b++) {
+		STREAM_PV(ds, 0)[b] = ~0ULL;
+		STREAM_MV(ds, 0)[b] = 0;
+	}
+	ds->scores[0] = m;
+	return (ds);
+}
+
+/* appends n bytes of text. returns 0, or -1 if out of memory */
+int
+distance_stream_append(struct distance_stream *ds, const void *text,
+    size_t n)
+{
+	const unsigned char *t = text;
+	const uint64_t *eq;
+	uint64_t       *pv, *mv;
+	size_t          b, j, nb = ds->nb;
+	int             h;
+
+	for (j = 0; j < n; j++, ds->n++) {
+		if (stream_room(ds) == -1)
+			return (-1);
+		if (ds->peq.m == 0) {
+			STREAM_SCORE(ds, ds->n + 1) = ds->n + 1;
+			continue;
+		}
+		pv = STREAM_PV(ds, ds->n + 1);
+		mv = STREAM_MV(ds, ds->n + 1);
+		memcpy(pv, STREAM_PV(ds, ds->n), 2 * nb * sizeof(uint64_t));
+		eq = myers_peq_lookup(&ds->peq, t[j]);
+		/* row 0 of a global alignment grows by one a column */
+		h = 1;
+		for (b = 0; b + 1 < nb; b++)
+			h = myers_block(&pv[b], &mv[b], eq[b], h,
+			    1ULL << (MYERS_WORD - 1));
+		h = myers_block(&pv[b], &mv[b], eq[b], h, ds->peq.hbit);
+		STREAM_SCORE(ds, ds->n + 1) = STREAM_SCORE(ds, ds->n) + h;
+	}
+	return (0);
+}
+
+/*
+   takes the last n bytes off again, or all there are, or with a depth
+   set as many of them as it allows
+ */
+void
+distance_stream_pop(struct distance_stream *ds, size_t n)
+{
+	ds->n -= min(n, ds->n - stream_floor(ds));
+}
+
+/*
+   lets only the last depth bytes be popped, 0 for all of them (the
+   default), so that the stream's memory no longer grows with its
+   length. the columns no longer needed are freed.
+ */
+void
+distance_stream_set_depth(struct distance_stream *ds, size_t depth)
+{
+	size_t          cap;
+
+	ds->depth = depth;
+	if (depth == 0)
+		return;
+	stream_drop(ds);
+	cap = max(depth > SIZE_MAX / 2 ? SIZE_MAX / 2 : 2 * depth, 16);
+	/* if this fails the stream keeps the memory it has */
+	if (ds->cap > cap)
+		stream_resize(ds, cap);
+}
+
+/* the bytes appended and not popped */
+size_t
+distance_stream_len(const struct distance_stream *ds)
+{
+	return (ds->n);
+}
+
+/* levenshtein_d() of the fixed string and the text so far */
+int
+distance_stream_distance(const struct distance_stream *ds)
+{
+	return ((int) STREAM_SCORE(ds, ds->n));
+}
+
+/*
+   the smallest levenshtein_d() of the text so far and a prefix of the
+   fixed string, 0 when the text is a prefix of it
+ */
+int
+distance_stream_prefix_distance(const struct distance_stream *ds)
+{
+	const uint64_t *pv, *mv;
+	uint64_t        p, x, mask, below;
+	size_t          b, nb = ds->nb, base, best, v;
+	int             bit;
+
+	if (ds->peq.m == 0)
+		return ((int) ds->n);
+	pv = STREAM_PV(ds, ds->n);
+	mv = STREAM_MV(ds, ds->n);
+	/* row 0 */
+	base = best = ds->n;
+	for (b = 0; b < nb; b++) {
+		/* rows past m are not part of the column */
+		mask = b == nb - 1 ? ds->peq.hbit | (ds->peq.hbit - 1) : ~0ULL;
+		p = pv[b] & mask;
+		x = mv[b] & mask;
+		/* skip the block if no row of it can get below best */
+		if (base < best + __builtin_popcountll(x))
+			for (; x != 0; x &= x - 1) {
+				bit = __builtin_ctzll(x);
+				below = bit == 63 ? ~0ULL : (2ULL << bit) - 1;
+				v = base + __builtin_popcountll(p & below) -
+				    __builtin_popcountll(mv[b] & below);
+				best = min(best, v);
+			}
+		base = base + __builtin_popcountll(p) -
+		    __builtin_popcountll(mv[b] & mask);
+	}
+	return ((int) best);
+}
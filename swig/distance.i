@@ -24,3 +24,339 @@ void 	bloom_create(const void *data, size_t len, const void *digest,
 double  bloom_d(const void *digest1, const void *digest2, size_t digest_len);
 double  needleman_wunsch_d(const void *d1, size_t len1, const void *d2, 
 		     size_t len2, struct matrix *m);
+
+/*
+	batch interfaces. the inputs are taken straight out of Tcl
+	ByteArray objects and lists (or Python strings and sequences)
+	without copying the data, and each call compares one input
+	against a whole list, or every pair in a list, returning the
+	distances as a list. this crosses the binding boundary once per
+	batch instead of once per pair.
+ */
+
+%{
+#include <stdlib.h>
+
+struct distance_list {
+	const void	**data;
+	size_t		 *lens;
+	size_t		  n;
+	double		 *out;
+	size_t		  nout;
+};
+
+static void
+distance_list_free(struct distance_list *l)
+{
+	if (l == NULL)
+		return;
+	free(l->data);
+	free(l->lens);
+	free(l->out);
+	free(l);
+}
+
+static struct distance_list *
+distance_list_new(size_t n, int pairs)
+{
+	struct distance_list *l;
+
+	if ((l = calloc(1, sizeof(*l))) == NULL)
+		return (NULL);
+	l->n = n;
+	if (pairs)
+		l->nout = n < 2 ? 0 : n * (n - 1) / 2;
+	else
+		l->nout = n;
+	l->data = malloc(sizeof(void *) * (n + 1));
+	l->lens = malloc(sizeof(size_t) * (n + 1));
+	l->out = malloc(sizeof(double) * (l->nout + 1));
+	if (l->data == NULL || l->lens == NULL || l->out == NULL) {
+		distance_list_free(l);
+		return (NULL);
+	}
+	return (l);
+}
+%}
+
+#if defined(SWIGTCL)
+
+%{
+static struct distance_list *
+distance_list_get(Tcl_Interp *interp, Tcl_Obj *obj, int pairs)
+{
+	struct distance_list *l;
+	Tcl_Obj **objv;
+	int i, objc, len;
+
+	if (Tcl_ListObjGetElements(interp, obj, &objc, &objv) != TCL_OK)
+		return (NULL);
+	if ((l = distance_list_new(objc, pairs)) == NULL) {
+		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+		return (NULL);
+	}
+	for (i = 0; i < objc; i++) {
+		l->data[i] = Tcl_GetByteArrayFromObj(objv[i], &len);
+		l->lens[i] = (size_t) len;
+	}
+	return (l);
+}
+
+static void
+distance_list_result(Tcl_Interp *interp, struct distance_list *l)
+{
+	Tcl_Obj *res;
+	size_t i;
+
+	res = Tcl_NewListObj(0, NULL);
+	for (i = 0; i < l->nout; i++)
+		Tcl_ListObjAppendElement(interp, res,
+		    Tcl_NewDoubleObj(l->out[i]));
+	Tcl_SetObjResult(interp, res);
+}
+%}
+
+/* a single input, as the bytes of any Tcl object */
+%typemap(in) (const void *q, size_t qlen) {
+	int len;
+
+	$1 = Tcl_GetByteArrayFromObj($input, &len);
+	$2 = (size_t) len;
+}
+
+%typemap(in) (const void * const *items, const size_t *lens, size_t n,
+    double *out) (struct distance_list *l = NULL) {
+	if ((l = distance_list_get(interp, $input, 0)) == NULL)
+		SWIG_fail;
+	$1 = (const void * const *) l->data;
+	$2 = l->lens;
+	$3 = l->n;
+	$4 = l->out;
+}
+
+%typemap(in) (const void * const *pairs, const size_t *lens, size_t n,
+    double *out) (struct distance_list *l = NULL) {
+	if ((l = distance_list_get(interp, $input, 1)) == NULL)
+		SWIG_fail;
+	$1 = (const void * const *) l->data;
+	$2 = l->lens;
+	$3 = l->n;
+	$4 = l->out;
+}
+
+%typemap(argout) (const void * const *items, const size_t *lens, size_t n,
+    double *out) {
+	distance_list_result(interp, l$argnum);
+}
+
+%typemap(argout) (const void * const *pairs, const size_t *lens, size_t n,
+    double *out) {
+	distance_list_result(interp, l$argnum);
+}
+
+%typemap(freearg) (const void * const *items, const size_t *lens, size_t n,
+    double *out) {
+	distance_list_free(l$argnum);
+}
+
+%typemap(freearg) (const void * const *pairs, const size_t *lens, size_t n,
+    double *out) {
+	distance_list_free(l$argnum);
+}
+
+#elif defined(SWIGPYTHON)
+
+%{
+/* the returned sequence keeps the strings alive until freearg */
+static PyObject *
+distance_list_get(PyObject *obj, struct distance_list **lp, int pairs)
+{
+	struct distance_list *l;
+	PyObject *fast;
+	Py_ssize_t i, len;
+	char *s;
+
+	if ((fast = PySequence_Fast(obj, "expected a sequence")) == NULL)
+		return (NULL);
+	if ((l = distance_list_new(PySequence_Fast_GET_SIZE(fast),
+	    pairs)) == NULL) {
+		Py_DECREF(fast);
+		PyErr_NoMemory();
+		return (NULL);
+	}
+	*lp = l;
+	for (i = 0; i < (Py_ssize_t) l->n; i++) {
+		if (PyString_AsStringAndSize(PySequence_Fast_GET_ITEM(fast, i),
+		    &s, &len) == -1) {
+			Py_DECREF(fast);
+			return (NULL);
+		}
+		l->data[i] = s;
+		l->lens[i] = (size_t) len;
+	}
+	return (fast);
+}
+
+static PyObject *
+distance_list_result(struct distance_list *l)
+{
+	PyObject *res;
+	size_t i;
+
+	if ((res = PyList_New(l->nout)) == NULL)
+		return (NULL);
+	for (i = 0; i < l->nout; i++)
+		PyList_SET_ITEM(res, i, PyFloat_FromDouble(l->out[i]));
+	return (res);
+}
+%}
+
+%typemap(in) (const void *q, size_t qlen) {
+	char *s;
+	Py_ssize_t len;
+
+	if (PyString_AsStringAndSize($input, &s, &len) == -1)
+		SWIG_fail;
+	$1 = s;
+	$2 = (size_t) len;
+}
+
+%typemap(in) (const void * const *items, const size_t *lens, size_t n,
+    double *out) (struct distance_list *l = NULL, PyObject *fast = NULL) {
+	if ((fast = distance_list_get($input, &l, 0)) == NULL)
+		SWIG_fail;
+	$1 = (const void * const *) l->data;
+	$2 = l->lens;
+	$3 = l->n;
+	$4 = l->out;
+}
+
+%typemap(in) (const void * const *pairs, const size_t *lens, size_t n,
+    double *out) (struct distance_list *l = NULL, PyObject *fast = NULL) {
+	if ((fast = distance_list_get($input, &l, 1)) == NULL)
+		SWIG_fail;
+	$1 = (const void * const *) l->data;
+	$2 = l->lens;
+	$3 = l->n;
+	$4 = l->out;
+}
+
+%typemap(argout) (const void * const *items, const size_t *lens, size_t n,
+    double *out) {
+	Py_XDECREF($result);
+	if (($result = distance_list_result(l$argnum)) == NULL)
+		SWIG_fail;
+}
+
+%typemap(argout) (const void * const *pairs, const size_t *lens, size_t n,
+    double *out) {
+	Py_XDECREF($result);
+	if (($result = distance_list_result(l$argnum)) == NULL)
+		SWIG_fail;
+}
+
+%typemap(freearg) (const void * const *items, const size_t *lens, size_t n,
+    double *out) {
+	distance_list_free(l$argnum);
+	Py_XDECREF(fast$argnum);
+}
+
+%typemap(freearg) (const void * const *pairs, const size_t *lens, size_t n,
+    double *out) {
+	distance_list_free(l$argnum);
+	Py_XDECREF(fast$argnum);
+}
+
+#endif
+
+/*
+	<metric>_many(q, items) returns a list of the distances between q
+	and each input in items, <metric>_pairs(items) the distances
+	between every pair of inputs in items, in the order (0, 1),
+	(0, 2), ... (1, 2), ...
+ */
+%inline %{
+void
+levenshtein_many(const void *q, size_t qlen, const void * const *items,
+    const size_t *lens, size_t n, double *out)
+{
+	distance_many(levenshtein_fn, NULL, q, qlen, items, lens, n, out, 0);
+}
+
+void
+levenshtein_pairs(const void * const *pairs, const size_t *lens, size_t n,
+    double *out)
+{
+	distance_pdist(levenshtein_fn, NULL, pairs, lens, n, out, 0);
+}
+
+void
+damerau_many(const void *q, size_t qlen, const void * const *items,
+    const size_t *lens, size_t n, double *out)
+{
+	distance_many(damerau_fn, NULL, q, qlen, items, lens, n, out, 0);
+}
+
+void
+damerau_pairs(const void * const *pairs, const size_t *lens, size_t n,
+    double *out)
+{
+	distance_pdist(damerau_fn, NULL, pairs, lens, n, out, 0);
+}
+
+void
+hamming_many(const void *q, size_t qlen, const void * const *items,
+    const size_t *lens, size_t n, double *out)
+{
+	distance_many(hamming_fn, NULL, q, qlen, items, lens, n, out, 0);
+}
+
+void
+hamming_pairs(const void * const *pairs, const size_t *lens, size_t n,
+    double *out)
+{
+	distance_pdist(hamming_fn, NULL, pairs, lens, n, out, 0);
+}
+
+void
+jaccard_many(const void *q, size_t qlen, const void * const *items,
+    const size_t *lens, size_t n, double *out)
+{
+	distance_many(jaccard_fn, NULL, q, qlen, items, lens, n, out, 0);
+}
+
+void
+jaccard_pairs(const void * const *pairs, const size_t *lens, size_t n,
+    double *out)
+{
+	distance_pdist(jaccard_fn, NULL, pairs, lens, n, out, 0);
+}
+
+void
+minkowski_many(const void *q, size_t qlen, const void * const *items,
+    const size_t *lens, size_t n, double *out, int power)
+{
+	distance_many(minkowski_fn, &power, q, qlen, items, lens, n, out, 0);
+}
+
+void
+minkowski_pairs(const void * const *pairs, const size_t *lens, size_t n,
+    double *out, int power)
+{
+	distance_pdist(minkowski_fn, &power, pairs, lens, n, out, 0);
+}
+
+void
+needleman_wunsch_many(const void *q, size_t qlen, const void * const *items,
+    const size_t *lens, size_t n, double *out, struct matrix *m)
+{
+	distance_many(needleman_wunsch_fn, m, q, qlen, items, lens, n, out, 0);
+}
+
+void
+needleman_wunsch_pairs(const void * const *pairs, const size_t *lens,
+    size_t n, double *out, struct matrix *m)
+{
+	distance_pdist(needleman_wunsch_fn, m, pairs, lens, n, out, 0);
+}
+%}
@@ -35,3 +35,10 @@ foreach a $list1 {					;# i
 	}
 	if {$i < $MAX} { incr i } else { set i 0 }
 }
+
+# the batch calls compare a whole list in one go, the inputs can be
+# strings or binary data (ByteArray objects)
+puts "levenshtein hello vs $list2: [::distance::levenshtein_many hello $list2]"
+puts "damerau pairs of $list2: [::distance::damerau_pairs $list2]"
+puts "binary: [::distance::levenshtein_many [binary format H* 00ff] \
+    [list [binary format H* 00fe] [binary format H* 0100]]]"
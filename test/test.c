@@ -13,6 +13,9 @@
 #include <stdint.h>
 #endif				/* __Darwin__ */
 #include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include "distance.h"
 
 static int      num_tests = 0;
@@ -355,6 +358,1773 @@ test_md(void)
 	return;
 } 
 
+static void
+test_batch(void)
+{
+	const char     *a[] = { "hello", "hlelo", "help" };
+	const char     *b[] = { "hello", "jello", "yellow", "world" };
+	size_t          alen[3], blen[4], i, j;
+	double          cd[12], pd[3];
+	struct distance_match m[4];
+	int             n;
+
+	printf("testing distance_cdist()\n");
+
+	for (i = 0; i < 3; i++)
+		alen[i] = strlen(a[i]);
+	for (i = 0; i < 4; i++)
+		blen[i] = strlen(b[i]);
+
+	distance_cdist(levenshtein_fn, NULL, (const void **) a, alen, 3,
+	    (const void **) b, blen, 4, cd, 2);
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 4; j++) {
+			printf("cdist[%lu][%lu] is %f ", (unsigned long) i,
+			    (unsigned long) j, cd[i * 4 + j]);
+			test_double_result(levenshtein_d(a[i], alen[i], b[j],
+			    blen[j]), cd[i * 4 + j]);
+		}
+
+	printf("testing distance_pdist()\n");
+
+	distance_pdist(levenshtein_fn, NULL, (const void **) a, alen, 3, pd, 0);
+	printf("pdist is %f %f %f ", pd[0], pd[1], pd[2]);
+	test_int_result(1, pd[0] == 2 && pd[1] == 2 && pd[2] == 2);
+
+	printf("testing distance_extract()\n");
+
+	n = distance_extract(levenshtein_fn, NULL, "hello", 5,
+	    (const void **) b, blen, 4, 2, -1, m, 0);
+	printf("extract returns %d: %lu %f, %lu %f ", n,
+	    (unsigned long) m[0].index, m[0].distance,
+	    (unsigned long) m[1].index, m[1].distance);
+	test_int_result(1, n == 2 && m[0].index == 0 && m[1].index == 1 &&
+	    m[1].distance == 1);
+
+	n = distance_extract(levenshtein_fn, NULL, "hello", 5,
+	    (const void **) b, blen, 4, 4, 1.0, m, 0);
+	printf("extract with max_distance 1 returns %d ", n);
+	test_int_result(2, n);
+
+	return;
+}
+
+/* jaro_winkler_d the slow way, byte by byte */
+static double
+jaro_ref(const unsigned char *s, size_t len1, const unsigned char *t,
+    size_t len2, double p)
+{
+	unsigned char   f[256], tm[256];
+	size_t          i, j, lo, hi, w, m = 0, tr = 0, l;
+	double          sim;
+
+	if (len1 == 0 || len2 == 0)
+		return (len1 == len2 ? 0.0 : 1.0);
+	w = (len1 > len2 ? len1 : len2) / 2;
+	w = w > 0 ? w - 1 : 0;
+	memset(f, 0, sizeof(f));
+	for (j = 0; j < len2; j++) {
+		lo = j > w ? j - w : 0;
+		hi = j + w + 1 < len1 ? j + w + 1 : len1;
+		for (i = lo; i < hi; i++)
+			if (!f[i] && s[i] == t[j]) {
+				f[i] = 1;
+				tm[m++] = t[j];
+				break;
+			}
+	}
+	if (m == 0)
+		return (1.0);
+	for (i = 0, j = 0; i < len1; i++)
+		if (f[i])
+			tr += s[i] != tm[j++];
+	sim = ((double) m / len1 + (double) m / len2 +
+	    (double) (m - tr / 2) / m) / 3;
+	if (sim > 0.7) {
+		for (l = 0; l < 4 && l < len1 && l < len2 && s[l] == t[l]; l++)
+			;
+		sim += l * p * (1 - sim);
+	}
+	return (1 - sim);
+}
+
+static void
+test_jaro(void)
+{
+	unsigned char  *buf;
+	const void     *b[300];
+	size_t          blen[300], i, j, bad;
+	double          jd, *out;
+
+	printf("testing jaro_d()\n");
+
+	jd = jaro_d("MARTHA", 6, "MARHTA", 6);
+	printf("jaro_d() returns %f ", jd);
+	test_double_result(1 - 0.944444, jd);
+
+	jd = jaro_winkler_d("MARTHA", 6, "MARHTA", 6, 0.1);
+	printf("jaro_winkler_d() returns %f ", jd);
+	test_double_result(1 - 0.961111, jd);
+
+	jd = jaro_d("DWAYNE", 6, "DUANE", 5);
+	printf("jaro_d() returns %f ", jd);
+	test_double_result(1 - 0.822222, jd);
+
+	jd = jaro_winkler_d("DWAYNE", 6, "DUANE", 5, 0.1);
+	printf("jaro_winkler_d() returns %f ", jd);
+	test_double_result(1 - 0.84, jd);
+
+	jd = jaro_winkler_d("DIXON", 5, "DICKSONX", 8, 0.1);
+	printf("jaro_winkler_d() returns %f ", jd);
+	test_double_result(1 - 0.813333, jd);
+
+	jd = jaro_d("abc", 3, "xyz", 3);
+	printf("jaro_d() returns %f ", jd);
+	test_double_result(1.0, jd);
+
+	jd = jaro_d("", 0, "", 0);
+	printf("jaro_d() returns %f ", jd);
+	test_double_result(0.0, jd);
+
+	/* either side of one word of masks */
+	buf = malloc(300 * 150);
+	out = malloc(300 * sizeof(double));
+	srandom(49);
+	for (i = 0; i < 300; i++) {
+		b[i] = buf + i * 150;
+		blen[i] = random() % 150;
+		for (j = 0; j < blen[i]; j++)
+			buf[i * 150 + j] = 'a' + random() % 4;
+	}
+	for (i = 0, bad = 0; i < 300; i++)
+		for (j = 0; j < 300; j += 7)
+			if (fabs(jaro_winkler_d(b[i], blen[i], b[j], blen[j],
+			    0.1) - jaro_ref(b[i], blen[i], b[j], blen[j],
+			    0.1)) > 1e-9)
+				bad++;
+	printf("jaro_winkler_d on random strings, %lu wrong ",
+	    (unsigned long) bad);
+	test_int_result(0, bad);
+
+	for (i = 0, bad = 0; i < 300; i += 13) {
+		jaro_winkler_many(b[i], blen[i], b, blen, 300, 0.1, out, 0);
+		for (j = 0; j < 300; j++)
+			if (fabs(out[j] - jaro_ref(b[i], blen[i], b[j],
+			    blen[j], 0.1)) > 1e-9)
+				bad++;
+	}
+	printf("jaro_winkler_many, %lu wrong ", (unsigned long) bad);
+	test_int_result(0, bad);
+
+	free(buf);
+	free(out);
+
+	return;
+}
+
+/* the q-gram distances of q = 2 with a full table of counts */
+static void
+qgram_ref(const unsigned char *s, size_t n, const unsigned char *t,
+    size_t m, double *d)
+{
+	static int      ca[65536], cb[65536];
+	double          dot = 0, na = 0, nb = 0, common = 0, diff = 0;
+	size_t          i;
+
+	memset(ca, 0, sizeof(ca));
+	memset(cb, 0, sizeof(cb));
+	for (i = 0; i + 1 < n; i++)
+		ca[s[i] << 8 | s[i + 1]]++;
+	for (i = 0; i + 1 < m; i++)
+		cb[t[i] << 8 | t[i + 1]]++;
+	for (i = 0; i < 65536; i++) {
+		dot += (double) ca[i] * cb[i];
+		na += (double) ca[i] * ca[i];
+		nb += (double) cb[i] * cb[i];
+		common += ca[i] < cb[i] ? ca[i] : cb[i];
+		diff += abs(ca[i] - cb[i]);
+	}
+	d[DISTANCE_QGRAM_UKKONEN] = diff;
+	d[DISTANCE_QGRAM_COSINE] = na == 0 || nb == 0 ? (na == nb ? 0 : 1) :
+	    1 - dot / (sqrt(na) * sqrt(nb));
+	d[DISTANCE_QGRAM_DICE] = na + nb == 0 ? 0 :
+	    1 - 2 * common / ((n > 1 ? n - 1 : 0) + (m > 1 ? m - 1 : 0));
+}
+
+static void
+test_qgram(void)
+{
+	struct distance_qgram *qp[200], *a, *b;
+	unsigned char  *buf;
+	const void     *s[200];
+	size_t          slen[200], i, j, bad, q = 5;
+	double          d, ref[3], *out;
+	int             metric;
+
+	printf("testing qgram_d()\n");
+
+	d = qgram_d("abcd", 4, "abdc", 4, 2);
+	printf("qgram_d() returns %f ", d);
+	test_double_result(4.0, d);
+
+	d = qgram_dice_d("abcd", 4, "abdc", 4, 2);
+	printf("qgram_dice_d() returns %f ", d);
+	test_double_result(2.0 / 3, d);
+
+	d = qgram_cosine_d("abcd", 4, "abdc", 4, 2);
+	printf("qgram_cosine_d() returns %f ", d);
+	test_double_result(2.0 / 3, d);
+
+	d = qgram_cosine_d("abab", 4, "ab", 2, 2);
+	printf("qgram_cosine_d() returns %f ", d);
+	test_double_result(1 - 2 / sqrt(5), d);
+
+	/* swapping the words only loses the q-grams across the space */
+	d = qgram_fn("hello world", 11, "world hello", 11, &q);
+	printf("qgram_fn() with q 5 returns %f ", d);
+	test_double_result(10.0, d);
+
+	a = distance_qgram_new("a", 1, 2);
+	b = distance_qgram_new("", 0, 2);
+	printf("distance_qgram_d() of empty profiles ");
+	test_double_result(0.0, distance_qgram_d(DISTANCE_QGRAM_COSINE, a,
+	    b));
+	distance_qgram_free(a);
+	distance_qgram_free(b);
+
+	/* long enough for the blocks of 4 and the tails */
+	buf = malloc(200 * 400);
+	out = malloc(200 * sizeof(double));
+	srandom(50);
+	for (i = 0; i < 200; i++) {
+		s[i] = buf + i * 400;
+		slen[i] = random() % 400;
+		for (j = 0; j < slen[i]; j++)
+			buf[i * 400 + j] = 'a' + random() % (i % 2 ? 6 : 20);
+	}
+	printf("distance_qgram_profiles ");
+	test_int_result(0, distance_qgram_profiles(s, slen, 200, 2, qp, 0));
+	for (metric = DISTANCE_QGRAM_UKKONEN, bad = 0;
+	    metric <= DISTANCE_QGRAM_DICE; metric++)
+		for (i = 0; i < 200; i += 9) {
+			distance_qgram_many(metric,
+			    (const struct distance_qgram *) qp[i],
+			    (const struct distance_qgram * const *) qp, 200,
+			    out, 0);
+			for (j = 0; j < 200; j++) {
+				qgram_ref(s[i], slen[i], s[j], slen[j], ref);
+				if (fabs(out[j] - ref[metric]) > 1e-9)
+					bad++;
+			}
+		}
+	printf("distance_qgram_many, %lu wrong ", (unsigned long) bad);
+	test_int_result(0, bad);
+
+	for (i = 0; i < 200; i++)
+		distance_qgram_free(qp[i]);
+	free(buf);
+	free(out);
+
+	return;
+}
+
+/* plain dynamic programming reference for the bit-parallel kernel */
+static int
+ref_ld(const unsigned char *s, size_t n, const unsigned char *t, size_t m)
+{
+	int            *d, r;
+	size_t          i, j;
+
+	d = malloc(sizeof(int) * (n + 1) * (m + 1));
+	for (i = 0; i <= n; i++)
+		d[i * (m + 1)] = i;
+	for (j = 0; j <= m; j++)
+		d[j] = j;
+	for (i = 1; i <= n; i++)
+		for (j = 1; j <= m; j++)
+			d[i * (m + 1) + j] = min(d[(i - 1) * (m + 1) + j] + 1,
+			    min(d[i * (m + 1) + j - 1] + 1,
+			    d[(i - 1) * (m + 1) + j - 1] +
+			    (s[i - 1] != t[j - 1])));
+	r = d[n * (m + 1) + m];
+	free(d);
+	return (r);
+}
+
+static void
+test_tok(void)
+{
+	unsigned char   s[300], t[300];
+	unsigned short  s16[300], t16[300];
+	unsigned int    s32[300], t32[300];
+	unsigned long long s64[300], t64[300];
+	size_t          n, m, i;
+	int             k, bad, badtok;
+	unsigned short  w1[] = { 1000, 2000, 3000, 4000 };
+	unsigned short  w2[] = { 1000, 3000, 2000, 4000 };
+
+	printf("testing levenshtein_d() against a reference ");
+	srandom(31);
+	bad = badtok = 0;
+	for (k = 0; k < 300; k++) {
+		n = random() % 200;
+		m = random() % 200;
+		/* small alphabets make for long runs of matches */
+		for (i = 0; i < n; i++)
+			s[i] = 'a' + random() % (k % 2 ? 4 : 26);
+		for (i = 0; i < m; i++)
+			t[i] = i < n && random() % 4 ? s[i] :
+			    'a' + random() % (k % 2 ? 4 : 26);
+		if (levenshtein_d(s, n, t, m) != ref_ld(s, n, t, m))
+			bad++;
+		for (i = 0; i < n; i++)
+			s64[i] = s32[i] = s16[i] = s[i] * 40503u;
+		for (i = 0; i < m; i++)
+			t64[i] = t32[i] = t16[i] = t[i] * 40503u;
+		if (levenshtein_tok_d(s16, n, t16, m, 2) != ref_ld(s, n, t, m) ||
+		    levenshtein_tok_d(s32, n, t32, m, 4) != ref_ld(s, n, t, m) ||
+		    levenshtein_tok_d(s64, n, t64, m, 8) != ref_ld(s, n, t, m))
+			badtok++;
+	}
+	test_int_result(0, bad);
+
+	printf("testing levenshtein_tok_d() against a reference ");
+	test_int_result(0, badtok);
+
+	printf("testing levenshtein_tok_d() with a bad width ");
+	test_int_result(-1, levenshtein_tok_d(s, 4, t, 4, 3));
+
+	printf("damerau_tok_d of swapped 16 bit tokens ");
+	test_int_result(0, damerau_tok_d(w1, 4, w2, 4, 2));
+
+	printf("levenshtein_tok_d of swapped 16 bit tokens ");
+	test_int_result(2, levenshtein_tok_d(w1, 4, w2, 4, 2));
+
+	printf("damerau_tok_d of bytes ");
+	test_int_result(damerau_d("abcd", 4, "acbe", 4),
+	    damerau_tok_d("abcd", 4, "acbe", 4, 1));
+
+	return;
+}
+
+static void
+test_utf8(void)
+{
+	/* "café" and "cafe", one accented letter, 2 bytes in UTF-8 */
+	const char     *c1 = "caf\xc3\xa9", *c2 = "cafe";
+	/* "naïve" and "nïave" */
+	const char     *n1 = "na\xc3\xafve", *n2 = "n\xc3\xaf" "ave";
+	/* a truncated sequence and a stray continuation byte */
+	const char     *b1 = "ab\xc3", *b2 = "ab\x80";
+	char            a1[64], a2[64];
+
+	printf("levenshtein_d of cafe with an accent ");
+	test_int_result(2, levenshtein_d(c1, strlen(c1), c2, strlen(c2)));
+
+	printf("levenshtein_utf8_d of cafe with an accent ");
+	test_int_result(1, levenshtein_utf8_d(c1, strlen(c1), c2, strlen(c2)));
+
+	printf("levenshtein_utf8_d of naive ");
+	test_int_result(2, levenshtein_utf8_d(n1, strlen(n1), n2, strlen(n2)));
+
+	printf("damerau_utf8_d of naive ");
+	test_int_result(0, damerau_utf8_d(n1, strlen(n1), n2, strlen(n2)));
+
+	printf("levenshtein_utf8_d of invalid bytes ");
+	test_int_result(1, levenshtein_utf8_d(b1, 3, b2, 3));
+
+	/* long enough to take the vector path of the ASCII check */
+	memset(a1, 'x', sizeof(a1));
+	memset(a2, 'x', sizeof(a2));
+	a2[40] = 'y';
+	printf("levenshtein_utf8_d of ASCII ");
+	test_int_result(1, levenshtein_utf8_d(a1, sizeof(a1), a2, sizeof(a2)));
+
+	return;
+}
+
+struct hits {
+	size_t          end[64];
+	int             dist[64];
+	int             n;
+};
+
+static int
+add_hit(size_t end, int distance, void *arg)
+{
+	struct hits    *h = arg;
+
+	if (h->n < 64) {
+		h->end[h->n] = end;
+		h->dist[h->n] = distance;
+	}
+	h->n++;
+	return (0);
+}
+
+static void
+test_search(void)
+{
+	const char     *text = "the quick brown fox jumps over the lazy dgo";
+	unsigned char   pat[100], hay[400];
+	char            path[] = "/tmp/distance.XXXXXX";
+	struct hits     h;
+	size_t          m, n, i, j, e;
+	int             k, r, bad, best, fd;
+
+	printf("levenshtein_search of fox ");
+	memset(&h, 0, sizeof(h));
+	r = levenshtein_search("fox", 3, text, strlen(text), 0, add_hit, &h);
+	test_int_result(1, r == 1 && h.n == 1 && h.end[0] == 18 &&
+	    h.dist[0] == 0);
+
+	printf("levenshtein_search of dog within 1 ");
+	memset(&h, 0, sizeof(h));
+	r = levenshtein_search("dog", 3, text, strlen(text), 1, add_hit, &h);
+	test_int_result(1, r == h.n && h.n > 0 &&
+	    h.end[h.n - 1] == strlen(text) - 2);
+
+	/* against the minimum over every start of the whole distance */
+	printf("levenshtein_search against a reference ");
+	srandom(33);
+	bad = 0;
+	for (k = 0; k < 40; k++) {
+		m = 1 + random() % 90;
+		n = random() % 300;
+		for (i = 0; i < m; i++)
+			pat[i] = 'a' + random() % 3;
+		for (i = 0; i < n; i++)
+			hay[i] = 'a' + random() % 3;
+		memset(&h, 0, sizeof(h));
+		/* k = m reports every offset */
+		r = levenshtein_search(pat, m, hay, n, m, add_hit, &h);
+		if (r != (int) n)
+			bad++;
+		for (e = 0; e < n && e < 64; e++) {
+			best = m;
+			for (j = 0; j <= e; j++)
+				best = min(best, ref_ld(pat, m, hay + j,
+				    e + 1 - j));
+			if (h.end[e] != e || h.dist[e] != best)
+				bad++;
+		}
+	}
+	test_int_result(0, bad);
+
+	printf("levenshtein_search_file of fox ");
+	fd = mkstemp(path);
+	write(fd, text, strlen(text));
+	close(fd);
+	memset(&h, 0, sizeof(h));
+	r = levenshtein_search_file("fox", 3, path, 0, add_hit, &h);
+	unlink(path);
+	test_int_result(1, r == 1 && h.end[0] == 18);
+
+	return;
+}
+
+struct mhits {
+	size_t          n[16];
+	unsigned long   sum[16];
+};
+
+static int
+add_mhit(size_t pattern, size_t end, int distance, void *arg)
+{
+	struct mhits   *h = arg;
+
+	h->n[pattern]++;
+	h->sum[pattern] += end * 31 + distance;
+	return (0);
+}
+
+static int
+sum_hit(size_t end, int distance, void *arg)
+{
+	unsigned long  *sum = arg;
+
+	*sum += end * 31 + distance;
+	return (0);
+}
+
+static void
+test_matcher(void)
+{
+	const char     *spam[] = { "viagra", "generic", "per 50 mg",
+	    "southampton" };
+	const char     *l2 = "G et generi:c Via-gra f(o)r as 1ow as $2.50 per 50 mg  southampton";
+	unsigned char   pats[16][40], text[3000];
+	const void     *pp[16];
+	size_t          lens[16], i, j, m;
+	struct distance_matcher *dm;
+	struct mhits    h;
+	unsigned long   sum;
+	int             k, r, bad;
+
+	printf("levenshtein_bounded_d within the bound ");
+	test_int_result(3, levenshtein_bounded_d("kitten", 6, "sitting", 7, 3));
+
+	printf("levenshtein_bounded_d over the bound ");
+	test_int_result(3, levenshtein_bounded_d("kitten", 6, "sitting", 7, 2));
+
+	printf("levenshtein_bounded_d of different lengths ");
+	test_int_result(2, levenshtein_bounded_d("a", 1, "abcdef", 6, 1));
+
+	printf("distance_matcher_scan of spam signatures ");
+	for (i = 0; i < 4; i++) {
+		pp[i] = spam[i];
+		lens[i] = strlen(spam[i]);
+	}
+	dm = distance_matcher_new(pp, lens, 4, 1);
+	memset(&h, 0, sizeof(h));
+	r = distance_matcher_scan(dm, l2, strlen(l2), add_mhit, &h);
+	distance_matcher_free(dm);
+	/* "Via-gra" is 2 edits from viagra, the rest are within 1 */
+	test_int_result(1, r > 0 && h.n[0] == 0 && h.n[1] > 0 &&
+	    h.n[2] > 0 && h.n[3] > 0);
+
+	/* every pattern must give what levenshtein_search gives */
+	printf("distance_matcher_scan against levenshtein_search ");
+	srandom(34);
+	bad = 0;
+	for (k = 0; k < 4; k++) {
+		for (i = 0; i < sizeof(text); i++)
+			text[i] = 'a' + random() % 4;
+		for (i = 0; i < 16; i++) {
+			m = 1 + random() % 39;
+			for (j = 0; j < m; j++)
+				pats[i][j] = 'a' + random() % 4;
+			pp[i] = pats[i];
+			lens[i] = m;
+			/* plant a copy with an edit or two */
+			memcpy(text + random() % (sizeof(text) - m), pats[i], m);
+			text[random() % sizeof(text)] = 'z';
+		}
+		dm = distance_matcher_new(pp, lens, 16, k);
+		memset(&h, 0, sizeof(h));
+		r = distance_matcher_scan(dm, text, sizeof(text), add_mhit, &h);
+		distance_matcher_free(dm);
+		for (i = 0; i < 16; i++) {
+			sum = 0;
+			r -= levenshtein_search(pats[i], lens[i], text,
+			    sizeof(text), k, sum_hit, &sum);
+			if (sum != h.sum[i])
+				bad++;
+		}
+		if (r != 0)
+			bad++;
+	}
+	test_int_result(0, bad);
+
+	return;
+}
+
+/* 1 if the script turns s into t and has the given number of edits */
+static int
+check_script(const struct distance_script *sc, const unsigned char *s,
+    size_t n, const unsigned char *t, size_t m, size_t edits)
+{
+	size_t          r, k, i = 0, j = 0, e = 0;
+
+	for (r = 0; r < sc->nruns; r++)
+		for (k = 0; k < sc->runs[r].len; k++)
+			switch (sc->runs[r].op) {
+			case DISTANCE_EDIT_MATCH:
+				if (i >= n || j >= m || s[i++] != t[j++])
+					return (0);
+				break;
+			case DISTANCE_EDIT_SUB:
+				if (i >= n || j >= m || s[i++] == t[j++])
+					return (0);
+				e++;
+				break;
+			case DISTANCE_EDIT_INS:
+				j++;
+				e++;
+				break;
+			case DISTANCE_EDIT_DEL:
+				i++;
+				e++;
+				break;
+			}
+	return (i == n && j == m && e == edits);
+}
+
+static void
+test_align(void)
+{
+	static unsigned char s[3000], t[3000];
+	struct distance_script sc, sc2;
+	struct matrix  *mt;
+	const char     *s2 = "this party is started";
+	const char     *s3 = "this parte is started";
+	size_t          n, m, i, r;
+	int             k, d, bad;
+
+	printf("levenshtein_align of kitten and sitting ");
+	levenshtein_align("kitten", 6, "sitting", 7, &sc, 1);
+	test_int_result(1, sc.cost == 3 && check_script(&sc,
+	    (const unsigned char *) "kitten", 6,
+	    (const unsigned char *) "sitting", 7, 3));
+	distance_script_free(&sc);
+
+	/* big enough to be split several times */
+	printf("levenshtein_align against levenshtein_d ");
+	srandom(35);
+	bad = 0;
+	for (k = 0; k < 20; k++) {
+		n = random() % (k < 10 ? 100 : 3000);
+		m = random() % (k < 10 ? 100 : 3000);
+		for (i = 0; i < n; i++)
+			s[i] = 'a' + random() % 4;
+		for (i = 0; i < m; i++)
+			t[i] = i < n && random() % 8 ? s[i] :
+			    'a' + random() % 4;
+		d = levenshtein_d(s, n, t, m);
+		if (levenshtein_align(s, n, t, m, &sc, k % 3) == -1 ||
+		    sc.cost != d || !check_script(&sc, s, n, t, m, d))
+			bad++;
+		distance_script_free(&sc);
+	}
+	test_int_result(0, bad);
+
+	mt = malloc(sizeof(struct matrix));
+	for (i = 0; i < 255; i++)
+		for (r = 0; r < 255; r++) {
+			mt->conversion[i][r] = 0.1;
+			mt->insertion[i][r] = 1.0;
+		}
+
+	printf("needleman_wunsch_align of one conversion ");
+	needleman_wunsch_align(s2, strlen(s2), s3, strlen(s3), mt, &sc, 1);
+	test_int_result(1, fabs(sc.cost - 0.1) < 0.0001 && sc.nruns == 3 &&
+	    sc.runs[1].op == DISTANCE_EDIT_SUB);
+	distance_script_free(&sc);
+
+	printf("needleman_wunsch_align threaded and not ");
+	for (i = 0; i < 2000; i++)
+		s[i] = 'a' + random() % 8;
+	for (i = 0; i < 2100; i++)
+		t[i] = i < 2000 && random() % 4 ? s[i] : 'a' + random() % 8;
+	needleman_wunsch_align(s, 2000, t, 2100, mt, &sc, 1);
+	needleman_wunsch_align(s, 2000, t, 2100, mt, &sc2, 4);
+	test_int_result(1, fabs(sc.cost - sc2.cost) < 0.0001 &&
+	    sc.cost > 0);
+	distance_script_free(&sc);
+	distance_script_free(&sc2);
+	free(mt);
+
+	return;
+}
+
+static void
+test_lv(void)
+{
+	unsigned char  *s, *t;
+	size_t          n, m, i, big = 1 << 20;
+	int             k, r, d, bad;
+
+	/* long and nearly the same, the diagonal kernel's case */
+	printf("levenshtein_d against a reference on long inputs ");
+	s = malloc(big);
+	t = malloc(big);
+	srandom(36);
+	bad = 0;
+	for (k = 0; k < 12; k++) {
+		n = 1024 + random() % 1500;
+		for (i = 0; i < n; i++)
+			s[i] = 'a' + random() % (k % 2 ? 2 : 26);
+		memcpy(t, s, n);
+		m = n;
+		for (i = 0; i < (size_t) k * 3; i++) {
+			r = random() % m;
+			switch (random() % 3) {
+			case 0:
+				t[r] = 'a' + random() % 26;
+				break;
+			case 1:
+				memmove(t + r, t + r + 1, m - r - 1);
+				m--;
+				break;
+			case 2:
+				memmove(t + r + 1, t + r, m - r);
+				t[r] = 'z';
+				m++;
+				break;
+			}
+		}
+		d = ref_ld(s, n, t, m);
+		if (levenshtein_d(s, n, t, m) != d)
+			bad++;
+		if (levenshtein_bounded_d(s, n, t, m, d) != d ||
+		    (d > 0 && levenshtein_bounded_d(s, n, t, m, d - 1) != d))
+			bad++;
+	}
+	test_int_result(0, bad);
+
+	printf("levenshtein_d of 1 MB inputs 5 substitutions apart ");
+	for (i = 0; i < big; i++)
+		s[i] = 'a' + random() % 26;
+	memcpy(t, s, big);
+	for (i = 1; i <= 5; i++)
+		t[i * big / 6] ^= 0x80;
+	test_int_result(5, levenshtein_d(s, big, t, big));
+
+	free(s);
+	free(t);
+
+	return;
+}
+
+static void
+test_wavefront(void)
+{
+	unsigned char  *s, *t;
+	struct matrix  *mt;
+	size_t          n = 2100, m = 2100, i, j;
+	double          d1, d2;
+
+	/* needleman_wunsch_d reads the NUL after each input */
+	s = malloc(n + 1);
+	t = malloc(m + 1);
+	srandom(37);
+	for (i = 0; i < n; i++)
+		s[i] = 'a' + random() % 20;
+	for (i = 0; i < m; i++)
+		t[i] = 'a' + random() % 20;
+	s[n] = t[m] = '\0';
+
+	printf("levenshtein_mt_d on 3 threads ");
+	test_int_result(levenshtein_d(s, n, t, m),
+	    levenshtein_mt_d(s, n, t, m, 3));
+
+	mt = malloc(sizeof(struct matrix));
+	for (i = 0; i < 255; i++)
+		for (j = 0; j < 255; j++) {
+			mt->conversion[i][j] = (i * 7 + j * 3) % 10 / 4.0;
+			mt->insertion[i][j] = 0.5 + (i + j) % 5 / 2.0;
+		}
+	printf("needleman_wunsch_mt_d on 3 threads ");
+	d1 = needleman_wunsch_d(s, n, t, m, mt);
+	d2 = needleman_wunsch_mt_d(s, n, t, m, mt, 3);
+	test_double_result(d1, d2);
+
+	free(mt);
+	free(s);
+	free(t);
+
+	return;
+}
+
+static void
+test_narrow(void)
+{
+	char            s[301], t[301];
+	struct matrix  *mt;
+	struct matrix_q *q;
+	size_t          i, j;
+
+	printf("testing narrow cells\n");
+
+	srandom(38);
+	for (i = 0; i < 300; i++)
+		s[i] = t[i] = 'a' + random() % 20;
+	s[300] = t[300] = '\0';
+	t[10] = t[150] = t[290] = 'z';
+	printf("damerau_d in 8 bit cells ");
+	test_int_result(2, damerau_d(s, 200, t, 200));
+	printf("damerau_d in 16 bit cells ");
+	test_int_result(3, damerau_d(s, 300, t, 300));
+
+	mt = malloc(sizeof(struct matrix));
+	q = malloc(sizeof(struct matrix_q));
+	for (i = 0; i < 255; i++)
+		for (j = 0; j < 255; j++) {
+			mt->conversion[i][j] = (i * 7 + j * 3) % 10 / 10.0;
+			mt->insertion[i][j] = 0.5 + (i + j) % 5 / 4.0;
+		}
+	printf("matrix_quantize scale ");
+	test_int_result(0, matrix_quantize(mt, q));
+	test_int_result(20, q->scale);
+	printf("needleman_wunsch_q_d in 16 bit cells ");
+	test_double_result(needleman_wunsch_d(s, 300, t, 300, mt),
+	    needleman_wunsch_q_d(s, 300, t, 300, q));
+
+	/* big enough costs overflow 16 bits and take the 32 bit cells */
+	for (i = 0; i < 255; i++)
+		for (j = 0; j < 255; j++)
+			mt->insertion[i][j] = 500 + (i + j) % 3;
+	printf("needleman_wunsch_q_d in 32 bit cells ");
+	test_int_result(0, matrix_quantize(mt, q));
+	test_double_result(needleman_wunsch_d(s, 300, t + 1, 299, mt),
+	    needleman_wunsch_q_d(s, 300, t + 1, 299, q));
+
+	/* one cost beyond 16 bits, on the edge of the matrix */
+	for (i = 0; i < 255; i++)
+		for (j = 0; j < 255; j++) {
+			mt->conversion[i][j] = 1;
+			mt->insertion[i][j] = 1;
+		}
+	mt->insertion['b']['a'] = 100000;
+	printf("needleman_wunsch_q_d with a cost over 16 bits ");
+	test_int_result(0, matrix_quantize(mt, q));
+	test_double_result(needleman_wunsch_d("ab", 2, "ab", 2, mt),
+	    needleman_wunsch_q_d("ab", 2, "ab", 2, q));
+	test_double_result(needleman_wunsch_d("abc", 3, "abd", 3, mt),
+	    needleman_wunsch_q_d("abc", 3, "abd", 3, q));
+
+	mt->conversion[1][2] = 1 / 3.0;
+	printf("matrix_quantize of a third ");
+	test_int_result(-1, matrix_quantize(mt, q));
+
+	free(q);
+	free(mt);
+
+	return;
+}
+
+static void
+test_filter(void)
+{
+	struct distance_filter_stats fs;
+	unsigned char  *buf;
+	const void     *b[200];
+	size_t          blen[200], i, j, bad;
+	double          d[200], full[200];
+	int             n, want;
+
+	printf("testing distance_filter()\n");
+
+	/* words of 20 to 40 bytes, every tenth a near copy of the query */
+	buf = malloc(200 * 41);
+	srandom(39);
+	for (i = 0; i < 200; i++) {
+		b[i] = buf + i * 41;
+		blen[i] = 20 + random() % 21;
+		for (j = 0; j < blen[i]; j++)
+			buf[i * 41 + j] = 'a' + random() % 26;
+	}
+	for (i = 0; i < 200; i += 10) {
+		blen[i] = 30;
+		for (j = 0; j < 30; j++)
+			buf[i * 41 + j] = 'a' + j % 26;
+		buf[i * 41 + i % 30] = '#';
+		if (i % 20 == 0)
+			buf[i * 41 + 29 - i % 7] = '#';
+	}
+	memcpy(buf + 199 * 41, buf + 10 * 41, 30);
+	blen[199] = 30;
+
+	memset(&fs, 0, sizeof(fs));
+	n = distance_filter(DISTANCE_LEVENSHTEIN, DISTANCE_FILTER_ALL,
+	    buf + 10 * 41, 30, b, blen, 200, 3, d, &fs, 2);
+	distance_many(levenshtein_fn, NULL, buf + 10 * 41, 30, b, blen, 200,
+	    full, 0);
+	for (i = 0, want = 0, bad = 0; i < 200; i++) {
+		if (full[i] <= 3)
+			want++;
+		if ((full[i] <= 3 ? full[i] : -1) != d[i])
+			bad++;
+	}
+	printf("distance_filter finds %d of %d within 3 ", n, want);
+	test_int_result(want, n);
+	printf("distance_filter distances differ in %lu ", (unsigned long) bad);
+	test_int_result(0, bad);
+	printf("distance_filter rejects %llu of %llu unverified ",
+	    fs.rejected[DISTANCE_FILTER_LENGTH] +
+	    fs.rejected[DISTANCE_FILTER_HISTOGRAM] +
+	    fs.rejected[DISTANCE_FILTER_QGRAM], fs.tested);
+	test_int_result(1, fs.tested == 200 &&
+	    fs.rejected[DISTANCE_FILTER_LENGTH] > 0 &&
+	    fs.rejected[DISTANCE_FILTER_VERIFY] < 20);
+
+	n = distance_filter(DISTANCE_DAMERAU, DISTANCE_FILTER_ALL,
+	    "hello", 5, b, blen, 200, 2, d, NULL, 0);
+	printf("distance_filter with damerau_d finds %d ", n);
+	test_int_result(0, n);
+
+	free(buf);
+
+	return;
+}
+
+static void
+test_corpus(void)
+{
+	struct distance_corpus *c;
+	struct distance_filter_stats fs;
+	char            path[] = "/tmp/distance_test.XXXXXX";
+	const char     *w[] = { "kitten", "sitting", "", "mitten", "smitten",
+	    "kitchen", "written" };
+	size_t          wlen[7], i, len, bad;
+	double          d1[7], d2[7];
+	const void     *p;
+	unsigned long long off;
+	int             fd, n1, n2;
+
+	printf("testing distance_corpus_open()\n");
+
+	for (i = 0; i < 7; i++)
+		wlen[i] = strlen(w[i]);
+	fd = mkstemp(path);
+	close(fd);
+	distance_corpus_write(path, (const void **) w, wlen, 7,
+	    DISTANCE_CORPUS_HIST);
+	c = distance_corpus_open(path);
+	printf("distance_corpus_open of 7 entries ");
+	test_int_result(7, c != NULL ? (int) distance_corpus_count(c) : -1);
+	if (c == NULL) {
+		unlink(path);
+		return;
+	}
+	p = distance_corpus_get(c, 4, &len);
+	printf("distance_corpus_get of smitten ");
+	test_int_result(1, len == 7 && memcmp(p, "smitten", 7) == 0);
+
+	distance_corpus_many(c, levenshtein_fn, NULL, "kitten", 6, d1, 2);
+	distance_many(levenshtein_fn, NULL, "kitten", 6, (const void **) w,
+	    wlen, 7, d2, 1);
+	for (i = 0, bad = 0; i < 7; i++)
+		if (d1[i] != d2[i])
+			bad++;
+	printf("distance_corpus_many differs in %lu ", (unsigned long) bad);
+	test_int_result(0, bad);
+
+	memset(&fs, 0, sizeof(fs));
+	n1 = distance_corpus_filter(c, DISTANCE_LEVENSHTEIN,
+	    DISTANCE_FILTER_ALL, "kitten", 6, 2, d1, &fs, 2);
+	n2 = distance_filter(DISTANCE_LEVENSHTEIN, 0, "kitten", 6,
+	    (const void **) w, wlen, 7, 2, d2, NULL, 1);
+	for (i = 0, bad = 0; i < 7; i++)
+		if (d1[i] != d2[i])
+			bad++;
+	printf("distance_corpus_filter finds %d of %d ", n1, n2);
+	test_int_result(1, n1 == 5 && n2 == 5 && bad == 0 &&
+	    fs.rejected[DISTANCE_FILTER_HISTOGRAM] > 0);
+	distance_corpus_close(c);
+
+	/* an offset table that wraps around, or is out of line */
+	fd = open(path, O_WRONLY);
+	off = -16ULL;
+	pwrite(fd, &off, sizeof(off), 24);
+	printf("distance_corpus_open with a wrapping offset table ");
+	test_int_result(1, distance_corpus_open(path) == NULL);
+	off = 68;
+	pwrite(fd, &off, sizeof(off), 24);
+	off = 132;
+	pwrite(fd, &off, sizeof(off), 32);
+	printf("distance_corpus_open with an unaligned offset table ");
+	test_int_result(1, distance_corpus_open(path) == NULL);
+	close(fd);
+
+	/* anything else is refused */
+	fd = open(path, O_WRONLY | O_TRUNC);
+	write(fd, "kitten\nsitting\n", 15);
+	close(fd);
+	printf("distance_corpus_open of a text file ");
+	test_int_result(1, distance_corpus_open(path) == NULL);
+	unlink(path);
+
+	return;
+}
+
+/* euclidean distance between points given as bytes, a float metric */
+static double
+euclid_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	const unsigned char *s = d1, *t = d2;
+	double          sum = 0;
+	size_t          i;
+
+	for (i = 0; i < len1 && i < len2; i++)
+		sum += ((double) s[i] - t[i]) * ((double) s[i] - t[i]);
+	return (sqrt(sum));
+}
+
+static int
+cmp_double(const void *x, const void *y)
+{
+	double          a = *(const double *) x, b = *(const double *) y;
+
+	return ((a > b) - (a < b));
+}
+
+static void
+test_vptree(void)
+{
+	struct distance_vptree *t;
+	struct distance_vptree_stats st;
+	struct distance_match m[2000];
+	unsigned char  *buf;
+	const void     *b[2000];
+	size_t          blen[2000], i, j, q, bad;
+	double          d[2000];
+	int             n, want;
+
+	printf("testing distance_vptree_new()\n");
+
+	buf = malloc(2000 * 12);
+	srandom(41);
+	for (i = 0; i < 2000; i++) {
+		b[i] = buf + i * 12;
+		blen[i] = 5 + random() % 8;
+		for (j = 0; j < blen[i]; j++)
+			buf[i * 12 + j] = 'a' + random() % 6;
+	}
+
+	t = distance_vptree_new(levenshtein_fn, NULL, b, blen, 2000, 3);
+	memset(&st, 0, sizeof(st));
+	for (q = 0, bad = 0; q < 20; q++) {
+		distance_many(levenshtein_fn, NULL, b[q * 97], blen[q * 97], b,
+		    blen, 2000, d, 0);
+		for (i = 0, want = 0; i < 2000; i++)
+			if (d[i] <= 2)
+				want++;
+		n = distance_vptree_radius(t, b[q * 97], blen[q * 97], 2, m,
+		    2000, &st);
+		if (n != want)
+			bad++;
+		for (i = 0; i < (size_t) n; i++)
+			if (d[m[i].index] != m[i].distance ||
+			    (i > 0 && m[i].distance < m[i - 1].distance))
+				bad++;
+	}
+	printf("distance_vptree_radius of 20 queries, %lu wrong ",
+	    (unsigned long) bad);
+	test_int_result(0, bad);
+	printf("distance_vptree_radius pruned %llu of %llu ", st.pruned,
+	    st.pruned + st.evaluated);
+	test_int_result(1, st.pruned > 0 && st.pruned + st.evaluated == 40000);
+	distance_vptree_free(t);
+
+	/* points in four dimensions */
+	for (i = 0; i < 2000; i++) {
+		blen[i] = 4;
+		for (j = 0; j < 4; j++)
+			buf[i * 12 + j] = random() % 256;
+	}
+	t = distance_vptree_new(euclid_fn, NULL, b, blen, 2000, 0);
+	memset(&st, 0, sizeof(st));
+	for (q = 0, bad = 0; q < 20; q++) {
+		distance_many(euclid_fn, NULL, b[q * 53], 4, b, blen, 2000, d,
+		    0);
+		qsort(d, 2000, sizeof(double), cmp_double);
+		n = distance_vptree_knn(t, b[q * 53], 4, 10, m, &st);
+		if (n != 10)
+			bad++;
+		for (i = 0; i < (size_t) n; i++)
+			if (m[i].distance != d[i])
+				bad++;
+	}
+	printf("distance_vptree_knn of 20 queries, %lu wrong ",
+	    (unsigned long) bad);
+	test_int_result(0, bad);
+	printf("distance_vptree_knn pruned %llu of %llu ", st.pruned,
+	    st.pruned + st.evaluated);
+	test_int_result(1, st.pruned > st.evaluated);
+	distance_vptree_free(t);
+
+	/* hamming_d is -1, infinitely far, between lengths that differ */
+	for (i = 0; i < 2000; i++) {
+		blen[i] = 4 + random() % 3;
+		for (j = 0; j < blen[i]; j++)
+			buf[i * 12 + j] = 'a' + random() % 4;
+	}
+	t = distance_vptree_new(hamming_fn, NULL, b, blen, 2000, 0);
+	for (q = 0, bad = 0; q < 200; q++) {
+		distance_many(hamming_fn, NULL, b[q * 7], blen[q * 7], b, blen,
+		    2000, d, 0);
+		qsort(d, 2000, sizeof(double), cmp_double);
+		for (i = 0; i < 2000 && d[i] < 0; i++)
+			;
+		n = distance_vptree_knn(t, b[q * 7], blen[q * 7], 10, m,
+		    NULL);
+		if (n != (int) min(10, 2000 - i))
+			bad++;
+		for (j = 0; j < (size_t) n; j++)
+			if (m[j].distance != d[i + j])
+				bad++;
+	}
+	printf("distance_vptree_knn over mixed lengths, %lu wrong ",
+	    (unsigned long) bad);
+	test_int_result(0, bad);
+	distance_vptree_free(t);
+
+	free(buf);
+
+	return;
+}
+
+/* DBSCAN the slow way, over all pairs */
+static int
+cluster_ref(const void * const *b, const size_t *blen, size_t n, int eps,
+    size_t minpts, int *labels)
+{
+	size_t          i, j, k, r, cnt, *parent, *owner;
+	int            *id, nc = 0;
+	char           *core;
+
+	parent = malloc(n * sizeof(size_t));
+	owner = malloc(n * sizeof(size_t));
+	id = malloc(n * sizeof(int));
+	core = malloc(n);
+	for (i = 0; i < n; i++) {
+		parent[i] = i;
+		owner[i] = n;
+		id[i] = -1;
+		for (j = 0, cnt = 0; j < n; j++)
+			if (levenshtein_d(b[i], blen[i], b[j], blen[j]) <= eps)
+				cnt++;
+		core[i] = cnt >= minpts;
+	}
+	for (i = 0; i < n; i++)
+		for (j = 0; j < n && core[i]; j++) {
+			if (levenshtein_d(b[i], blen[i], b[j], blen[j]) > eps)
+				continue;
+			if (!core[j]) {
+				if (owner[j] > i)
+					owner[j] = i;
+				continue;
+			}
+			for (r = j; parent[r] != r; r = parent[r])
+				;
+			for (k = i; parent[k] != k; k = parent[k])
+				;
+			parent[max(r, k)] = min(r, k);
+		}
+	for (i = 0; i < n; i++) {
+		if (!core[i] && owner[i] == n) {
+			labels[i] = -1;
+			continue;
+		}
+		for (r = core[i] ? i : owner[i]; parent[r] != r; r = parent[r])
+			;
+		if (id[r] == -1)
+			id[r] = nc++;
+		labels[i] = id[r];
+	}
+	free(parent);
+	free(owner);
+	free(id);
+	free(core);
+	return (nc);
+}
+
+static void
+test_cluster(void)
+{
+	unsigned char  *buf;
+	const void     *b[600];
+	size_t          blen[600], i, j, bad;
+	int             l1[600], l2[600], want[600], n1, n2, nw, noise;
+
+	printf("testing distance_cluster()\n");
+
+	buf = malloc(600 * 8);
+	srandom(45);
+	for (i = 0; i < 600; i++) {
+		b[i] = buf + i * 8;
+		blen[i] = 3 + random() % 5;
+		for (j = 0; j < blen[i]; j++)
+			buf[i * 8 + j] = 'a' + random() % 4;
+	}
+
+	nw = cluster_ref(b, blen, 600, 1, 1, want);
+	n1 = distance_cluster(levenshtein_fn, NULL, b, blen, 600, 1, 1, l1, 1);
+	n2 = distance_cluster(levenshtein_fn, NULL, b, blen, 600, 1, 1, l2, 4);
+	for (i = 0, bad = 0; i < 600; i++)
+		if (l1[i] != want[i] || l2[i] != want[i])
+			bad++;
+	printf("distance_cluster single linkage, %d clusters, %lu wrong ",
+	    n1, (unsigned long) bad);
+	test_int_result(1, bad == 0 && n1 == nw && n2 == nw && nw > 1);
+
+	nw = cluster_ref(b, blen, 600, 1, 4, want);
+	n1 = distance_cluster(levenshtein_fn, NULL, b, blen, 600, 1, 4, l1, 1);
+	n2 = distance_cluster(levenshtein_fn, NULL, b, blen, 600, 1, 4, l2, 4);
+	for (i = 0, bad = 0, noise = 0; i < 600; i++) {
+		if (l1[i] != want[i] || l2[i] != want[i])
+			bad++;
+		if (want[i] == -1)
+			noise++;
+	}
+	printf("distance_cluster dbscan, %d clusters, %d noise, %lu wrong ",
+	    n1, noise, (unsigned long) bad);
+	test_int_result(1, bad == 0 && n1 == nw && n2 == nw && noise > 0);
+
+	free(buf);
+
+	return;
+}
+
+static void
+test_knng(void)
+{
+	struct distance_knng_stats st;
+	struct distance_match *g;
+	unsigned char  *buf;
+	const void     *b[2000];
+	size_t          blen[2000], i, j, bad;
+	double          recall;
+	int             ret;
+
+	printf("testing distance_knng()\n");
+
+	/* points in four dimensions */
+	buf = malloc(2000 * 4);
+	g = malloc(2000 * 10 * sizeof(*g));
+	srandom(46);
+	for (i = 0; i < 2000; i++) {
+		b[i] = buf + i * 4;
+		blen[i] = 4;
+		for (j = 0; j < 4; j++)
+			buf[i * 4 + j] = random() % 256;
+	}
+	memset(&st, 0, sizeof(st));
+	ret = distance_knng(euclid_fn, NULL, b, blen, 2000, 10, 1, 0.001, g,
+	    &st, 0);
+	for (i = 0, bad = 0; i < 2000; i++)
+		for (j = 0; j < 10; j++)
+			if (g[i * 10 + j].index == i ||
+			    g[i * 10 + j].distance != euclid_fn(b[i], 4,
+			    b[g[i * 10 + j].index], 4, NULL) ||
+			    (j > 0 && g[i * 10 + j].distance <
+			    g[i * 10 + j - 1].distance))
+				bad++;
+	printf("distance_knng of 2000 points, %lu wrong ",
+	    (unsigned long) bad);
+	test_int_result(0, ret == 0 ? bad : 1);
+	printf("distance_knng took %llu distances in %llu rounds ",
+	    st.evaluated, st.rounds);
+	test_int_result(1, st.evaluated < 2000 * 1999 / 2 && st.rounds > 1);
+	recall = distance_knng_recall(euclid_fn, NULL, b, blen, 2000, 10, g,
+	    100, 0);
+	printf("distance_knng_recall %.3f ", recall);
+	test_int_result(1, recall >= 0.9 && recall <= 1);
+	printf("distance_knng with k of n ");
+	test_int_result(-1, distance_knng(euclid_fn, NULL, b, blen, 10, 10,
+	    1, 0.001, g, NULL, 0));
+
+	free(buf);
+	free(g);
+
+	return;
+}
+
+static int	pool_tasks;
+
+/* an executor that runs each task at once, on the calling thread */
+static void
+inline_submit(void (*fn)(void *), void *task, void *ctx)
+{
+	__sync_fetch_and_add((int *) ctx, 1);
+	fn(task);
+}
+
+static struct {
+	void	(*fn)(void *);
+	void	*task;
+} pool_later[16];
+static int	pool_nlater;
+
+/* an executor that keeps its tasks, to run once the call is over */
+static void
+later_submit(void (*fn)(void *), void *task, void *ctx)
+{
+	if (pool_nlater < 16) {
+		pool_later[pool_nlater].fn = fn;
+		pool_later[pool_nlater++].task = task;
+	}
+}
+
+static volatile int pool_stop;
+static int	pool_calls;
+
+/* levenshtein_fn, counted */
+static double
+count_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	__sync_fetch_and_add(&pool_calls, 1);
+	return (levenshtein_d(d1, len1, d2, len2));
+}
+
+/* levenshtein_fn that cancels its caller after 100 calls */
+static double
+cancel_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	if (__sync_add_and_fetch(&pool_calls, 1) == 100)
+		__atomic_store_n(&pool_stop, 1, __ATOMIC_RELAXED);
+	return (levenshtein_d(d1, len1, d2, len2));
+}
+
+static void
+test_pool(void)
+{
+	struct distance_executor ex;
+	unsigned char  *buf;
+	const void     *b[400];
+	size_t          blen[400], i, j, bad;
+	double         *d1, *d2;
+	int            *flag, ret;
+
+	printf("testing distance_pool_set()\n");
+
+	/* a few long inputs among many short ones */
+	buf = malloc(400 * 300);
+	d1 = malloc(400 * 400 * sizeof(double));
+	d2 = malloc(400 * 400 * sizeof(double));
+	srandom(47);
+	for (i = 0; i < 400; i++) {
+		b[i] = buf + i * 300;
+		blen[i] = i % 50 == 0 ? 200 + random() % 100 : random() % 20;
+		for (j = 0; j < blen[i]; j++)
+			buf[i * 300 + j] = 'a' + random() % 4;
+	}
+	distance_cdist(levenshtein_fn, NULL, b, blen, 400, b, blen, 400, d1,
+	    1);
+	distance_pool_set(4, DISTANCE_POOL_AFFINITY);
+	distance_cdist(levenshtein_fn, NULL, b, blen, 400, b, blen, 400, d2,
+	    0);
+	for (i = 0, bad = 0; i < 400 * 400; i++)
+		if (d1[i] != d2[i])
+			bad++;
+	printf("distance_cdist on a pool of 4, %lu wrong ",
+	    (unsigned long) bad);
+	test_int_result(0, bad);
+
+	memset(&ex, 0, sizeof(ex));
+	ex.submit = inline_submit;
+	ex.ctx = &pool_tasks;
+	ex.nthreads = 3;
+	distance_pool_executor(&ex);
+	memset(d2, 0, 400 * 400 * sizeof(double));
+	distance_pdist(levenshtein_fn, NULL, b, blen, 400, d2, 0);
+	distance_pool_executor(NULL);
+	distance_pdist(levenshtein_fn, NULL, b, blen, 400, d1, 1);
+	for (i = 0, bad = 0; i < 400 * 399 / 2; i++)
+		if (d1[i] != d2[i])
+			bad++;
+	printf("distance_pdist on an executor, %d tasks, %lu wrong ",
+	    pool_tasks, (unsigned long) bad);
+	test_int_result(1, bad == 0 && pool_tasks == 2);
+
+	/*
+	   helpers that start after the call has returned, with the cancel
+	   flag it was made under gone by then
+	 */
+	ex.submit = later_submit;
+	ex.ctx = NULL;
+	distance_pool_executor(&ex);
+	flag = calloc(1, sizeof(*flag));
+	distance_cancel(flag);
+	ret = distance_many(count_fn, NULL, b[0], blen[0], b, blen, 400, d2,
+	    0);
+	distance_cancel(NULL);
+	free(flag);
+	distance_pool_executor(NULL);
+	j = pool_calls;
+	for (i = 0; i < (size_t) pool_nlater; i++)
+		pool_later[i].fn(pool_later[i].task);
+	for (i = 0, bad = 0; i < 400; i++)
+		if (d2[i] != levenshtein_d(b[0], blen[0], b[i], blen[i]))
+			bad++;
+	printf("distance_many on a deferring executor, %d late tasks, "
+	    "%lu wrong ", pool_nlater, (unsigned long) bad);
+	test_int_result(1, ret == 0 && bad == 0 && pool_nlater == 2 &&
+	    j == 400 && pool_calls == 400);
+	pool_calls = 0;
+
+	distance_cancel(&pool_stop);
+	ret = distance_cdist(cancel_fn, NULL, b, blen, 400, b, blen, 400, d2,
+	    4);
+	printf("distance_cdist cancelled after %d of %d ", pool_calls,
+	    400 * 400);
+	test_int_result(1, ret == -1 && pool_calls < 400 * 400);
+	printf("distance_many while cancelled ");
+	test_int_result(-1, distance_many(levenshtein_fn, NULL, b[0], blen[0],
+	    b, blen, 400, d2, 0));
+	distance_cancel(NULL);
+	printf("distance_many after the cancel is cleared ");
+	test_int_result(0, distance_many(levenshtein_fn, NULL, b[0], blen[0],
+	    b, blen, 400, d2, 0));
+	distance_pool_set(0, 0);
+
+	free(buf);
+	free(d1);
+	free(d2);
+
+	return;
+}
+
+/* set from the batches' threads, so read and written atomically */
+static int	async_status[4];
+
+static void
+async_cb(struct distance_async *da, int status, void *arg)
+{
+	__atomic_store_n(&async_status[*(int *) arg], status,
+	    __ATOMIC_RELEASE);
+}
+
+/* a callback that lets go of its own handle */
+static void
+async_free_cb(struct distance_async *da, int status, void *arg)
+{
+	__atomic_store_n(&async_status[*(int *) arg], status,
+	    __ATOMIC_RELEASE);
+	distance_async_free(da);
+}
+
+static int
+async_get(int i)
+{
+	return (__atomic_load_n(&async_status[i], __ATOMIC_ACQUIRE));
+}
+
+/* levenshtein_fn, slowly */
+static double
+slow_fn(const void *d1, size_t len1, const void *d2, size_t len2,
+    void *arg)
+{
+	usleep(100);
+	return (levenshtein_d(d1, len1, d2, len2));
+}
+
+static void
+test_async(void)
+{
+	struct distance_async *da;
+	struct pollfd   pfd;
+	unsigned char  *buf;
+	const void     *b[200];
+	size_t          blen[200], i, j, bad;
+	double         *d1, *d2;
+	struct distance_executor ex;
+	int             ret, idx[4] = {0, 1, 2, 3};
+
+	printf("testing distance_async_cdist()\n");
+
+	buf = malloc(200 * 30);
+	d1 = malloc(200 * 200 * sizeof(double));
+	d2 = malloc(200 * 200 * sizeof(double));
+	srandom(48);
+	for (i = 0; i < 200; i++) {
+		b[i] = buf + i * 30;
+		blen[i] = random() % 30;
+		for (j = 0; j < blen[i]; j++)
+			buf[i * 30 + j] = 'a' + random() % 4;
+	}
+	distance_cdist(levenshtein_fn, NULL, b, blen, 200, b, blen, 200, d1,
+	    1);
+
+	__atomic_store_n(&async_status[0], 1, __ATOMIC_RELEASE);
+	da = distance_async_cdist(levenshtein_fn, NULL, b, blen, 200, b, blen,
+	    200, d2, 0, async_cb, &idx[0]);
+	pfd.fd = distance_async_fd(da);
+	pfd.events = POLLIN;
+	ret = poll(&pfd, 1, 10000);
+	printf("distance_async_fd readable when done ");
+	test_int_result(1, ret == 1 && distance_async_done(da));
+	printf("distance_async_wait ");
+	test_int_result(0, distance_async_wait(da));
+	distance_async_free(da);
+	for (i = 0, bad = 0; i < 200 * 200; i++)
+		if (d1[i] != d2[i])
+			bad++;
+	printf("distance_async_cdist, status %d, %lu wrong ", async_get(0),
+	    (unsigned long) bad);
+	test_int_result(1, async_get(0) == 0 && bad == 0);
+
+	da = distance_async_many(levenshtein_fn, NULL, b[7], blen[7], b, blen,
+	    200, d2, 2, NULL, NULL);
+	distance_async_wait(da);
+	distance_async_free(da);
+	for (i = 0, bad = 0; i < 200; i++)
+		if (d1[7 * 200 + i] != d2[i])
+			bad++;
+	printf("distance_async_many, %lu wrong ", (unsigned long) bad);
+	test_int_result(0, bad);
+
+	__atomic_store_n(&async_status[1], 1, __ATOMIC_RELEASE);
+	da = distance_async_pdist(levenshtein_fn, NULL, b, blen, 200, d2, 0,
+	    async_free_cb, &idx[1]);
+	/* the handle is gone after the callback, so wait on the status */
+	for (i = 0; i < 10000 && async_get(1) == 1; i++)
+		usleep(1000);
+	distance_pdist(levenshtein_fn, NULL, b, blen, 200, d1, 1);
+	for (i = 0, bad = 0; i < 200 * 199 / 2; i++)
+		if (d1[i] != d2[i])
+			bad++;
+	printf("distance_async_pdist, freed in its callback, %lu wrong ",
+	    (unsigned long) bad);
+	test_int_result(1, async_get(1) == 0 && bad == 0);
+
+	/* 200 * 200 * 100us would be four seconds */
+	__atomic_store_n(&async_status[2], 1, __ATOMIC_RELEASE);
+	da = distance_async_cdist(slow_fn, NULL, b, blen, 200, b, blen, 200,
+	    d2, 0, async_cb, &idx[2]);
+	distance_async_cancel(da);
+	printf("distance_async_cancel ");
+	test_int_result(-1, distance_async_wait(da));
+	distance_async_free(da);
+	printf("callback status after a cancel ");
+	test_int_result(-1, async_get(2));
+
+	/* a batch goes to the executor, not to a thread of its own */
+	memset(&ex, 0, sizeof(ex));
+	ex.submit = later_submit;
+	ex.nthreads = 2;
+	distance_pool_executor(&ex);
+	pool_nlater = 0;
+	__atomic_store_n(&async_status[3], 1, __ATOMIC_RELEASE);
+	da = distance_async_many(levenshtein_fn, NULL, b[3], blen[3], b, blen,
+	    200, d2, 0, async_cb, &idx[3]);
+	distance_pool_executor(NULL);
+	ret = pool_nlater == 1 && !distance_async_done(da);
+	for (i = 0; i < (size_t) pool_nlater; i++)
+		pool_later[i].fn(pool_later[i].task);
+	ret = ret && distance_async_done(da) && async_get(3) == 0;
+	distance_async_free(da);
+	distance_cdist(levenshtein_fn, NULL, b, blen, 200, b, blen, 200, d1,
+	    1);
+	for (i = 0, bad = 0; i < 200; i++)
+		if (d1[3 * 200 + i] != d2[i])
+			bad++;
+	printf("distance_async_many on an executor, %d tasks, %lu wrong ",
+	    pool_nlater, (unsigned long) bad);
+	test_int_result(1, ret && bad == 0);
+
+	/* freed before the executor got to it */
+	pool_nlater = 0;
+	distance_pool_executor(&ex);
+	da = distance_async_cdist(slow_fn, NULL, b, blen, 200, b, blen, 200,
+	    d2, 0, async_cb, &idx[3]);
+	distance_pool_executor(NULL);
+	__atomic_store_n(&async_status[3], 1, __ATOMIC_RELEASE);
+	distance_async_free(da);
+	for (i = 0; i < (size_t) pool_nlater; i++)
+		pool_later[i].fn(pool_later[i].task);
+	printf("distance_async_free before the batch started ");
+	test_int_result(1, pool_nlater == 1 && async_get(3) == 1);
+
+	free(buf);
+	free(d1);
+	free(d2);
+
+	return;
+}
+
+static void
+test_stream(void)
+{
+	struct distance_stream *ds;
+	unsigned char   s[150], text[1200];
+	size_t          n, i, k, op, bad, pbad;
+	int             best, d;
+
+	printf("testing distance_stream_append()\n");
+
+	ds = distance_stream_new("kitten", 6);
+	distance_stream_append(ds, "sit", 3);
+	printf("distance_stream_prefix_distance of sit ");
+	test_int_result(1, distance_stream_prefix_distance(ds));
+	distance_stream_append(ds, "ting", 4);
+	printf("distance_stream_distance of sitting ");
+	test_int_result(3, distance_stream_distance(ds));
+	distance_stream_pop(ds, 4);
+	distance_stream_append(ds, "ten", 3);
+	printf("distance_stream_distance of sitten ");
+	test_int_result(1, distance_stream_distance(ds));
+	distance_stream_free(ds);
+
+	/* three blocks of pattern, random typing and backspacing */
+	srandom(42);
+	for (i = 0; i < 150; i++)
+		s[i] = 'a' + random() % 4;
+	ds = distance_stream_new(s, 150);
+	for (op = 0, n = 0, bad = 0, pbad = 0; op < 300; op++) {
+		if (n > 0 && random() % 4 == 0) {
+			i = 1 + random() % min(n, 3);
+			distance_stream_pop(ds, i);
+			n -= i;
+		} else if (n < 200) {
+			text[n] = 'a' + random() % 4;
+			distance_stream_append(ds, text + n, 1);
+			n++;
+		}
+		if (distance_stream_len(ds) != n ||
+		    distance_stream_distance(ds) != ref_ld(s, 150, text, n))
+			bad++;
+		if (op % 25 != 0)
+			continue;
+		for (i = 0, best = n; i <= 150; i++)
+			if ((d = ref_ld(s, i, text, n)) < best)
+				best = d;
+		if (distance_stream_prefix_distance(ds) != best)
+			pbad++;
+	}
+	distance_stream_free(ds);
+	printf("distance_stream_distance wrong %lu times ", (unsigned long) bad);
+	test_int_result(0, bad);
+	printf("distance_stream_prefix_distance wrong %lu times ",
+	    (unsigned long) pbad);
+	test_int_result(0, pbad);
+
+	/* a long stream that only keeps the last 5 bytes to pop */
+	ds = distance_stream_new(s, 70);
+	for (n = 0; n < 100; n++)
+		text[n] = 'a' + random() % 4;
+	distance_stream_append(ds, text, 100);
+	distance_stream_set_depth(ds, 5);
+	for (op = 0, bad = 0, k = 5; op < 1500; op++) {
+		if (random() % 4 == 0) {
+			i = 1 + random() % 3;
+			i = min(i, k);
+			distance_stream_pop(ds, i);
+			n -= i;
+			k -= i;
+		} else if (n + 10 < sizeof(text)) {
+			text[n] = 'a' + random() % 4;
+			distance_stream_append(ds, text + n, 1);
+			n++;
+			k = min(k + 1, 5);
+		}
+		if (distance_stream_len(ds) != n ||
+		    (op % 10 == 0 &&
+		    distance_stream_distance(ds) != ref_ld(s, 70, text, n)))
+			bad++;
+	}
+	printf("distance_stream with a depth of 5 wrong %lu times ",
+	    (unsigned long) bad);
+	test_int_result(0, bad);
+	distance_stream_append(ds, text, 10);
+	memcpy(text + n, text, 10);
+	n += 10;
+	distance_stream_pop(ds, 100);
+	printf("distance_stream_pop past the depth ");
+	test_int_result(1, distance_stream_len(ds) == n - 5 &&
+	    distance_stream_distance(ds) == ref_ld(s, 70, text, n - 5));
+	distance_stream_free(ds);
+
+	return;
+}
+
+static void
+test_cache(void)
+{
+	struct distance_cache *dc;
+	struct distance_cache_stats st;
+	char            w[300][8];
+	const void     *b[300];
+	size_t          blen[300], i, bad;
+	double          d1[300], d2[300];
+
+	printf("testing distance_cache_fn()\n");
+
+	srandom(43);
+	for (i = 0; i < 300; i++) {
+		snprintf(w[i], sizeof(w[i]), "%07ld", random() % 10000000);
+		b[i] = w[i];
+		blen[i] = 7;
+	}
+	dc = distance_cache_new(levenshtein_fn, NULL, 4096);
+	distance_many(levenshtein_fn, NULL, "1234567", 7, b, blen, 300, d1, 1);
+	distance_many(distance_cache_fn, dc, "1234567", 7, b, blen, 300, d2,
+	    3);
+	distance_many(distance_cache_fn, dc, "1234567", 7, b, blen, 300, d2,
+	    3);
+	for (i = 0, bad = 0; i < 300; i++)
+		if (d1[i] != d2[i])
+			bad++;
+	distance_cache_stats(dc, &st);
+	printf("distance_cache_fn differs in %lu, %llu hits %llu misses ",
+	    (unsigned long) bad, st.hits, st.misses);
+	test_int_result(1, bad == 0 && st.hits >= 300 && st.misses <= 300);
+	distance_cache_free(dc);
+
+	/* room for 8 pairs only, the rest is evicted */
+	/* the lengths are part of the key, "ab" "b" is not "a" "bb" */
+	dc = distance_cache_new(levenshtein_fn, NULL, 16);
+	distance_cache_fn("ab", 2, "b", 1, dc);
+	printf("distance_cache_fn keeps pairs apart at the seam ");
+	test_int_result(2, (int) distance_cache_fn("a", 1, "bb", 2, dc));
+	distance_cache_free(dc);
+
+	dc = distance_cache_new(levenshtein_fn, NULL, 8);
+	distance_many(distance_cache_fn, dc, "1234567", 7, b, blen, 300, d2,
+	    1);
+	distance_cache_stats(dc, &st);
+	printf("distance_cache_fn of 300 pairs in 8 evicts %llu ",
+	    st.evictions);
+	test_int_result(292, st.evictions);
+	distance_cache_free(dc);
+
+	return;
+}
+
+static void
+test_stats(void)
+{
+	struct distance_stats st;
+	unsigned char  *a, *b;
+	size_t          i;
+	int             d;
+
+	printf("testing distance_stats_get()\n");
+
+	distance_stats_reset();
+	if (distance_stats_get(&st) == -1) {
+		printf("statistics not compiled in, skipping\n");
+		return;
+	}
+	levenshtein_d("kitten", 6, "sitting", 7);
+	levenshtein_d("", 0, "sitting", 7);
+	hamming_d("kitten", 6, "sitting", 7);
+	distance_stats_get(&st);
+
+	printf("levenshtein_d calls %llu ", st.calls[DISTANCE_LEVENSHTEIN]);
+	test_int_result(2, st.calls[DISTANCE_LEVENSHTEIN]);
+	printf("levenshtein_d cells %llu ", st.cells[DISTANCE_LEVENSHTEIN]);
+	test_int_result(42, st.cells[DISTANCE_LEVENSHTEIN]);
+	printf("levenshtein_d length 4-7 calls %llu ",
+	    st.calls_by_len[DISTANCE_LEVENSHTEIN][3]);
+	test_int_result(2, st.calls_by_len[DISTANCE_LEVENSHTEIN][3]);
+	printf("trivial kernel calls %llu ", st.kernels[DISTANCE_KERNEL_TRIVIAL]);
+	test_int_result(2, st.kernels[DISTANCE_KERNEL_TRIVIAL]);
+
+	/* long inputs too far apart for the diagonals are still one call */
+	a = malloc(20000);
+	b = malloc(20000);
+	srandom(36);
+	for (i = 0; i < 20000; i++)
+		a[i] = b[i] = 'a' + random() % 4;
+	for (i = 0; i < 600; i++)
+		b[random() % 20000] = 'e';
+	distance_stats_reset();
+	d = levenshtein_d(a, 20000, b, 20000);
+	distance_stats_get(&st);
+	printf("levenshtein_d after diagonal tries, %llu calls, %llu kernels ",
+	    st.calls[DISTANCE_LEVENSHTEIN],
+	    st.kernels[DISTANCE_KERNEL_DIAGONAL] +
+	    st.kernels[DISTANCE_KERNEL_BITPARALLEL]);
+	test_int_result(1, d > 256 && st.calls[DISTANCE_LEVENSHTEIN] == 1 &&
+	    st.kernels[DISTANCE_KERNEL_BITPARALLEL] == 1 &&
+	    st.kernels[DISTANCE_KERNEL_DIAGONAL] == 0 &&
+	    st.cells[DISTANCE_LEVENSHTEIN] > 20000ULL * 20000);
+	free(a);
+	free(b);
+
+	distance_stats_reset();
+	distance_stats_get(&st);
+	printf("calls after reset %llu ", st.calls[DISTANCE_LEVENSHTEIN]);
+	test_int_result(0, st.calls[DISTANCE_LEVENSHTEIN]);
+
+	return;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -364,7 +2134,28 @@ main(int argc, char *argv[])
 	test_mld();
 	test_jd();
 	test_md();
+	test_jaro();
+	test_qgram();
 	test_dd();
+	test_batch();
+	test_tok();
+	test_utf8();
+	test_search();
+	test_matcher();
+	test_align();
+	test_lv();
+	test_wavefront();
+	test_narrow();
+	test_filter();
+	test_corpus();
+	test_vptree();
+	test_cluster();
+	test_knng();
+	test_pool();
+	test_async();
+	test_stream();
+	test_cache();
+	test_stats();
 
 	printf("-----\nEND: %d of %d tests pass\n", num_pass, num_tests);
 
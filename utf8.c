@@ -0,0 +1,146 @@
+/*	$Id$ */
+
+/*
+   edit distances over UTF-8 text, counted in codepoints rather than
+   bytes, so "café" and "cafe" are one edit apart and not two.
+
+   both inputs are decoded once into a scratch buffer of 32 bit
+   codepoints and handed to the token kernels. most input is plain
+   ASCII, where bytes and codepoints are the same thing, so that is
+   checked first (16 bytes at a time with SSE2 where available) and
+   such input goes to the byte kernels without decoding.
+
+   bytes that are not part of a valid sequence (stray continuation
+   bytes, overlong forms, surrogates, truncated sequences) decode to
+   U+DC80 to U+DCFF, one per byte, as Python's surrogateescape does.
+   they compare equal only to the same invalid byte.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "distance.h"
+#include "distance_int.h"
+
+/* codepoints kept on the stack before falling back to malloc */
+#define UTF8_STACK	256
+
+/* 1 if none of the len bytes has the high bit set */
+static int
+utf8_is_ascii(const unsigned char *p, size_t len)
+{
+	size_t          i = 0;
+	uint64_t        w, acc = 0;
+
+#ifdef __SSE2__
+	__m128i         v = _mm_setzero_si128();
+
+	for (; i + 16 <= len; i += 16)
+		v = _mm_or_si128(v, _mm_loadu_si128((const __m128i *) (p + i)));
+	if (_mm_movemask_epi8(v) != 0)
+		return (0);
+#endif
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&w, p + i, 8);
+		acc |= w;
+	}
+	for (; i < len; i++)
+		acc |= p[i];
+	return ((acc & 0x8080808080808080ULL) == 0);
+}
+
+/*
+   decodes len bytes into out, which must have room for len codepoints.
+   returns the number of codepoints.
+ */
+static size_t
+utf8_decode(const unsigned char *p, size_t len, uint32_t *out)
+{
+	size_t          i = 0, n = 0, k, need;
+	uint32_t        c, lo;
+
+	while (i < len) {
+		c = p[i];
+		if (c < 0x80) {
+			out[n++] = c;
+			i++;
+			continue;
+		}
+		if (c >= 0xc2 && c <= 0xdf) {
+			need = 1;
+			c &= 0x1f;
+			lo = 0x80;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			need = 2;
+			c &= 0x0f;
+			lo = 0x800;
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			need = 3;
+			c &= 0x07;
+			lo = 0x10000;
+		} else
+			goto invalid;
+		if (need >= len - i)
+			goto invalid;
+		for (k = 1; k <= need; k++) {
+			if ((p[i + k] & 0xc0) != 0x80)
+				goto invalid;
+			c = (c << 6) | (p[i + k] & 0x3f);
+		}
+		if (c < lo || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+			goto invalid;
+		out[n++] = c;
+		i += need + 1;
+		continue;
+invalid:
+		out[n++] = 0xdc00 | p[i];
+		i++;
+	}
+	return (n);
+}
+
+/*
+   decodes both inputs into one buffer and runs the width 4 kernel f.
+   returns -1 if out of memory.
+ */
+static int
+utf8_run(int (*f)(const void *, size_t, const void *, size_t, size_t),
+    const void *d1, size_t len1, const void *d2, size_t len2)
+{
+	uint32_t        stack[2 * UTF8_STACK], *buf = stack;
+	size_t          n1, n2;
+	int             d;
+
+	if (len1 + len2 > 2 * UTF8_STACK) {
+		if ((buf = malloc((len1 + len2) * sizeof(uint32_t))) == NULL)
+			return (-1);
+		STATS_ADD(allocs, 1);
+	}
+	n1 = utf8_decode(d1, len1, buf);
+	n2 = utf8_decode(d2, len2, buf + n1);
+	d = f(buf, n1, buf + n1, n2, sizeof(uint32_t));
+	if (buf != stack)
+		free(buf);
+	return (d);
+}
+
+/* levenshtein distance between two UTF-8 strings, in codepoints */
+int
+levenshtein_utf8_d(const void *d1, size_t len1, const void *d2, size_t len2)
+{
+	if (utf8_is_ascii(d1, len1) && utf8_is_ascii(d2, len2))
+		return (levenshtein_d(d1, len1, d2, len2));
+	return (utf8_run(levenshtein_tok_d, d1, len1, d2, len2));
+}
+
+/* damerau distance between two UTF-8 strings, in codepoints */
+int
+damerau_utf8_d(const void *d1, size_t len1, const void *d2, size_t len2)
+{
+	if (utf8_is_ascii(d1, len1) && utf8_is_ascii(d2, len2))
+		return (damerau_tok_d(d1, len1, d2, len2, 1));
+	return (utf8_run(damerau_tok_d, d1, len1, d2, len2));
+}
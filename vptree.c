@@ -0,0 +1,448 @@
+/*	$Id$ */
+
+/*
+   P. N. Yianilos, "Data structures and algorithms for nearest neighbor
+   search in general metric spaces", Proceedings of the 4th ACM-SIAM
+   Symposium on Discrete Algorithms, 311-321, 1993.
+
+   a vantage point tree indexes inputs under any distance_fn. every
+   node picks one input as its vantage point and splits the rest at the
+   median distance mu from it: inside are those at most mu away,
+   outside those at least mu away. a query x away from the vantage
+   point looking for inputs within r of it only needs the inside if
+   x - r <= mu and the outside if x + r >= mu.
+
+   that is only exact when the function is a metric, as levenshtein_d,
+   hamming_d and qgram_d are. the fractional ones that kept a bk-tree
+   out are not, and may have inputs in range left out of an answer:
+   needleman_wunsch_d does not add up the costs along its first row
+   and column, so even unit costs break the triangle inequality,
+   minkowski_d is 0 for "ab" and "aab" at power 2, jaccard_d is 0 for
+   inputs that differ at every position, and bloom_d is not symmetric.
+   damerau_d (swaps are free) and the jaro, cosine and dice distances
+   are not metrics either.
+
+   the nodes live in one array in preorder, a node at i has its inside
+   at i + 1 and its outside right after the inside, so a subtree is a
+   contiguous run of the array and the tree needs no pointers. each
+   node keeps the input's pointer and length next to mu so a visit
+   touches one cache line.
+
+   a negative distance (hamming_d and jaccard_d on inputs of different
+   sizes) counts as infinitely far and is never a match, as elsewhere.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+/* below this many inputs a node's distances are not worth threads */
+#define VP_PAR_MIN	4096
+
+struct vp_node {
+	const void	*p;
+	size_t		 len;
+	size_t		 index;		/* position in the caller's list */
+	double		 mu;		/* median distance, inside <= mu */
+	size_t		 nin;		/* nodes in the inside subtree */
+};
+
+struct distance_vptree {
+	distance_fn	 f;
+	void		*arg;
+	struct vp_node	*nodes;
+	size_t		 n;
+};
+
+/* an input and its distance from the current vantage point */
+struct vp_item {
+	size_t		 index;
+	double		 d;
+};
+
+struct vp_build {
+	struct distance_vptree *t;
+	const void * const *b;
+	const size_t	*blen;
+	struct vp_item	*items;
+	size_t		 lo;		/* of the range being split */
+	size_t		 hi;
+	int		 nthreads;
+	int		 depth;		/* levels still built in parallel */
+};
+
+static __inline double
+vp_dist(const struct distance_vptree *t, const void *d1, size_t len1,
+    const void *d2, size_t len2)
+{
+	double          d;
+
+	d = t->f(d1, len1, d2, len2, t->arg);
+	return (d < 0 ? HUGE_VAL : d);
+}
+
+static void
+vp_dist_work(size_t lo, size_t hi, void *p)
+{
+	struct vp_build *vb = p;
+	struct vp_item *it;
+	size_t          i, v = vb->items[vb->lo].index;
+
+	for (i = vb->lo + 1 + lo; i < vb->lo + 1 + hi; i++) {
+		it = &vb->items[i];
+		it->d = vp_dist(vb->t, vb->b[v], vb->blen[v], vb->b[it->index],
+		    vb->blen[it->index]);
+	}
+}
+
+/* puts the k-th smallest distance of items[lo, hi) at k, quickselect */
+static void
+vp_select(struct vp_item *items, size_t lo, size_t hi, size_t k)
+{
+	struct vp_item  tmp;
+	size_t          i, j;
+	double          pivot;
+
+	while (hi - lo > 1) {
+		pivot = items[lo + (hi - lo) / 2].d;
+		i = lo;
+		j = hi - 1;
+		while (i <= j) {
+			while (items[i].d < pivot)
+				i++;
+			while (items[j].d > pivot)
+				j--;
+			if (i <= j) {
+				tmp = items[i];
+				items[i] = items[j];
+				items[j] = tmp;
+				i++;
+				if (j == 0)
+					break;
+				j--;
+			}
+		}
+		if (k <= j)
+			hi = j + 1;
+		else if (k >= i)
+			lo = i;
+		else
+			return;
+	}
+}
+
+static void vp_build(struct vp_build *vb);
+
+static void
+vp_build_work(size_t lo, size_t hi, void *p)
+{
+	struct vp_build *vb = p;
+	size_t          i;
+
+	for (i = lo; i < hi; i++)
+		vp_build(&vb[i]);
+}
+
+/*
+   builds the subtree of items[lo, hi) into nodes[lo, hi). the vantage
+   point is the middle input of the range, which is as good as a random
+   one for inputs in no particular order and keeps the tree the same
+   from one build to the next.
+ */
+static void
+vp_build(struct vp_build *vb)
+{
+	struct vp_build sub[2];
+	struct vp_node *nd;
+	struct vp_item  tmp, *items = vb->items;
+	size_t          lo = vb->lo, hi = vb->hi, mid, v;
+
+	while (lo < hi) {
+		tmp = items[lo];
+		items[lo] = items[lo + (hi - lo) / 2];
+		items[lo + (hi - lo) / 2] = tmp;
+		v = items[lo].index;
+		nd = &vb->t->nodes[lo];
+		nd->p = vb->b[v];
+		nd->len = vb->blen[v];
+		nd->index = v;
+		nd->mu = 0;
+		nd->nin = 0;
+		if (hi - lo == 1)
+			return;
+
+		vb->lo = lo;
+		vb->hi = hi;
+		if (hi - lo > VP_PAR_MIN && vb->nthreads != 1)
+			distance_parallel_for(hi - lo - 1, vb->nthreads,
+			    vp_dist_work, vb);
+		else
+			vp_dist_work(0, hi - lo - 1, vb);
+
+		/* the inside gets the closer half, the median included */
+		mid = lo + 1 + (hi - lo) / 2;
+		vp_select(items, lo + 1, hi, mid - 1);
+		nd->mu = items[mid - 1].d;
+		nd->nin = mid - lo - 1;
+
+		if (vb->depth > 0 && hi - lo > VP_PAR_MIN) {
+			sub[0] = sub[1] = *vb;
+			sub[0].lo = lo + 1;
+			sub[0].hi = mid;
+			sub[1].lo = mid;
+			sub[1].hi = hi;
+			sub[0].depth = sub[1].depth = vb->depth - 1;
+			sub[0].nthreads = sub[1].nthreads =
+			    vb->nthreads > 1 ? (vb->nthreads + 1) / 2 : 1;
+			distance_parallel_for(2, 2, vp_build_work, sub);
+			return;
+		}
+		/* recurse into the inside, loop on the outside */
+		sub[0] = *vb;
+		sub[0].lo = lo + 1;
+		sub[0].hi = mid;
+		vp_build(&sub[0]);
+		lo = mid;
+	}
+}
+
+void
+distance_vptree_free(struct distance_vptree *t)
+{
+	if (t == NULL)
+		return;
+	free(t->nodes);
+	free(t);
+}
+
+/*
+   indexes the n inputs b[i] under f, which should be a metric for the
+   queries to be exact. the distances of the build are spread over
+   nthreads threads, 0 means one per CPU. returns NULL if out of
+   memory or if cancelled.
+ */
+struct distance_vptree *
+distance_vptree_new(distance_fn f, void *arg, const void * const *b,
+    const size_t *blen, size_t n, int nthreads)
+{
+	struct distance_vptree *t;
+	struct vp_build vb;
+	size_t          i;
+
+	if (f == NULL)
+		return (NULL);
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		return (NULL);
+	STATS_ADD(allocs, 1);
+	t->f = f;
+	t->arg = arg;
+	t->n = n;
+	t->nodes = malloc((n + 1) * sizeof(struct vp_node));
+	vb.items = malloc((n + 1) * sizeof(struct vp_item));
+	if (t->nodes == NULL || vb.items == NULL) {
+		free(vb.items);
+		distance_vptree_free(t);
+		return (NULL);
+	}
+	STATS_ADD(allocs, 2);
+	for (i = 0; i < n; i++)
+		vb.items[i].index = i;
+
+	if (nthreads <= 0)
+		nthreads = distance_pool_size();
+	vb.t = t;
+	vb.b = b;
+	vb.blen = blen;
+	vb.lo = 0;
+	vb.hi = n;
+	vb.nthreads = nthreads;
+	for (vb.depth = 0; (1 << vb.depth) < nthreads && vb.depth < 8;
+	    vb.depth++)
+		;
+	vp_build(&vb);
+	free(vb.items);
+	if (distance_cancelled()) {
+		distance_vptree_free(t);
+		return (NULL);
+	}
+	return (t);
+}
+
+/* a query in progress */
+struct vp_query {
+	const struct distance_vptree *t;
+	const void	*q;
+	size_t		 qlen;
+	double		 r;		/* radius, shrinks for knn */
+	struct distance_match *out;
+	size_t		 nout;		/* room in out */
+	size_t		 nfound;
+	size_t		 k;		/* 0 for a radius query */
+	unsigned long long evaluated;
+};
+
+/* out[0, nfound) as a max heap on distance, for knn */
+static void
+vp_heap_push(struct vp_query *vq, size_t index, double d)
+{
+	struct distance_match *h = vq->out, tmp;
+	size_t          i, c, p;
+
+	if (vq->nfound < vq->k) {
+		i = vq->nfound++;
+		h[i].index = index;
+		h[i].distance = d;
+		for (; i > 0; i = p) {
+			p = (i - 1) / 2;
+			if (h[p].distance >= h[i].distance)
+				break;
+			tmp = h[p];
+			h[p] = h[i];
+			h[i] = tmp;
+		}
+	} else {
+		h[0].index = index;
+		h[0].distance = d;
+		for (i = 0; (c = 2 * i + 1) < vq->nfound; i = c) {
+			if (c + 1 < vq->nfound &&
+			    h[c + 1].distance > h[c].distance)
+				c++;
+			if (h[i].distance >= h[c].distance)
+				break;
+			tmp = h[c];
+			h[c] = h[i];
+			h[i] = tmp;
+		}
+	}
+	if (vq->nfound == vq->k)
+		vq->r = h[0].distance;
+}
+
+static void
+vp_search(struct vp_query *vq, size_t lo, size_t hi)
+{
+	const struct vp_node *nd;
+	double          x;
+	size_t          in, out;
+	int             inside;
+
+	while (lo < hi) {
+		nd = &vq->t->nodes[lo];
+		x = vp_dist(vq->t, vq->q, vq->qlen, nd->p, nd->len);
+		vq->evaluated++;
+		if (x <= vq->r && x != HUGE_VAL) {
+			if (vq->k > 0) {
+				if (vq->nfound < vq->k || x < vq->r)
+					vp_heap_push(vq, nd->index, x);
+			} else {
+				if (vq->nfound < vq->nout) {
+					vq->out[vq->nfound].index = nd->index;
+					vq->out[vq->nfound].distance = x;
+				}
+				vq->nfound++;
+			}
+		}
+		in = lo + 1;
+		out = lo + 1 + nd->nin;
+		/*
+		   the side the query falls in first, it shrinks r sooner.
+		   an infinite x and r would make x - r NaN and prune the
+		   inside, an infinite r rules nothing out.
+		 */
+		inside = vq->r == HUGE_VAL || x - vq->r <= nd->mu;
+		if (x <= nd->mu) {
+			if (in < out && inside)
+				vp_search(vq, in, out);
+			if (!(x + vq->r >= nd->mu))
+				return;
+			lo = out;
+		} else {
+			if (x + vq->r >= nd->mu)
+				vp_search(vq, out, hi);
+			if (!(in < out && inside))
+				return;
+			lo = in;
+			hi = out;
+		}
+	}
+}
+
+static int
+vp_match_cmp(const void *x, const void *y)
+{
+	const struct distance_match *m1 = x, *m2 = y;
+
+	if (m1->distance != m2->distance)
+		return (m1->distance < m2->distance ? -1 : 1);
+	return ((m1->index > m2->index) - (m1->index < m2->index));
+}
+
+static void
+vp_stats(const struct vp_query *vq, struct distance_vptree_stats *st)
+{
+	if (st == NULL)
+		return;
+	st->evaluated += vq->evaluated;
+	st->pruned += vq->t->n - vq->evaluated;
+}
+
+/*
+   finds every input within r of q. out has room for nout matches and
+   is filled closest first; the return value is the number of inputs
+   within r, which may be more than nout. if st is not NULL the
+   distances computed and the ones saved are added to it.
+ */
+int
+distance_vptree_radius(const struct distance_vptree *t, const void *q,
+    size_t qlen, double r, struct distance_match *out, size_t nout,
+    struct distance_vptree_stats *st)
+{
+	struct vp_query vq;
+
+	if (t == NULL || r < 0 || (out == NULL && nout > 0))
+		return (-1);
+	memset(&vq, 0, sizeof(vq));
+	vq.t = t;
+	vq.q = q;
+	vq.qlen = qlen;
+	vq.r = r;
+	vq.out = out;
+	vq.nout = nout;
+	vp_search(&vq, 0, t->n);
+	if (nout > 0)
+		qsort(out, min(vq.nfound, nout), sizeof(*out), vp_match_cmp);
+	vp_stats(&vq, st);
+	return ((int) vq.nfound);
+}
+
+/*
+   finds the (up to) k inputs closest to q, into out closest first.
+   returns the number found.
+ */
+int
+distance_vptree_knn(const struct distance_vptree *t, const void *q,
+    size_t qlen, size_t k, struct distance_match *out,
+    struct distance_vptree_stats *st)
+{
+	struct vp_query vq;
+
+	if (t == NULL || (out == NULL && k > 0))
+		return (-1);
+	if (k == 0)
+		return (0);
+	memset(&vq, 0, sizeof(vq));
+	vq.t = t;
+	vq.q = q;
+	vq.qlen = qlen;
+	vq.r = HUGE_VAL;
+	vq.out = out;
+	vq.nout = k;
+	vq.k = k;
+	vp_search(&vq, 0, t->n);
+	qsort(out, vq.nfound, sizeof(*out), vp_match_cmp);
+	vp_stats(&vq, st);
+	return ((int) vq.nfound);
+}
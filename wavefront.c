@@ -0,0 +1,332 @@
+/*	$Id$ */
+
+/*
+   one very long comparison on several threads. the matrix is cut into
+   tiles of a band of rows by a range of columns; a tile needs only the
+   bottom edge of the tile above it and the right edge of the tile to
+   its left, so all the tiles on one anti-diagonal of tiles can run at
+   once. the edges are the only thing the tiles share: each edge has a
+   single slot that is read by the next tile before that tile writes
+   its own edge to it, and tiles on the same anti-diagonal never touch
+   the same slot, so no locks are needed beyond the join at the end of
+   each anti-diagonal.
+
+   the levenshtein tiles run the bit-parallel kernel of myers.c, the
+   edges being the vertical delta words of a band and one horizontal
+   delta per column. the needleman-wunsch tiles are scalar, the edges
+   being rows and columns of costs plus the corner each tile shares
+   with the one above and to the left.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "distance.h"
+#include "distance_int.h"
+
+/* words of 64 rows in a levenshtein band */
+#define WF_BAND_WORDS	16
+/* rows in a needleman-wunsch band */
+#define WF_NW_ROWS	512
+/* fewest columns in a tile */
+#define WF_MIN_COLS	2048
+/* below this many cells one thread does it all */
+#define WF_MIN_CELLS	(1ULL << 22)
+
+struct wavefront {
+	size_t		 nb;		/* bands */
+	size_t		 nc;		/* column tiles */
+	size_t		 cols;		/* columns in a tile */
+	size_t		 diag;		/* the anti-diagonal being run */
+	void		 (*tile)(struct wavefront *, size_t, size_t);
+
+	/* levenshtein */
+	const unsigned char *s;
+	const unsigned char *t;
+	size_t		 n;		/* rows, len1 */
+	size_t		 m;		/* columns, len2 */
+	size_t		 nwords;
+	uint64_t	*pv;		/* [nwords], right edge of each band */
+	uint64_t	*mv;
+	signed char	*h;		/* [m], bottom edge of each column */
+	long long	*sum;		/* [nc], last band's deltas */
+
+	/* needleman-wunsch */
+	struct matrix	*mt;
+	double		*row;		/* [m + 1], bottom edge */
+	double		*col;		/* [n + 1], right edge */
+	double		*corner;	/* [nb + nc], by b - c */
+};
+
+static void
+wf_work(size_t lo, size_t hi, void *p)
+{
+	struct wavefront *wf = p;
+	size_t          k, b, c, first;
+
+	/* the k-th tile of the anti-diagonal, counted from the top */
+	first = wf->diag >= wf->nc ? wf->diag - wf->nc + 1 : 0;
+	for (k = lo; k < hi; k++) {
+		b = first + k;
+		c = wf->diag - b;
+		wf->tile(wf, b, c);
+	}
+}
+
+/* returns 0, or -1 if cancelled */
+static int
+wf_run(struct wavefront *wf, int nthreads)
+{
+	size_t          first, last;
+
+	for (wf->diag = 0; wf->diag < wf->nb + wf->nc - 1; wf->diag++) {
+		first = wf->diag >= wf->nc ? wf->diag - wf->nc + 1 : 0;
+		last = min(wf->diag, wf->nb - 1);
+		if (distance_parallel_for(last - first + 1, nthreads, wf_work,
+		    wf) == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+/* enough column tiles to keep every thread busy on each anti-diagonal */
+static size_t
+wf_cols(size_t m, int nthreads)
+{
+	size_t          cols;
+
+	cols = m / (4 * (size_t) nthreads);
+	return (max(cols, WF_MIN_COLS));
+}
+
+DISTANCE_CLONES
+static void
+lev_tile(struct wavefront *wf, size_t b, size_t c)
+{
+	uint64_t        peq[256][WF_BAND_WORDS], eq[WF_BAND_WORDS];
+	uint64_t        pv[WF_BAND_WORDS], mv[WF_BAND_WORDS], top, hbit;
+	size_t          w0, nw, r0, nr, i, j, j0, j1, w;
+	long long       sum = 0;
+	int             h, last;
+
+	w0 = b * WF_BAND_WORDS;
+	nw = min(WF_BAND_WORDS, wf->nwords - w0);
+	r0 = w0 * MYERS_WORD;
+	nr = min(nw * MYERS_WORD, wf->n - r0);
+	last = b == wf->nb - 1;
+	top = 1ULL << (MYERS_WORD - 1);
+	hbit = last ? 1ULL << ((wf->n - 1) % MYERS_WORD) : top;
+
+	/* the match masks of this band only, cheap next to the tile */
+	memset(peq, 0, sizeof(peq));
+	for (i = 0; i < nr; i++)
+		peq[wf->s[r0 + i]][i / MYERS_WORD] |= 1ULL << (i % MYERS_WORD);
+	memcpy(pv, wf->pv + w0, nw * sizeof(uint64_t));
+	memcpy(mv, wf->mv + w0, nw * sizeof(uint64_t));
+
+	j0 = c * wf->cols;
+	j1 = min(j0 + wf->cols, wf->m);
+	for (j = j0; j < j1; j++) {
+		memcpy(eq, peq[wf->t[j]], nw * sizeof(uint64_t));
+		h = wf->h[j];
+		for (w = 0; w + 1 < nw; w++)
+			h = myers_block(&pv[w], &mv[w], eq[w], h, top);
+		h = myers_block(&pv[w], &mv[w], eq[w], h, hbit);
+		wf->h[j] = h;
+		sum += h;
+	}
+
+	memcpy(wf->pv + w0, pv, nw * sizeof(uint64_t));
+	memcpy(wf->mv + w0, mv, nw * sizeof(uint64_t));
+	if (last)
+		wf->sum[c] = sum;
+}
+
+/*
+   levenshtein_d() on up to nthreads threads, 0 meaning one per CPU.
+   for multi-megabyte inputs; small ones are passed to levenshtein_d().
+ */
+int
+levenshtein_mt_d(const void *d1, size_t len1, const void *d2, size_t len2,
+    int nthreads)
+{
+	struct wavefront wf;
+	size_t          k, b, c;
+	long long       d;
+
+	if (nthreads <= 0)
+		nthreads = distance_pool_size();
+	if (nthreads == 1 || len1 == 0 || len2 == 0 ||
+	    (unsigned long long) len1 * len2 < WF_MIN_CELLS)
+		return (levenshtein_d(d1, len1, d2, len2));
+
+	/* nearly the same inputs are still best on the diagonals */
+	k = max(len1, len2) - min(len1, len2);
+	k = max(k, MYERS_WORD);
+	if (k <= max(len1, len2) / MYERS_WORD &&
+	    (d = lv_distance(d1, len1, d2, len2, k)) <= (long long) k) {
+		STATS_CALL(DISTANCE_LEVENSHTEIN, len1, len2,
+		    (unsigned long long) max(len1, len2) + d * d,
+		    DISTANCE_KERNEL_DIAGONAL);
+		return ((int) d);
+	}
+
+	memset(&wf, 0, sizeof(wf));
+	wf.s = d1;
+	wf.t = d2;
+	wf.n = len1;
+	wf.m = len2;
+	wf.nwords = (len1 + MYERS_WORD - 1) / MYERS_WORD;
+	wf.nb = (wf.nwords + WF_BAND_WORDS - 1) / WF_BAND_WORDS;
+	wf.cols = wf_cols(len2, nthreads);
+	wf.nc = (len2 + wf.cols - 1) / wf.cols;
+	wf.tile = lev_tile;
+	wf.pv = malloc(2 * wf.nwords * sizeof(uint64_t));
+	wf.h = malloc(len2);
+	wf.sum = calloc(wf.nc, sizeof(long long));
+	if (wf.pv == NULL || wf.h == NULL || wf.sum == NULL) {
+		free(wf.pv);
+		free(wf.h);
+		free(wf.sum);
+		return (-1);
+	}
+	STATS_ADD(allocs, 3);
+	STATS_CALL(DISTANCE_LEVENSHTEIN, len1, len2,
+	    (unsigned long long) len1 * len2, DISTANCE_KERNEL_BITPARALLEL);
+	wf.mv = wf.pv + wf.nwords;
+
+	/* column 0 counts up by one a row, row 0 by one a column */
+	for (b = 0; b < wf.nwords; b++) {
+		wf.pv[b] = ~0ULL;
+		wf.mv[b] = 0;
+	}
+	memset(wf.h, 1, len2);
+
+	if (wf_run(&wf, nthreads) == -1)
+		d = -1;
+	else
+		for (d = len1, c = 0; c < wf.nc; c++)
+			d += wf.sum[c];
+	free(wf.pv);
+	free(wf.h);
+	free(wf.sum);
+	return ((int) d);
+}
+
+/* the matrix has 255 entries per side, larger bytes share the last */
+#define WF_IDX(c)	((c) > 254 ? 254 : (c))
+
+/*
+   the first row and column as needleman_wunsch_d() fills them: from
+   the first byte of one input against a byte of the other, reading a
+   NUL past the end of the other input.
+ */
+static double
+nw_edge(const struct wavefront *wf, size_t i, size_t j)
+{
+	unsigned char   a, b;
+
+	if (i == 0 && j == 0)
+		return (0);
+	if (j == 0) {
+		a = wf->s[0];
+		b = i < wf->m ? wf->t[i] : 0;
+	} else {
+		a = j < wf->n ? wf->s[j] : 0;
+		b = wf->t[0];
+	}
+	return (wf->mt->insertion[WF_IDX(a)][WF_IDX(b)]);
+}
+
+DISTANCE_CLONES
+static void
+nw_tile(struct wavefront *wf, size_t b, size_t c)
+{
+	struct matrix  *mt = wf->mt;
+	double          diag, up, left, cost, ins, *row, *col;
+	size_t          i, j, i0, i1, j0, j1, slot;
+	unsigned char   from, to;
+
+	i0 = b * WF_NW_ROWS;
+	i1 = min(i0 + WF_NW_ROWS, wf->n);
+	j0 = c * wf->cols;
+	j1 = min(j0 + wf->cols, wf->m);
+	row = wf->row;
+	col = wf->col;
+	slot = b + wf->nc - 1 - c;
+
+	/* row[j] is the cell above (i, j), col[i] the cell left of it */
+	diag = b == 0 || c == 0 ? nw_edge(wf, i0, j0) : wf->corner[slot];
+	for (i = i0 + 1; i <= i1; i++) {
+		from = wf->s[i - 1];
+		left = col[i];
+		for (j = j0 + 1; j <= j1; j++) {
+			to = wf->t[j - 1];
+			up = row[j];
+			ins = mt->insertion[WF_IDX(from)][WF_IDX(to)];
+			cost = from == to ? 0 :
+			    mt->conversion[WF_IDX(from)][WF_IDX(to)];
+			left = min(up + ins, min(left + ins, diag + cost));
+			row[j] = left;
+			diag = up;
+		}
+		/* the next row starts below this one's left edge */
+		diag = col[i];
+		col[i] = left;
+	}
+	wf->corner[slot] = row[j1];
+}
+
+/*
+   needleman_wunsch_d() on up to nthreads threads, 0 meaning one per
+   CPU. bytes past the matrix share its last entry instead of reading
+   outside it.
+ */
+double
+needleman_wunsch_mt_d(const void *d1, size_t len1, const void *d2,
+    size_t len2, struct matrix *mt, int nthreads)
+{
+	struct wavefront wf;
+	size_t          i, j;
+	double          d;
+
+	if (nthreads <= 0)
+		nthreads = distance_pool_size();
+	if (nthreads == 1 || len1 == 0 || len2 == 0 ||
+	    (unsigned long long) len1 * len2 < WF_MIN_CELLS)
+		return (needleman_wunsch_d(d1, len1, d2, len2, mt));
+
+	memset(&wf, 0, sizeof(wf));
+	wf.s = d1;
+	wf.t = d2;
+	wf.n = len1;
+	wf.m = len2;
+	wf.mt = mt;
+	wf.nb = (len1 + WF_NW_ROWS - 1) / WF_NW_ROWS;
+	wf.cols = wf_cols(len2, nthreads);
+	wf.nc = (len2 + wf.cols - 1) / wf.cols;
+	wf.tile = nw_tile;
+	wf.row = malloc((len2 + 1) * sizeof(double));
+	wf.col = malloc((len1 + 1) * sizeof(double));
+	wf.corner = malloc((wf.nb + wf.nc) * sizeof(double));
+	if (wf.row == NULL || wf.col == NULL || wf.corner == NULL) {
+		free(wf.row);
+		free(wf.col);
+		free(wf.corner);
+		return (-1);
+	}
+	STATS_ADD(allocs, 3);
+	STATS_CALL(DISTANCE_NEEDLEMAN_WUNSCH, len1, len2,
+	    (unsigned long long) len1 * len2, DISTANCE_KERNEL_FULL);
+
+	for (j = 0; j <= len2; j++)
+		wf.row[j] = nw_edge(&wf, 0, j);
+	for (i = 0; i <= len1; i++)
+		wf.col[i] = nw_edge(&wf, i, 0);
+
+	d = wf_run(&wf, nthreads) == -1 ? -1 : wf.row[len2];
+	free(wf.row);
+	free(wf.col);
+	free(wf.corner);
+	return (d);
+}